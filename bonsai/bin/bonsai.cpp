@@ -19,6 +19,22 @@ using std::cout;
 using std::begin;
 using std::end;
 
+// args: dbpath, tax_path, inr1.fq, [inr2.fq]
+template<typename KmerType, typename MapType=typename kmer_traits<KmerType>::lca_type>
+void classify_with(char **args, std::FILE *ofp, int num_threads, int emit_all, int emit_fastq, int emit_kraken,
+                   bool canonicalize, int chunk_size, int per_set) {
+    using ClassifierType = ClassifierGeneric<score::Lex, KmerType, MapType>;
+    Database<typename ClassifierType::map_type> db(args[0]);
+    ClassifierType c(db.db_, db.s_, db.k_, db.k_, num_threads,
+                     emit_all, emit_fastq, emit_kraken, canonicalize);
+    LOG_INFO("Using the %s encoder.\n", fixed_encoder_name(c.enc_.fixed()));
+    const Taxonomy tax(args[1]);
+    // We can use args[3] for both single-end and paired-end mode since the argument at
+    // index argc is null when argc - optind == 3.
+    process_dataset(c, &tax, args[2], args[3],
+                    ofp, chunk_size, per_set);
+}
+
 int classify_main(int argc, char *argv[]) {
     int co, num_threads(1), emit_kraken(1), emit_fastq(0), emit_all(0), chunk_size(1 << 20), per_set(32);
     bool canonicalize(true);
@@ -61,18 +77,15 @@ int classify_main(int argc, char *argv[]) {
         case 3:  LOG_DEBUG("Processing in single-end mode.\n"); break;
         case 4:  LOG_DEBUG("Processing in paired-end mode.\n"); break;
     }
-    Database<khash_t(c)> db(argv[optind]);
     //reportDB<khash_t(c)>(&db, stderr);
     //for(auto &i: db._s) --i; // subtract by one since we'll re-subtract during construction.
-    ClassifierGeneric<score::Lex> c(db.db_, db.s_, db.k_, db.k_, num_threads,
-                                   emit_all, emit_fastq, emit_kraken, canonicalize);
-    khash_t(p) *taxmap(build_parent_map(argv[optind + 1]));
-    // We can use optind + 3 for both single-end and paired-end mode since the argument at
-    // index argc is null when argc - optind == 3.
-    process_dataset(c, taxmap, argv[optind + 2], argv[optind + 3],
-                    ofp, chunk_size, per_set);
+    if(database_is_mphf(argv[optind]))
+        classify_with<u64, MphfMap>(argv + optind, ofp, num_threads, emit_all, emit_fastq, emit_kraken, canonicalize, chunk_size, per_set);
+    else if(database_k(argv[optind]) > 32)
+        classify_with<u128>(argv + optind, ofp, num_threads, emit_all, emit_fastq, emit_kraken, canonicalize, chunk_size, per_set);
+    else
+        classify_with<u64>(argv + optind, ofp, num_threads, emit_all, emit_fastq, emit_kraken, canonicalize, chunk_size, per_set);
     if(ofp != stdout) std::fclose(ofp);
-    kh_destroy(p, taxmap);
     LOG_INFO("Successfully completed classify!\n");
     return EXIT_SUCCESS;
 }
@@ -144,13 +157,37 @@ int phase2_main(int argc, char *argv[]) {
     if(inpaths.empty()) LOG_EXIT("Need input files from command line or file. See usage.\n");
     LOG_DEBUG("Got paths\n");
     if(seq2taxpath.empty()) LOG_EXIT("seq2taxpath required for final database generation.");
+    if(k > 32) {
+        // 128-bit keys: lexicographic LCA databases only.
+        if(mode != score_scheme::LEX) LOG_EXIT("Only lexicographic LCA databases support k > 32.\n");
+        if(tax_path.empty()) RUNTIME_ERROR("Tax path required. [See -T option.]");
+        Spacer sp(k, wsz, sv);
+        LOG_INFO("About to estimate cardinality\n");
+        static constexpr unsigned np = 24;
+        // Count distinct k-mers, then scale by the expected density of window minimizers, 2 / (w - k + 2).
+        std::size_t hash_size(estimate_rolling_cardinality(inpaths, k, canon, num_threads, np));
+        if(wsz > k) hash_size = hash_size * 2 / (wsz - k + 2);
+        hash_size = cardinality_upper_bound(hash_size, np);
+        LOG_INFO("Allocating for up to %zu keys\n", hash_size);
+        const Taxonomy tax(tax_path.data());
+        Database<khash_t(c128)> phase2_map(sp);
+        phase2_map.db_ = wide_lca_map<score::Lex>(inpaths, &tax, seq2taxpath.data(), sp, num_threads, canon, hash_size);
+        phase2_map.write(dbpath.data(), write_fmt);
+        return EXIT_SUCCESS;
+    }
     if(score_scheme::LEX == mode || score_scheme::ENTROPY) {
         LOG_INFO("Final map will be written to %s\n", dbpath.data());
         Spacer sp(k, wsz, sv);
+        LOG_INFO("Using the %s encoder.\n", fixed_encoder_name(fixed_encoder(sp)));
         Database<khash_t(c)>  phase2_map(sp);
-        // Force using hll so that we can use __sync_bool_compare_and_swap to parallelize.
+        // Estimate the number of minimizers with the same window and scoring as the build, then pad by the sketch's
+        // error so that the table is allocated once. If this is exceeded, the table is grown in parallel.
         LOG_INFO("About to estimate cardinality\n");
-        std::size_t hash_size(estimate_cardinality<score::Lex>(inpaths, k, k, sv, canon, nullptr, num_threads, 24));
+        static constexpr unsigned np = 24;
+        std::size_t hash_size(score_scheme::LEX == mode ? estimate_cardinality<score::Lex>(inpaths, k, wsz, sv, canon, nullptr, num_threads, np)
+                                                        : estimate_cardinality<score::Entropy>(inpaths, k, wsz, sv, canon, nullptr, num_threads, np));
+        LOG_INFO("Estimated cardinality: %zu\n", hash_size);
+        hash_size = cardinality_upper_bound(hash_size, np);
 #if !NDEBUG
         {
             uint64_t sum = 0;
@@ -166,38 +203,192 @@ int phase2_main(int argc, char *argv[]) {
             assert(sum > hash_size || !std::fprintf(stderr, "sum: %" PRIu64". hash size: %zu\n", sum, hash_size));
         }
 #endif
-        LOG_INFO("Estimated cardinality: %zu\n", hash_size);
+        LOG_INFO("Allocating for up to %zu keys\n", hash_size);
         if(tax_path.empty()) RUNTIME_ERROR("Tax path required. [See -T option.]");
         LOG_INFO("Parent map bulding from %s\n", tax_path.data());
-        khash_t(p) *taxmap(build_parent_map(tax_path.data()));
+        const Taxonomy tax(tax_path.data());
         //LOG_INFO("I just feel like stopping this executable now for testing.\n");
         //goto fail;
-        phase2_map.db_ = score_scheme::LEX == mode ? lca_map<score::Lex>(inpaths, taxmap, seq2taxpath.data(), sp, num_threads, canon, hash_size)
-                                                   : lca_map<score::Entropy>(inpaths, taxmap, seq2taxpath.data(), sp, num_threads, canon, hash_size);
+        phase2_map.db_ = score_scheme::LEX == mode ? lca_map<score::Lex>(inpaths, &tax, seq2taxpath.data(), sp, num_threads, canon, hash_size)
+                                                   : lca_map<score::Entropy>(inpaths, &tax, seq2taxpath.data(), sp, num_threads, canon, hash_size);
         phase2_map.write(dbpath.data(), write_fmt);
         //fail:
-        kh_destroy(p, taxmap);
         return EXIT_SUCCESS;
     }
     LOG_INFO("Making minimized map\n");
     Database<khash_t(64)> phase1_map{Database<khash_t(64)>(dbpath.data())};
     Database<khash_t(c)>  phase2_map{phase1_map};
     Spacer sp(k, wsz, phase1_map.s_);
-    khash_t(p) *taxmap(tax_path.empty() ? nullptr: build_parent_map(tax_path.data()));
-    phase2_map.db_ = minimized_map<score::Hash>(inpaths, phase1_map.db_, seq2taxpath.data(), taxmap, sp, num_threads, start_size, canon);
+    std::unique_ptr<Taxonomy> tax(tax_path.empty() ? nullptr: new Taxonomy(tax_path.data()));
+    // Score from a compact read-only index and drop the phase 1 table before building the final map.
+    ScoreIndex index(phase1_map.db_, num_threads);
+    khash_destroy(phase1_map.db_);
+    phase1_map.db_ = nullptr;
+    phase2_map.db_ = minimized_map<score::Hash>(inpaths, index, seq2taxpath.data(), tax.get(), sp, num_threads, start_size, canon);
     std::string dbpath2 = argv[optind + 1];
     if(endswith(dbpath2, suf))     write_fmt = ZLIB;
     if(write_fmt && !endswith(dbpath2, ".gz"))
         dbpath2 += suf, LOG_INFO("Writing gzipped, but without a .gz suffix. Adding it.\n");
     // Write minimized map
     phase2_map.write(dbpath2.data(), write_fmt);
-    if(taxmap) kh_destroy(p, taxmap);
+    return EXIT_SUCCESS;
+}
+
+
+int update_main(int argc, char *argv[]) {
+    int c, mode(score_scheme::LEX), num_threads(1);
+    bool canon(true);
+    WRITE write_fmt = UNCOMPRESSED;
+    std::string tax_path, seq2taxpath, paths_file;
+    std::ios_base::sync_with_stdio(false);
+    if(argc < 4) {
+        usage:
+        std::fprintf(stderr, "Usage: %s <flags> <in.db> <out.path> <paths>\n"
+                             "Adds genomes to an existing database. k, w, and spacing are taken from the database.\n"
+                             "Flags:\n"
+                             "-p: Number of threads [1] (set to -1 to use all threads)\n"
+                             "-F: Load paths from file provided instead further arguments on the command-line.\n"
+                             "-e: Use entropy maximization. (Must match how the database was built.)\n"
+                             "-C: Do not canonicalize. (Must match how the database was built.)\n"
+                             "-T: Set tax_path. [Required]\n"
+                             "-M: Set seq2taxpath. [Required]\n"
+                             "-z: Write gzip-compressed.\n"
+                     , *argv);
+        std::exit(EXIT_FAILURE);
+    }
+    while((c = getopt(argc, argv, "CM:p:T:F:ezh?")) >= 0) {
+        switch(c) {
+            case 'C': canon = false; break;
+            case 'h': case '?': goto usage;
+            case 'p': num_threads = std::atoi(optarg); break;
+            case 'T': tax_path = optarg; break;
+            case 'M': seq2taxpath = optarg; break;
+            case 'F': paths_file = optarg; break;
+            case 'e': mode = score_scheme::ENTROPY; break;
+            case 'z': write_fmt = ZLIB; break;
+        }
+    }
+    if(argc - optind < 2 + paths_file.empty()) goto usage;
+    if(num_threads < 0) num_threads = std::thread::hardware_concurrency();
+    if(tax_path.empty()) LOG_EXIT("Tax path required. [See -T option.]\n");
+    if(seq2taxpath.empty()) LOG_EXIT("seq2taxpath required. [See -M option.]\n");
+    std::string dbpath = argv[optind + 1];
+    if(endswith(dbpath, ".gz"))     write_fmt = ZLIB;
+    if(write_fmt && !endswith(dbpath, ".gz"))
+        dbpath += ".gz", LOG_INFO("Writing gzipped, but without a .gz suffix. Adding it.\n");
+    std::vector<std::string> inpaths(paths_file.size() ? get_paths(paths_file.data())
+                                                       : std::vector<std::string>(argv + optind + 2, argv + argc));
+    if(inpaths.empty()) LOG_EXIT("Need input files from command line or file. See usage.\n");
+    if(database_is_mphf(argv[optind]))
+        LOG_EXIT("%s is a compacted (minimal perfect hash) database, which can't be updated. Update the database it was compacted from.\n", argv[optind]);
+    Database<khash_t(c)> db(argv[optind]);
+    Spacer sp(db.k_, db.w_, db.s_);
+    LOG_INFO("Loaded database with %zu keys. k: %u. w: %u.\n", kh_size(db.db_), db.k_, db.w_);
+    LOG_INFO("Using the %s encoder.\n", fixed_encoder_name(fixed_encoder(sp)));
+    // Upper bound on new keys: every minimizer in the new genomes. Overlap with the database only means less growth.
+    static constexpr unsigned np = 24;
+    const size_t nnew(cardinality_upper_bound(score_scheme::LEX == mode ? estimate_cardinality<score::Lex>(inpaths, db.k_, db.w_, db.s_, canon, nullptr, num_threads, np)
+                                                                        : estimate_cardinality<score::Entropy>(inpaths, db.k_, db.w_, db.s_, canon, nullptr, num_threads, np), np));
+    const Taxonomy tax(tax_path.data());
+    if(score_scheme::LEX == mode) lca_map_update<score::Lex>(db.db_, inpaths, &tax, seq2taxpath.data(), sp, num_threads, canon, nnew);
+    else                          lca_map_update<score::Entropy>(db.db_, inpaths, &tax, seq2taxpath.data(), sp, num_threads, canon, nnew);
+    db.write(dbpath.data(), write_fmt);
+    LOG_INFO("Updated database written to %s\n", dbpath.data());
+    return EXIT_SUCCESS;
+}
+
+
+int merge_main(int argc, char *argv[]) {
+    int c, num_threads(1);
+    WRITE write_fmt = UNCOMPRESSED;
+    std::string tax_path;
+    if(argc < 4) {
+        usage:
+        std::fprintf(stderr, "Usage: %s <flags> <out.path> <in1.db> <in2.db> [...]\n"
+                             "Combines databases built with the same k, w, and spacing into their LCA-union.\n"
+                             "Flags:\n"
+                             "-p: Number of threads [1] (set to -1 to use all threads)\n"
+                             "-T: Set tax_path. [Required]\n"
+                             "-z: Write gzip-compressed.\n"
+                     , *argv);
+        std::exit(EXIT_FAILURE);
+    }
+    while((c = getopt(argc, argv, "p:T:zh?")) >= 0) {
+        switch(c) {
+            case 'h': case '?': goto usage;
+            case 'p': num_threads = std::atoi(optarg); break;
+            case 'T': tax_path = optarg; break;
+            case 'z': write_fmt = ZLIB; break;
+        }
+    }
+    if(argc - optind < 3) goto usage;
+    if(num_threads < 0) num_threads = std::thread::hardware_concurrency();
+    if(tax_path.empty()) LOG_EXIT("Tax path required. [See -T option.]\n");
+    std::string dbpath = argv[optind];
+    if(endswith(dbpath, ".gz"))     write_fmt = ZLIB;
+    if(write_fmt && !endswith(dbpath, ".gz"))
+        dbpath += ".gz", LOG_INFO("Writing gzipped, but without a .gz suffix. Adding it.\n");
+    for(int i(optind + 1); i < argc; ++i)
+        if(database_is_mphf(argv[i]))
+            LOG_EXIT("%s is a compacted (minimal perfect hash) database, which can't be merged. Merge the databases it was compacted from.\n", argv[i]);
+    const Taxonomy tax(tax_path.data());
+    // Merge into the first database, loading the rest one at a time so only two are ever resident.
+    Database<khash_t(c)> out(argv[optind + 1]);
+    LOG_INFO("Loaded %s with %zu keys.\n", argv[optind + 1], kh_size(out.db_));
+    for(int i(optind + 2); i < argc; ++i) {
+        Database<khash_t(c)> db(argv[i]);
+        if(!out.compatible(db))
+            LOG_EXIT("Database %s (k = %u, w = %u, spacing = %s) does not match %s (k = %u, w = %u, spacing = %s).\n",
+                     argv[i], db.k_, db.w_, str(db.s_).data(), argv[optind + 1], out.k_, out.w_, str(out.s_).data());
+        LOG_INFO("Merging %s with %zu keys.\n", argv[i], kh_size(db.db_));
+        lca_merge(out.db_, db.db_, &tax, num_threads);
+    }
+    out.write(dbpath.data(), write_fmt);
+    LOG_INFO("Merged database with %zu keys written to %s\n", kh_size(out.db_), dbpath.data());
+    return EXIT_SUCCESS;
+}
+
+int compact_main(int argc, char *argv[]) {
+    int c, num_threads(1);
+    WRITE write_fmt = UNCOMPRESSED;
+    if(argc < 3) {
+        usage:
+        std::fprintf(stderr, "Usage: %s <flags> <in.db> <out.db>\n"
+                             "Converts a finished LCA database into a smaller, immutable minimal perfect hash database for classification.\n"
+                             "Flags:\n"
+                             "-p: Number of threads [1] (set to -1 to use all threads)\n"
+                             "-z: Write gzip-compressed.\n"
+                     , *argv);
+        std::exit(EXIT_FAILURE);
+    }
+    while((c = getopt(argc, argv, "p:zh?")) >= 0) {
+        switch(c) {
+            case 'h': case '?': goto usage;
+            case 'p': num_threads = std::atoi(optarg); break;
+            case 'z': write_fmt = ZLIB; break;
+        }
+    }
+    if(argc - optind != 2) goto usage;
+    if(num_threads < 0) num_threads = std::thread::hardware_concurrency();
+    if(database_is_mphf(argv[optind])) LOG_EXIT("%s is already a minimal perfect hash database.\n", argv[optind]);
+    if(database_k(argv[optind]) > 32) LOG_EXIT("Minimal perfect hash databases support k <= 32.\n");
+    std::string dbpath = argv[optind + 1];
+    if(endswith(dbpath, ".gz"))     write_fmt = ZLIB;
+    if(write_fmt && !endswith(dbpath, ".gz"))
+        dbpath += ".gz", LOG_INFO("Writing gzipped, but without a .gz suffix. Adding it.\n");
+    Database<khash_t(c)> in(argv[optind]);
+    Database<MphfMap> out(in, 1);
+    out.db_ = new MphfMap(in.db_, num_threads);
+    LOG_INFO("Compacted %zu keys from %zu bytes of khash to %zu bytes.\n", kh_size(in.db_),
+             size_t(kh_end(in.db_)) * (sizeof(*in.db_->keys) + sizeof(*in.db_->vals)) + __ac_fsize(kh_end(in.db_)) * sizeof(*in.db_->flags),
+             out.db_->bytes());
+    out.write(dbpath.data(), write_fmt);
     return EXIT_SUCCESS;
 }
 
 
 int phase1_main(int argc, char *argv[]) {
-    int c, taxmap_preparsed(0), use_hll(0), mode(score_scheme::LEX), wsz(-1), k(31), num_threads(1), sketch_size(24);
+    int c, taxmap_preparsed(0), use_hll(1), mode(score_scheme::LEX), wsz(-1), k(31), num_threads(1), sketch_size(24);
     bool canon(true);
     std::ios_base::sync_with_stdio(false);
     std::string spacing;
@@ -215,7 +406,8 @@ int phase1_main(int argc, char *argv[]) {
                      "between bases repeated the second integer number of times.\n"
                      "-S: Set HyperLogLog sketch size. For very large cardinalities, this may need to be increased for accuracy.\n"
                      "-t: Build for taxonomic minimizing.\n-f: Build for feature minimizing.\n"
-                     "-H: Estimate rather than count kmers exactly before building map.\n"
+                     "-E: Count kmers exactly rather than estimate them before building map. Stores every distinct kmer and reads input twice.\n"
+                     "-H: Estimate kmers with a HyperLogLog and size the map from its error bound. [Default]\n"
                      "-T: Path to taxonomy map to load, if you've preparsed it. Not really worth it, building from scratch is fast.\n"
                      "-d: Write out in database format version 1.\n"
                      , *argv);
@@ -224,7 +416,7 @@ int phase1_main(int argc, char *argv[]) {
     if("lca"s == argv[0])
         std::fprintf(stderr, "[W:%s] lca subcommand has been renamed phase1. "
                              "This has been deprecated and will be removed.\n", __func__);
-    while((c = getopt(argc, argv, "Cs:S:p:k:tfTHh?")) >= 0) {
+    while((c = getopt(argc, argv, "Cs:S:p:k:tfTEHh?")) >= 0) {
         switch(c) {
             case 'C': canon = false; break;
             case 'h': case '?': goto usage;
@@ -233,6 +425,7 @@ int phase1_main(int argc, char *argv[]) {
             case 's': spacing = optarg; break;
             case 'S': sketch_size = std::atoi(optarg); break;
             case 'T': taxmap_preparsed = 1; break;
+            case 'E': use_hll = 0; break;
             case 'H': use_hll = 1; break;
             case 't': mode = score_scheme::TAX_DEPTH; break;
             case 'f': mode = score_scheme::FEATURE_COUNT; break;
@@ -243,23 +436,26 @@ int phase1_main(int argc, char *argv[]) {
     if(wsz < 0) wsz = k;
     khash_t(p) *taxmap(taxmap_preparsed ? khash_load<khash_t(p)>(argv[optind + 1])
                                         : build_parent_map(argv[optind + 1]));
+    const Taxonomy tax(taxmap);
+    kh_destroy(p, taxmap);
     spvec_t sv(parse_spacing(spacing.data(), k));
     Spacer sp(k, wsz, sv);
+    LOG_INFO("Using the %s encoder.\n", fixed_encoder_name(fixed_encoder(sp)));
     std::vector<std::string> inpaths(argv + optind + 3, argv + argc);
-    std::size_t hash_size(use_hll ? estimate_cardinality<score::Lex>(inpaths, k, k, sv, canon, nullptr, num_threads, sketch_size): 1 << 16);
-    if(use_hll) LOG_INFO("Estimated number of elements: %zu\n", hash_size);
+    // Size the table once, either from an exact count or from an estimate padded by its error.
+    std::size_t hash_size(use_hll ? cardinality_upper_bound(estimate_cardinality<score::Lex>(inpaths, k, k, sv, canon, nullptr, num_threads, sketch_size), sketch_size)
+                                  : count_cardinality<score::Lex>(inpaths, k, k, sv, canon, nullptr, num_threads));
+    LOG_INFO("%s number of elements: %zu\n", use_hll ? "Estimated": "Exact", hash_size);
 
     if(mode == score_scheme::LEX) LOG_EXIT("No phase1 required for lexicographic. Use phase2 instead.\n");
     auto mapbuilder(mode == score_scheme::TAX_DEPTH ? taxdepth_map<score::Lex>
                                                     : ftct_map<score::Lex>);
-    Database<khash_t(64)> db(sp, 1, mapbuilder(inpaths, taxmap, argv[optind], sp, num_threads, canon, hash_size));
+    Database<khash_t(64)> db(sp, 1, mapbuilder(inpaths, &tax, argv[optind], sp, num_threads, canon, hash_size));
     for(auto &i: db.s_) {
         LOG_DEBUG("Decrementing value %i to %i\n", i, i - 1);
         --i;
     }
     db.write(argv[optind + 2]);
-
-    kh_destroy(p, taxmap);
     return EXIT_SUCCESS;
 }
 
@@ -271,12 +467,17 @@ int hist_main(int argc, char *argv[]) {
                              "Usage: bonsai %s <database.db> [outfile (omit to emit to stdout)]\n", *argv);
         std::exit(EXIT_FAILURE);
     }
-    Database<khash_t(c)> db(argv[1]);
-    khash_t(c) *map(db.db_);
     std::FILE *ofp(stdout);
     count::Counter<u32> counter;
+    if(database_is_mphf(argv[1])) {
+        Database<MphfMap> db(argv[1]);
+        db.db_->for_each_taxon([&](tax_t tax) {counter.add(tax);});
+    } else {
+        Database<khash_t(c)> db(argv[1]);
+        khash_t(c) *map(db.db_);
+        for(khiter_t ki(0); ki != kh_end(map); ++ki) if(kh_exist(map, ki)) counter.add(kh_val(map, ki));
+    }
     if(argc > 2) ofp = std::fopen(argv[2], "w");
-    for(khiter_t ki(0); ki != kh_end(map); ++ki) if(kh_exist(map, ki)) counter.add(kh_val(map, ki));
     auto &cmap(counter.get_map());
     using elcount = std::pair<tax_t, u32>;
     std::vector<elcount> structs;
@@ -289,7 +490,7 @@ int hist_main(int argc, char *argv[]) {
  }
 
 int err_main(int argc, char *argv[]) {
-    std::fprintf(stderr, "[bonsai:%s] No valid subcommand provided. Options: prebuild/p1/phase, build/p2/phase2, classify, metatree\n", BONSAI_VERSION);
+    std::fprintf(stderr, "[bonsai:%s] No valid subcommand provided. Options: prebuild/p1/phase, build/p2/phase2, update, merge, compact, classify, metatree\n", BONSAI_VERSION);
     return EXIT_FAILURE;
 }
 
@@ -358,13 +559,14 @@ int metatree_main(int argc, char *argv[]) {
     std::vector<std::string> inpaths(paths_file.size() ? get_paths(paths_file.data())
                                                        : std::vector<std::string>(argv + optind + 5, argv + argc));
     std::unordered_set<std::string> save;
+    const std::vector<tax_t> inpath_taxids(get_taxids(inpaths, name_hash, num_threads));
     for(size_t i(0); i < inpaths.size(); ++i) {
         const auto &path(inpaths[i]);
 #if !NDEBUG
         if((i % 500) == 0) LOG_DEBUG("At index %zu/%zu, save size is %zu\n", i, inpaths.size(), save.size());
 #endif
         tax_t id;
-        if((id = get_taxid(path.data(), name_hash)) != UINT32_C(-1)) {
+        if((id = inpath_taxids[i]) != UINT32_C(-1)) {
             if(accepted_pass(taxmap, accept_lcas, id)) {
                 save.insert(path), used_taxes.insert(id);
             }
@@ -391,7 +593,7 @@ int metatree_main(int argc, char *argv[]) {
     std::vector<tax_t> taxes(get_sorted_taxes(taxmap, argv[optind + 1]));
     taxes = vector_set_filter(taxes, used_taxes);
     std::cerr << "Got sorted taxes\n";
-    auto tx2desc_map(tax2desc_genome_map(tax2genome_map(name_hash, inpaths), taxmap, taxes, tax_depths));
+    auto tx2desc_map(tax2desc_genome_map(tax2genome_map(name_hash, inpaths, num_threads), taxmap, taxes, tax_depths));
 #if !NDEBUG
     for(const auto tax: taxes) assert(kh_get(p, taxmap, tax) != kh_end(taxmap));
     ks::string ks;
@@ -438,6 +640,9 @@ int main(int argc, char *argv[]) {
         {"phase2",   phase2_main},
         {"build",    phase2_main},
         {"p2",       phase2_main},
+        {"update",   update_main},
+        {"merge",    merge_main},
+        {"compact",  compact_main},
         {"lca",      phase1_main},
         {"hist",     hist_main},
         {"metatree", metatree_main},
@@ -1,5 +1,8 @@
 #pragma once
 #include "tx.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 namespace bns {
 
@@ -14,53 +17,236 @@ enum BitCmp {
 inline int veccmp_naive(const void *a, const void *b, size_t nbytes);
 #endif
 
-inline int veccmp(const void *a, const void *b, size_t nbytes) {
-#if __AVX2__
-    __m256i aentry, bentry;
-    const __m256i *pa = reinterpret_cast<const __m256i*>(a),
-                  *pb = reinterpret_cast<const __m256i*>(b);
-    size_t n255(nbytes >> 5), nlo(nbytes & 31u);
-    int aparent(1), bparent(1); // a could be parent of b, b could be parent of a.
-    while(n255--) {
-        aentry = _mm256_loadu_si256(pa++);
-        bentry = _mm256_loadu_si256(pb++);
-        bparent &= _mm256_testz_si256(aentry, ~bentry);
-        aparent &= _mm256_testz_si256(bentry, ~aentry);
+/*
+ * Kernels over bit patterns, nwords u64s each.
+ * veccmp_words gives the subset relation, stopping as soon as the patterns are known to be incomparable.
+ * bitstats fuses the relation with both popcounts and the bit difference (popcount of a ^ b) in one pass.
+ * popcnt_words is the one-pattern popcount used wherever nodes and patterns are scored.
+ * AVX-512 and AVX2 versions are compiled with target attributes and picked at runtime from the CPU's features,
+ * so they are used without building for -march=native.
+ */
+struct BitStats {
+    int      cmp_;  // BitCmp
+    unsigned popa_;
+    unsigned popb_;
+    unsigned diff_;
+};
+
+enum BitKernel: int {
+    SCALAR_KERNEL,
+    AVX2_KERNEL,
+    AVX512_KERNEL
+};
+
+namespace detail {
+// Indexed by (aparent << 1) | bparent, where aparent means b has no bits outside of a.
+static constexpr u8 CMP_CODES[] {BitCmp::INCOMPARABLE, BitCmp::SECOND_PARENT, BitCmp::FIRST_PARENT, BitCmp::EQUAL};
+
+inline int veccmp_scalar(const u64 *a, const u64 *b, size_t n) {
+    int aparent(1), bparent(1);
+    for(size_t i(0); i < n && (aparent | bparent); ++i) {
+        bparent &= !(a[i] & ~b[i]);
+        aparent &= !(b[i] & ~a[i]);
+    }
+    return CMP_CODES[(aparent << 1) | bparent];
+}
+inline BitStats bitstats_scalar(const u64 *a, const u64 *b, size_t n) {
+    u64 anotb(0), bnota(0);
+    unsigned popa(0), popb(0), diff(0);
+    for(size_t i(0); i < n; ++i) {
+        anotb |= a[i] & ~b[i], bnota |= b[i] & ~a[i];
+        popa += __builtin_popcountll(a[i]), popb += __builtin_popcountll(b[i]), diff += __builtin_popcountll(a[i] ^ b[i]);
+    }
+    return BitStats{CMP_CODES[(!bnota << 1) | !anotb], popa, popb, diff};
+}
+INLINE unsigned popcnt_scalar(const u64 *a, size_t n) {
+    unsigned ret(0);
+    for(size_t i(0); i < n; ret += __builtin_popcountll(a[i++]));
+    return ret;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+inline int veccmp_avx2(const u64 *a, const u64 *b, size_t n) {
+    int aparent(1), bparent(1);
+    size_t i(0);
+    for(; i + 4 <= n; i += 4) {
+        const __m256i va(_mm256_loadu_si256((const __m256i *)(a + i))), vb(_mm256_loadu_si256((const __m256i *)(b + i)));
+        bparent &= _mm256_testc_si256(vb, va);
+        aparent &= _mm256_testc_si256(va, vb);
         if((aparent | bparent) == 0) return BitCmp::INCOMPARABLE;
     }
-#elif __SSE2__
-    __m128i aentry, bentry;
-    const __m128i *pa = reinterpret_cast<const __m128i*>(a),
-                  *pb = reinterpret_cast<const __m128i*>(b);
-    size_t n127(nbytes >> 4), nlo(nbytes & 15u);
-    int aparent(1), bparent(1); // a could be parent of b, b could be parent of a.
-    while(n127--) {
-        aentry = _mm_loadu_si128(pa++);
-        bentry = _mm_loadu_si128(pb++);
-        bparent &= _mm_testz_si128(aentry, ~bentry);
-        aparent &= _mm_testz_si128(bentry, ~aentry);
-        if((aparent == 0) & (bparent == 0)) return BitCmp::INCOMPARABLE;
-    }
-#else
-    size_t n64(nbytes >> 3), nlo(nbytes & 7u);
-    const u64 *pa((const u64 *)a), *pb((const u64 *)b);
-    while(n64--) {
-        bparent &= !(*pa & (~*pb));
-        aparent &= !(*pb & (~*pa));
-        if((aparent == 0) & (bparent == 0)) return BitCmp::INCOMPARABLE;
-        ++pa, ++pb;
+    for(; i < n; ++i) {
+        bparent &= !(a[i] & ~b[i]);
+        aparent &= !(b[i] & ~a[i]);
+    }
+    return CMP_CODES[(aparent << 1) | bparent];
+}
+// Tails are handled with masked loads, so there is no scalar cleanup loop.
+__attribute__((target("avx512f")))
+inline int veccmp_avx512(const u64 *a, const u64 *b, size_t n) {
+    int aparent(1), bparent(1);
+    for(size_t i(0); i < n; i += 8) {
+        const __mmask8 mask(n - i >= 8 ? 0xFFu: (1u << (n - i)) - 1);
+        const __m512i va(_mm512_maskz_loadu_epi64(mask, a + i)), vb(_mm512_maskz_loadu_epi64(mask, b + i));
+        bparent &= !_mm512_test_epi64_mask(va, _mm512_andnot_si512(vb, va));
+        aparent &= !_mm512_test_epi64_mask(vb, _mm512_andnot_si512(va, vb));
+        if((aparent | bparent) == 0) return BitCmp::INCOMPARABLE;
+    }
+    return CMP_CODES[(aparent << 1) | bparent];
+}
+// Per-64-bit-lane popcounts by nibble lookup, as in Mula et al., since AVX2 has no vector popcount.
+__attribute__((target("avx2")))
+inline __m256i popcnt256(__m256i v) {
+    const __m256i lut(_mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+    const __m256i low(_mm256_set1_epi8(0x0f));
+    const __m256i counts(_mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(v, low)),
+                                         _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low))));
+    return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+__attribute__((target("avx2")))
+inline u64 hsum256(__m256i v) {
+    const __m128i sum(_mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+    return _mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1);
+}
+__attribute__((target("avx2,popcnt")))
+inline BitStats bitstats_avx2(const u64 *a, const u64 *b, size_t n) {
+    __m256i popa(_mm256_setzero_si256()), popb(popa), diff(popa), anotb(popa), bnota(popa);
+    size_t i(0);
+    for(; i + 4 <= n; i += 4) {
+        const __m256i va(_mm256_loadu_si256((const __m256i *)(a + i))), vb(_mm256_loadu_si256((const __m256i *)(b + i)));
+        anotb = _mm256_or_si256(anotb, _mm256_andnot_si256(vb, va));
+        bnota = _mm256_or_si256(bnota, _mm256_andnot_si256(va, vb));
+        popa = _mm256_add_epi64(popa, popcnt256(va));
+        popb = _mm256_add_epi64(popb, popcnt256(vb));
+        diff = _mm256_add_epi64(diff, popcnt256(_mm256_xor_si256(va, vb)));
+    }
+    int aparent(_mm256_testz_si256(bnota, bnota)), bparent(_mm256_testz_si256(anotb, anotb));
+    BitStats ret{0, unsigned(hsum256(popa)), unsigned(hsum256(popb)), unsigned(hsum256(diff))};
+    for(; i < n; ++i) {
+        bparent &= !(a[i] & ~b[i]), aparent &= !(b[i] & ~a[i]);
+        ret.popa_ += __builtin_popcountll(a[i]), ret.popb_ += __builtin_popcountll(b[i]), ret.diff_ += __builtin_popcountll(a[i] ^ b[i]);
+    }
+    ret.cmp_ = CMP_CODES[(aparent << 1) | bparent];
+    return ret;
+}
+__attribute__((target("avx2,popcnt")))
+inline unsigned popcnt_avx2(const u64 *a, size_t n) {
+    __m256i sum(_mm256_setzero_si256());
+    size_t i(0);
+    for(; i + 4 <= n; i += 4) sum = _mm256_add_epi64(sum, popcnt256(_mm256_loadu_si256((const __m256i *)(a + i))));
+    unsigned ret(hsum256(sum));
+    for(; i < n; ret += __builtin_popcountll(a[i++]));
+    return ret;
+}
+__attribute__((target("avx512f,avx512vpopcntdq")))
+inline BitStats bitstats_avx512(const u64 *a, const u64 *b, size_t n) {
+    __m512i popa(_mm512_setzero_si512()), popb(popa), diff(popa), anotb(popa), bnota(popa);
+    for(size_t i(0); i < n; i += 8) {
+        const __mmask8 mask(n - i >= 8 ? 0xFFu: (1u << (n - i)) - 1);
+        const __m512i va(_mm512_maskz_loadu_epi64(mask, a + i)), vb(_mm512_maskz_loadu_epi64(mask, b + i));
+        anotb = _mm512_or_si512(anotb, _mm512_andnot_si512(vb, va));
+        bnota = _mm512_or_si512(bnota, _mm512_andnot_si512(va, vb));
+        popa = _mm512_add_epi64(popa, _mm512_popcnt_epi64(va));
+        popb = _mm512_add_epi64(popb, _mm512_popcnt_epi64(vb));
+        diff = _mm512_add_epi64(diff, _mm512_popcnt_epi64(_mm512_xor_si512(va, vb)));
+    }
+    const int aparent(!_mm512_test_epi64_mask(bnota, bnota)), bparent(!_mm512_test_epi64_mask(anotb, anotb));
+    return BitStats{CMP_CODES[(aparent << 1) | bparent], unsigned(_mm512_reduce_add_epi64(popa)),
+                    unsigned(_mm512_reduce_add_epi64(popb)), unsigned(_mm512_reduce_add_epi64(diff))};
+}
+__attribute__((target("avx512f,avx512vpopcntdq")))
+inline unsigned popcnt_avx512(const u64 *a, size_t n) {
+    __m512i sum(_mm512_setzero_si512());
+    for(size_t i(0); i < n; i += 8) {
+        const __mmask8 mask(n - i >= 8 ? 0xFFu: (1u << (n - i)) - 1);
+        sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(_mm512_maskz_loadu_epi64(mask, a + i)));
+    }
+    return _mm512_reduce_add_epi64(sum);
+}
+#endif
+} // namespace detail
+
+// Each kernel family checks exactly the features its versions are compiled for:
+// the subset kernels use no popcount, while bitstats and popcnt_words need POPCNT (AVX2) or VPOPCNTDQ (AVX-512).
+inline bool veccmp_kernel_supported(BitKernel kernel) {
+    switch(kernel) {
+        case SCALAR_KERNEL: return true;
+#if defined(__x86_64__) || defined(__i386__)
+        case AVX2_KERNEL:   return __builtin_cpu_supports("avx2");
+        case AVX512_KERNEL: return __builtin_cpu_supports("avx512f");
+#endif
+        default: return false;
     }
+}
+inline bool popcnt_kernel_supported(BitKernel kernel) {
+    switch(kernel) {
+        case SCALAR_KERNEL: return true;
+#if defined(__x86_64__) || defined(__i386__)
+        case AVX2_KERNEL:   return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+        case AVX512_KERNEL: return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq");
 #endif
-    u8 *eba(const_cast<u8 *>(reinterpret_cast<const u8 *>(pa))), *ebb(const_cast<u8 *>(reinterpret_cast<const u8 *>(pb)));
-    while(nlo--) {
-        bparent &= !(*eba & (~*ebb));
-        aparent &= !(*ebb & (~*eba));
-        if((aparent == 0) & (bparent == 0)) return BitCmp::INCOMPARABLE;
-        ++eba, ++ebb;
+        default: return false;
     }
-    static const u8 retcodes[] {BitCmp::INCOMPARABLE, BitCmp::SECOND_PARENT, BitCmp::FIRST_PARENT, BitCmp::EQUAL};
-    assert(retcodes[(aparent << 1) | bparent] == veccmp_naive(a, b, nbytes));
-    return retcodes[(aparent << 1) | bparent];
+}
+// Widest kernels the running CPU supports, checked once.
+inline BitKernel best_veccmp_kernel() {
+    static const BitKernel ret(veccmp_kernel_supported(AVX512_KERNEL) ? AVX512_KERNEL
+                               : veccmp_kernel_supported(AVX2_KERNEL) ? AVX2_KERNEL: SCALAR_KERNEL);
+    return ret;
+}
+inline BitKernel best_popcnt_kernel() {
+    static const BitKernel ret(popcnt_kernel_supported(AVX512_KERNEL) ? AVX512_KERNEL
+                               : popcnt_kernel_supported(AVX2_KERNEL) ? AVX2_KERNEL: SCALAR_KERNEL);
+    return ret;
+}
+
+inline int veccmp_words(const u64 *a, const u64 *b, size_t nwords, BitKernel kernel=best_veccmp_kernel()) {
+    switch(kernel) {
+#if defined(__x86_64__) || defined(__i386__)
+        case AVX512_KERNEL: return detail::veccmp_avx512(a, b, nwords);
+        case AVX2_KERNEL:   return detail::veccmp_avx2(a, b, nwords);
+#endif
+        default:            return detail::veccmp_scalar(a, b, nwords);
+    }
+}
+inline BitStats bitstats(const u64 *a, const u64 *b, size_t nwords, BitKernel kernel=best_popcnt_kernel()) {
+    switch(kernel) {
+#if defined(__x86_64__) || defined(__i386__)
+        case AVX512_KERNEL: return detail::bitstats_avx512(a, b, nwords);
+        case AVX2_KERNEL:   return detail::bitstats_avx2(a, b, nwords);
+#endif
+        default:            return detail::bitstats_scalar(a, b, nwords);
+    }
+}
+// Most patterns are a word or two wide (a bit per taxon in a subtree): too narrow for a dispatched vector call to pay off.
+static constexpr size_t POPCNT_DISPATCH_WORDS = 8;
+INLINE unsigned popcnt_words(const u64 *a, size_t nwords, BitKernel kernel=best_popcnt_kernel()) {
+    if(nwords < POPCNT_DISPATCH_WORDS) return detail::popcnt_scalar(a, nwords);
+    switch(kernel) {
+#if defined(__x86_64__) || defined(__i386__)
+        case AVX512_KERNEL: return detail::popcnt_avx512(a, nwords);
+        case AVX2_KERNEL:   return detail::popcnt_avx2(a, nwords);
+#endif
+        default:            return detail::popcnt_scalar(a, nwords);
+    }
+}
+
+inline int veccmp(const void *a, const void *b, size_t nbytes) {
+    const u64 *pa((const u64 *)a), *pb((const u64 *)b);
+    int ret(veccmp_words(pa, pb, nbytes >> 3));
+    if(nbytes & 7u && ret != BitCmp::INCOMPARABLE) {
+        int aparent(ret == BitCmp::FIRST_PARENT || ret == BitCmp::EQUAL), bparent(ret == BitCmp::SECOND_PARENT || ret == BitCmp::EQUAL);
+        const u8 *eba((const u8 *)(pa + (nbytes >> 3))), *ebb((const u8 *)(pb + (nbytes >> 3)));
+        for(size_t nlo(nbytes & 7u); nlo--; ++eba, ++ebb) {
+            bparent &= !(*eba & (~*ebb));
+            aparent &= !(*ebb & (~*eba));
+        }
+        ret = detail::CMP_CODES[(aparent << 1) | bparent];
+    }
+    assert(ret == veccmp_naive(a, b, nbytes));
+    return ret;
 }
 #if !NDEBUG
 inline int veccmp_naive(const void *a, const void *b, size_t nbytes) {
@@ -95,5 +281,12 @@ int veccmp(const Container1 &a, const Container2 &b) {
     return veccmp(a.data(), b.data(), a.size() * sizeof(T));
 }
 
+template<typename Container>
+BitStats bitstats(const Container &a, const Container &b) {
+    static_assert(sizeof(a[0]) == sizeof(u64), "bitstats works on containers of 64-bit words.");
+    if(unlikely(a.size() != b.size())) LOG_EXIT("a and b must be the same size! %zu, %zu\n", static_cast<size_t>(a.size()), static_cast<size_t>(b.size()));
+    return bitstats((const u64 *)a.data(), (const u64 *)b.data(), a.size());
+}
+
 
 } // namespace bns
@@ -4,6 +4,120 @@
 
 namespace bns {
 
+INLINE unsigned bits_popcnt(const u64 *bits, unsigned words) {return popcnt_words(bits, words);}
+
+/*
+ * SubsetIndex:
+ * Finds, for each of n distinct patterns, the patterns that are strict supersets of it, without comparing every pair.
+ * Patterns are sorted by popcount, so strict supersets of a pattern can only lie in the suffix with larger popcounts.
+ * The index is bitsliced: for every bit, a bitset over sorted positions of the patterns having that bit.
+ * A pattern's supersets are the AND of its bits' columns over that suffix, taken rarest column first
+ * so that the candidate set empties (and the query stops) as early as possible.
+ */
+class SubsetIndex {
+    std::vector<u32> order_;    // Sorted position -> pattern index.
+    std::vector<u32> popcnts_;  // Pattern index -> popcount.
+    std::vector<u64> columns_;  // Bit b -> nwords_ words at columns_[b * nwords_], one bit per sorted position.
+    std::vector<u32> colcnts_;  // Bit b -> number of patterns with bit b set.
+    std::vector<const u64 *> patterns_;
+    const unsigned words_;
+    size_t         nwords_;
+
+public:
+    SubsetIndex(const std::vector<const u64 *> &patterns, unsigned words):
+        order_(patterns.size()), popcnts_(patterns.size()), patterns_(patterns), words_(words), nwords_((patterns.size() + 63) >> 6)
+    {
+        if(patterns.size() >= std::numeric_limits<u32>::max()) RUNTIME_ERROR("Too many patterns to index.");
+        const unsigned nbits(words << 6);
+        for(u32 i(0); i < patterns.size(); ++i) popcnts_[i] = bits_popcnt(patterns[i], words), order_[i] = i;
+        std::stable_sort(order_.begin(), order_.end(), [&](u32 a, u32 b) {return popcnts_[a] < popcnts_[b];});
+        columns_.assign(size_t(nbits) * nwords_, 0);
+        colcnts_.assign(nbits, 0);
+        for(size_t pos(0); pos < patterns.size(); ++pos) {
+            const u64 *bits(patterns[order_[pos]]);
+            for(unsigned w(0); w < words; ++w)
+                for(u64 v(bits[w]); v; v &= v - 1) {
+                    const unsigned b((w << 6) + __builtin_ctzll(v));
+                    columns_[b * nwords_ + (pos >> 6)] |= UINT64_C(1) << (pos & 63);
+                    ++colcnts_[b];
+                }
+        }
+    }
+    size_t size() const {return order_.size();}
+    // Calls fn(j) for every pattern index j whose pattern is a strict subset of bits (words_ wide).
+    // Candidates are those with smaller popcount, narrowed by removing each column of a bit not in bits.
+    template<typename Fn>
+    void for_each_subset(const u64 *bits, const Fn &fn) const {
+        static thread_local std::vector<u32> others;
+        static thread_local std::vector<u64> acc;
+        const u32 pc(bits_popcnt(bits, words_));
+        const size_t end(std::lower_bound(order_.begin(), order_.end(), pc,
+                                          [&](u32 j, u32 x) {return popcnts_[j] < x;}) - order_.begin());
+        if(end == 0) return;
+        others.clear();
+        for(u32 b(0); b < words_ << 6; ++b)
+            if(colcnts_[b] && !(bits[b >> 6] >> (b & 63) & 1)) others.push_back(b);
+        std::sort(others.begin(), others.end(), [&](u32 a, u32 b) {return colcnts_[a] > colcnts_[b];});
+        acc.assign((end + 63) >> 6, UINT64_C(-1));
+        if(end & 63) acc.back() = (UINT64_C(1) << (end & 63)) - 1;
+        for(const u32 b: others) {
+            const u64 *col(&columns_[b * nwords_]);
+            u64 any(0);
+            for(size_t w(0); w < acc.size(); ++w) any |= (acc[w] &= ~col[w]);
+            if(!any) return;
+        }
+        for(size_t w(0); w < acc.size(); ++w)
+            for(u64 v(acc[w]); v; v &= v - 1)
+                fn(order_[(w << 6) + __builtin_ctzll(v)]);
+    }
+    // Calls fn(j) for every pattern index j whose pattern is a strict superset of pattern i.
+    template<typename Fn>
+    void for_each_superset(u32 i, const Fn &fn) const {
+        static thread_local std::vector<u32> bits;
+        static thread_local std::vector<u64> acc;
+        const size_t start(std::upper_bound(order_.begin(), order_.end(), popcnts_[i],
+                                            [&](u32 pc, u32 j) {return pc < popcnts_[j];}) - order_.begin());
+        if(start >= order_.size()) return;
+        const size_t wbeg(start >> 6);
+        bits.clear();
+        for(unsigned w(0); w < words_; ++w)
+            for(u64 v(patterns_[i][w]); v; v &= v - 1) bits.push_back((w << 6) + __builtin_ctzll(v));
+        std::sort(bits.begin(), bits.end(), [&](u32 a, u32 b) {return colcnts_[a] < colcnts_[b];});
+        acc.assign(nwords_ - wbeg, UINT64_C(-1));
+        acc[0] &= UINT64_C(-1) << (start & 63);
+        if(order_.size() & 63) acc.back() &= (UINT64_C(1) << (order_.size() & 63)) - 1;
+        for(const u32 b: bits) {
+            const u64 *col(&columns_[b * nwords_ + wbeg]);
+            u64 any(0);
+            for(size_t w(0); w < acc.size(); ++w) any |= (acc[w] &= col[w]);
+            if(!any) return;
+        }
+        for(size_t w(0); w < acc.size(); ++w)
+            for(u64 v(acc[w]); v; v &= v - 1)
+                fn(order_[((wbeg + w) << 6) + __builtin_ctzll(v)]);
+    }
+};
+
+namespace detail {
+struct superset_helper {
+    const SubsetIndex              &index_;
+    std::vector<std::vector<u32>> &supersets_;
+};
+inline void superset_fn(void *data_, long index, int tid) {
+    auto &h(*(superset_helper *)data_);
+    h.index_.for_each_superset(index, [&](u32 j) {h.supersets_[index].push_back(j);});
+}
+} // namespace detail
+
+// Indices of the strict supersets of each pattern. Patterns must be distinct and words wide.
+inline std::vector<std::vector<u32>> strict_supersets(const std::vector<const u64 *> &patterns, unsigned words, int num_threads=-1) {
+    if(num_threads <= 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+    const SubsetIndex index(patterns, words);
+    std::vector<std::vector<u32>> ret(patterns.size());
+    detail::superset_helper helper{index, ret};
+    kt_for(num_threads, &detail::superset_fn, &helper, patterns.size());
+    return ret;
+}
 
 template<typename T>
 class AdjacencyList {
@@ -22,116 +136,283 @@ public:
         REVERSE = 1
     };
 
-    AdjacencyList(const count::Counter<T> &counts, bool reverse=false):
-        m_(0), nelem_(counts.get_nelem()), is_reverse_(reverse) {
-        // O(n^2), or n choose 2 operations.
-        std::set<T*> ptrs;
-        const auto &map(counts.get_map());
-        LOG_INFO("Trying to do stuff.\n");
-        if(reverse == false) {
-            for(auto i(map.cbegin()), ie(map.cend()); i != ie; ++i) {
-                ++m_;
-                auto j(i);
-                while(++j != map.end()) {
-                    switch(veccmp(i->first, j->first)) {
-                        case 1:
-                            map_[&i->first].push_back(&j->first); // i is a strict parent of j.
-                            break;
-                        case 2:
-                            map_[&j->first].push_back(&i->first); // j is a strict parent of i.
-                            break;
-                    }
-                }
-            }
-        } else {
-            for(auto i(map.cbegin()), ie(map.cend()); i != ie; ++i) {
-                ++m_;
-                auto j(i);
-                while(++j != map.end()) {
-                    switch(veccmp(i->first, j->first)) {
-                        case 1:
-                            map_[&j->first].push_back(&i->first); // j is a strict parent of i.
-                            break;
-                        case 2:
-                            map_[&i->first].push_back(&j->first); // i is a strict parent of j.
-                            break;
-                    }
-                }
-            }
+    // Forward lists map each pattern to its strict subsets; reverse lists map it to its strict supersets.
+    AdjacencyList(const count::Counter<T> &counts, bool reverse=false, int num_threads=-1):
+        m_(counts.size()), nelem_(counts.get_nelem()), is_reverse_(reverse) {
+        std::vector<const T *> elems;
+        std::vector<const u64 *> patterns;
+        elems.reserve(counts.size()), patterns.reserve(counts.size());
+        for(const auto &pair: counts.get_map()) {
+            if(elems.size() && pair.first.size() != elems[0]->size())
+                RUNTIME_ERROR(ks::sprintf("Patterns must all be the same size! %zu, %zu", pair.first.size(), elems[0]->size()).data());
+            elems.push_back(&pair.first), patterns.push_back(pair.first.data());
         }
-        LOG_DEBUG("About to shrink_to_fit.\n");
+        if(elems.empty()) return;
+        const auto supersets(strict_supersets(patterns, elems[0]->size(), num_threads));
+        for(u32 i(0); i < elems.size(); ++i)
+            for(const u32 j: supersets[i]) {
+                if(reverse) map_[elems[i]].push_back(elems[j]); // j is a strict parent of i.
+                else        map_[elems[j]].push_back(elems[i]);
+            }
         for(auto &el: map_) el.second.shrink_to_fit();
-        LOG_DEBUG("Finished constructor.");
+        LOG_DEBUG("Built adjacency list over %zu patterns.\n", m_);
     }
 };
 
 using adjmap_t = AdjacencyList<bitvec_t>;
 
-class bitmap_t {
-    std::unordered_map<u64, bitvec_t> core_;
+/*
+ * PatternSet:
+ * Interned presence patterns. Each distinct pattern is stored once, words() u64s wide, in one contiguous arena
+ * and named by a 32-bit id (its insertion order). Interning also counts the kmers sharing each pattern.
+ * Lookups go through an open-addressed table of ids with linear probing, hashed on the pattern's words.
+ */
+class PatternSet {
+public:
+    static constexpr u32 NONE = u32(-1);
+private:
+    std::vector<u64> arena_;  // Pattern id -> words_ u64s starting at arena_[id * words_].
+    std::vector<u64> counts_;
+    std::vector<u32> table_;  // NONE for empty slots.
+    unsigned         words_;
 
+    INLINE u64 hash(const u64 *bits) const {
+        u64 ret(words_);
+        for(unsigned i(0); i < words_; ret = wang_hash(ret ^ bits[i++]));
+        return ret;
+    }
+    INLINE bool equal(u32 id, const u64 *bits) const {
+        return std::equal(bits, bits + words_, pattern(id));
+    }
+    // Slot holding bits, or the empty slot where it would go.
+    INLINE size_t slot(const u64 *bits) const {
+        const size_t mask(table_.size() - 1);
+        size_t i(hash(bits) & mask);
+        while(table_[i] != NONE && !equal(table_[i], bits)) i = (i + 1) & mask;
+        return i;
+    }
+    void grow() {
+        std::vector<u32>(table_.size() << 1, NONE).swap(table_);
+        const size_t mask(table_.size() - 1);
+        for(u32 id(0); id < counts_.size(); ++id) {
+            size_t i(hash(pattern(id)) & mask);
+            while(table_[i] != NONE) i = (i + 1) & mask;
+            table_[i] = id;
+        }
+    }
 public:
-    std::unordered_map<u64, bitvec_t> fill(const kgset_t &set) {
-        std::unordered_map<u64, bitvec_t> tmp;
-        const unsigned len((set.size() + 63) >> 6);
-        const khash_t(all) *h;
-        const auto &vec(set.core());
-        LOG_DEBUG("Size of set: %zu\n", set.size());
-
-        for(size_t i(0); i < set.size(); ++i) {
-            h = &vec[i];
-            for(khiter_t ki(0); ki != kh_end(h); ++ki) {
-                if(kh_exist(h, ki)) {
-                    auto m(tmp.find(kh_key(h, ki)));
-                    if(m == tmp.end()) m = tmp.emplace(kh_key(h, ki),
-                                                       bitvec_t(len, lazy::LAZY_VEC_INIT)).first;
-                    m->second[i >> 6] |= 1u << (i & 63u);
+    explicit PatternSet(unsigned words=1): table_(64, NONE), words_(words) {
+        if(words == 0) RUNTIME_ERROR("Patterns must be at least one word wide.");
+    }
+    size_t size()     const {return counts_.size();}
+    unsigned words()  const {return words_;}
+    INLINE const u64 *pattern(u32 id) const {return &arena_[size_t(id) * words_];}
+    bitvec_t vec(u32 id)              const {return bitvec_t(pattern(id), pattern(id) + words_);}
+    INLINE u64 count(u32 id)          const {return counts_[id];}
+    u32 find(const u64 *bits)         const {return table_[slot(bits)];}
+    u32 find(const bitvec_t &bits)    const {return bits.size() == words_ ? find(bits.data()): NONE;}
+    // Adds n to the count of bits, inserting it if new, and returns its id.
+    u32 intern(const u64 *bits, u64 n=1) {
+        const size_t i(slot(bits));
+        u32 id(table_[i]);
+        if(id == NONE) {
+            if(unlikely(counts_.size() >= NONE)) RUNTIME_ERROR("Too many distinct patterns for 32-bit ids.");
+            table_[i] = id = counts_.size();
+            arena_.insert(arena_.end(), bits, bits + words_);
+            counts_.push_back(n);
+            if(counts_.size() << 1 > table_.size()) grow();
+        } else counts_[id] += n;
+        return id;
+    }
+    u32 intern(const bitvec_t &bits, u64 n=1) {
+        if(bits.size() != words_) RUNTIME_ERROR(ks::sprintf("Pattern has %zu words, expected %u.", bits.size(), words_).data());
+        return intern(bits.data(), n);
+    }
+    void shrink_to_fit() {arena_.shrink_to_fit(); counts_.shrink_to_fit();}
+};
+
+/*
+ * Presence bits for every kmer in a kgset_t: bit i is set if set i contains the kmer.
+ * Kmers are split into shards by hash. One pass over the sets scatters each kmer, tagged with its set, into
+ * per-thread buffers for its shard; then one thread builds each shard from its buffers alone, so no locking is needed,
+ * the work is linear in the kmers, and only num_threads shards' bits are in memory at once.
+ * Buffers take 8 bytes per kmer occurrence. Passing the kgset_t as an rvalue frees each set once it is scattered,
+ * so the buffers replace the sets rather than adding to them.
+ * Within a shard, bits are stored contiguously (words per kmer) in one array, indexed by a kmer -> slot table.
+ */
+static constexpr size_t SHARD_KMERS = size_t(1) << 24;
+
+INLINE unsigned kmer_shards(const kgset_t &set, int num_threads, size_t shard_kmers=SHARD_KMERS) {
+    return std::max(size_t(std::max(num_threads, 1)), (set.weight() + shard_kmers - 1) / shard_kmers);
+}
+// Routes on the hash's high bits: khash picks buckets from the low ones,
+// so routing on those would leave each shard's slot table using a fraction of its buckets.
+INLINE unsigned kmer_shard(u64 kmer, unsigned nshards) {
+    return unsigned(((wang_hash(kmer) >> 32) * nshards) >> 32);
+}
+
+namespace detail {
+// Kmers one thread scattered to one shard, in runs from a single set each.
+struct shard_buffer {
+    std::vector<u64>                     kmers_;
+    std::vector<std::pair<u32, size_t>>   runs_; // Set index, end of its run in kmers_.
+};
+struct kmer_scatter_helper {
+    const kgset_t                 &set_;
+    kgset_t                   *release_;
+    std::vector<shard_buffer> &buffers_; // num_threads * nshards, by thread then shard.
+    const unsigned             nshards_;
+};
+inline void kmer_scatter_fn(void *data_, long index, int tid) {
+    auto &h(*(kmer_scatter_helper *)data_);
+    shard_buffer *const buffers(&h.buffers_[size_t(tid) * h.nshards_]);
+    const khash_t(all) *set(&h.set_.core()[index]);
+    for(khiter_t ki(0); ki != kh_end(set); ++ki)
+        if(kh_exist(set, ki)) buffers[kmer_shard(kh_key(set, ki), h.nshards_)].kmers_.push_back(kh_key(set, ki));
+    for(unsigned i(0); i < h.nshards_; ++i) {
+        auto &b(buffers[i]);
+        if(b.kmers_.size() != (b.runs_.empty() ? 0: b.runs_.back().second)) b.runs_.emplace_back(u32(index), b.kmers_.size());
+    }
+    if(h.release_) h.release_->release(index);
+}
+template<typename Fn>
+struct kmer_bits_helper {
+    std::vector<shard_buffer> &buffers_;
+    const Fn                       &fn_;
+    const unsigned             nshards_;
+    const int                 nthreads_;
+    const unsigned               words_;
+};
+template<typename Fn>
+void kmer_bits_fn(void *data_, long index, int tid) {
+    auto &h(*(kmer_bits_helper<Fn> *)data_);
+    const unsigned words(h.words_);
+    khash_t(64) *slots(kh_init(64));
+    std::vector<u64> bits;
+    int khr;
+    khiter_t kj;
+    for(int t(0); t < h.nthreads_; ++t) {
+        shard_buffer &b(h.buffers_[size_t(t) * h.nshards_ + index]);
+        size_t k(0);
+        for(const auto &run: b.runs_) {
+            const u32 i(run.first);
+            for(; k < run.second; ++k) {
+                kj = kh_put(64, slots, b.kmers_[k], &khr);
+                if(unlikely(khr < 0)) RUNTIME_ERROR(ks::sprintf("Could not insert to shard of size %zu.", kh_size(slots)).data());
+                if(khr) {
+                    kh_val(slots, kj) = bits.size() / words;
+                    bits.resize(bits.size() + words);
                 }
+                bits[kh_val(slots, kj) * words + (i >> 6)] |= UINT64_C(1) << (i & 63);
             }
         }
-        return tmp;
+        b = shard_buffer(); // Freed as soon as it's read, so buffers shrink as shards finish.
+    }
+    for(khiter_t ki(0); ki != kh_end(slots); ++ki)
+        if(kh_exist(slots, ki))
+            h.fn_(unsigned(index), kh_key(slots, ki), &bits[kh_val(slots, ki) * words]);
+    kh_destroy(64, slots);
+}
+template<typename Fn>
+void for_each_kmer_bits(const kgset_t &set, kgset_t *release, const Fn &fn, unsigned nshards, int num_threads) {
+    if(num_threads <= 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<shard_buffer> buffers(size_t(num_threads) * nshards);
+    ForPool pool(num_threads);
+    {
+        kmer_scatter_helper helper{set, release, buffers, nshards};
+        pool.forpool(&kmer_scatter_fn, &helper, set.size());
     }
+    kmer_bits_helper<Fn> helper{buffers, fn, nshards, num_threads, unsigned((set.size() + 63) >> 6)};
+    pool.forpool(&kmer_bits_fn<Fn>, &helper, nshards);
+}
+inline PatternSet pattern_counts(const kgset_t &set, kgset_t *release, int num_threads, size_t shard_kmers) {
+    if(num_threads <= 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+    const unsigned nshards(kmer_shards(set, num_threads, shard_kmers)), words((set.size() + 63) >> 6);
+    std::vector<PatternSet> counts(nshards, PatternSet(words));
+    for_each_kmer_bits(set, release, [&](unsigned shard, u64, const u64 *bits) {
+        const unsigned bitsum(bits_popcnt(bits, words));
+        if(bitsum != 1u && bitsum != set.size()) counts[shard].intern(bits);
+    }, nshards, num_threads);
+    PatternSet ret(std::move(counts[0]));
+    for(unsigned i(1); i < nshards; ++i) {
+        for(u32 id(0); id < counts[i].size(); ++id) ret.intern(counts[i].pattern(id), counts[i].count(id));
+        counts[i] = PatternSet(words);
+    }
+    ret.shrink_to_fit();
+    LOG_DEBUG("%zu presence patterns from %u shards.\n", ret.size(), nshards);
+    return ret;
+}
+} // namespace detail
+
+// Calls fn(shard, kmer, bits) for every kmer in set, where bits holds (set.size() + 63) / 64 words.
+// Each shard is visited by one thread, so fn may write to per-shard state without locking.
+template<typename Fn>
+void for_each_kmer_bits(const kgset_t &set, const Fn &fn, unsigned nshards, int num_threads) {
+    detail::for_each_kmer_bits(set, nullptr, fn, nshards, num_threads);
+}
+// As above, but frees set's tables as they are read.
+template<typename Fn>
+void for_each_kmer_bits(kgset_t &&set, const Fn &fn, unsigned nshards, int num_threads) {
+    detail::for_each_kmer_bits(set, &set, fn, nshards, num_threads);
+}
 
+// Number of kmers with each presence pattern, without materializing the kmer -> pattern map.
+// As in bitmap_t, kmers in exactly one set or in all of them are skipped.
+inline PatternSet pattern_counts(const kgset_t &set, int num_threads=-1, size_t shard_kmers=SHARD_KMERS) {
+    return detail::pattern_counts(set, nullptr, num_threads, shard_kmers);
+}
+inline PatternSet pattern_counts(kgset_t &&set, int num_threads=-1, size_t shard_kmers=SHARD_KMERS) {
+    return detail::pattern_counts(set, &set, num_threads, shard_kmers);
+}
+
+// Kmers map to ids of their interned presence patterns, which are stored once each.
+class bitmap_t {
+    std::unordered_map<u64, u32> core_;
+    PatternSet               patterns_;
+
+public:
     auto &get_map() {return core_;}
     auto &cget_map() const {return static_cast<const decltype(core_)&>(core_);}
+    const PatternSet &patterns() const {return patterns_;}
+    // Presence bits for kmer, or nullptr if it was not kept.
+    const u64 *find(u64 kmer) const {
+        auto it(core_.find(kmer));
+        return it == core_.end() ? nullptr: patterns_.pattern(it->second);
+    }
 
     bitmap_t(){}
-    bitmap_t(const kgset_t &set) {
-        const auto tmp(fill(set));
-        unsigned bitsum;
-#if !NDEBUG
-        size_t n_passed(0), total(tmp.size());
-        std::unordered_map<unsigned, size_t> counts;
-        std::unordered_set<std::string> stringset;
-#endif
-        // Only keeps kmers from kgset if they don't have 1 or set.size() bits set.
-        for(auto &i: tmp) {
-            bitsum = pop::vec_popcnt(i.second);
-            if(bitsum != 1u && bitsum != set.size()) {
-                core_.emplace(i.first, i.second);
-#if !NDEBUG
-                ++n_passed, stringset.insert(bitvec2str(i.second));
-#endif
-            }
-#if !NDEBUG
-            ++counts[bitsum];
-#endif
+    // Only keeps kmers from kgset if they don't have 1 or set.size() bits set.
+    bitmap_t(const kgset_t &set, int num_threads=-1, size_t shard_kmers=SHARD_KMERS): patterns_((set.size() + 63) >> 6) {
+        if(num_threads <= 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+        const unsigned nshards(kmer_shards(set, num_threads, shard_kmers)), words(patterns_.words());
+        std::vector<std::vector<std::pair<u64, u32>>> kept(nshards);
+        std::vector<PatternSet> shard_patterns(nshards, PatternSet(words));
+        for_each_kmer_bits(set, [&](unsigned shard, u64 kmer, const u64 *bits) {
+            const unsigned bitsum(bits_popcnt(bits, words));
+            if(bitsum != 1u && bitsum != set.size()) kept[shard].emplace_back(kmer, shard_patterns[shard].intern(bits));
+        }, nshards, num_threads);
+        size_t total(0);
+        for(const auto &v: kept) total += v.size();
+        core_.reserve(total);
+        std::vector<u32> ids;
+        for(unsigned i(0); i < nshards; ++i) {
+            // Translate shard-local ids to global ones.
+            const PatternSet &local(shard_patterns[i]);
+            ids.resize(local.size());
+            for(u32 id(0); id < local.size(); ++id) ids[id] = patterns_.intern(local.pattern(id), local.count(id));
+            for(const auto &pair: kept[i]) core_.emplace(pair.first, ids[pair.second]);
+            std::vector<std::pair<u64, u32>>().swap(kept[i]);
+            shard_patterns[i] = PatternSet(words);
         }
-        LOG_DEBUG("Keeping %zu of %zu kmers whose bit patterns are not exactly compressed by the taxonomy heuristic.\n",
-                  n_passed, total);
-#if !NDEBUG
-        for(const auto &pair: counts)
-            LOG_DEBUG("Count %u appeared %u times\n", pair.first, pair.second);
-        for(const auto &str: stringset) LOG_DEBUG("'%s' found\n", str.data());
-#endif
-        
+        patterns_.shrink_to_fit();
+        LOG_DEBUG("Keeping %zu kmers with %zu distinct bit patterns not exactly compressed by the taxonomy heuristic.\n", core_.size(), patterns_.size());
     }
     bitmap_t(bitmap_t &&other)            = default;
     bitmap_t &operator=(bitmap_t &&other) = default;
 
     auto to_counter() const {
         count::Counter<bitvec_t> ret;
-        for(auto &pair: core_) ret.add(pair.second);
+        for(u32 id(0); id < patterns_.size(); ++id) ret.add(patterns_.vec(id), patterns_.count(id));
         ret.set_nelem(core_.size());
         return ret;
     }
@@ -145,8 +426,13 @@ inline u64 score_node_addn(const bitvec_t &bitstring,
     const auto m(am.find(bitstring));
     const auto node(counts.find(bitstring));
     if(unlikely(m == am.end()) || node == counts.end()) return UINT64_C(-1);
-    u64 ret(node->second * (nelem - pop::vec_popcnt(node->first)));
-    for(const auto i: m->second) ret += counts.find(*i)->second * pop::vec_popcnt(*i);
+    u64 ret(node->second * (nelem - popcnt_words(node->first.data(), node->first.size())));
+    // Each subset's popcount comes with a check that it really is one, in a single pass.
+    for(const auto i: m->second) {
+        const BitStats stats(bitstats(node->first, *i));
+        assert(stats.cmp_ == BitCmp::FIRST_PARENT);
+        ret += counts.find(*i)->second * stats.popb_;
+    }
     return ret;
 }
 
@@ -3,6 +3,7 @@
 #include "kspp/ks.h"
 #include "encoder.h"
 #include "feature_min.h"
+#include "mphf.h"
 #include "klib/kthread.h"
 #include "util.h"
 
@@ -128,11 +129,26 @@ inline void append_kraken_classification(const tax_counter &hit_counts,
     bks.terminate();
 }
 
-template<typename ScoreType>
+// Database lookups for each kind of map. Return false for kmers not in the database.
+INLINE bool db_lookup(const khash_t(c) *db, u64 kmer, tax_t &tax) {
+    const khiter_t ki(kh_get(c, db, kmer));
+    return ki != kh_end(db) ? (tax = kh_val(db, ki), true): false;
+}
+INLINE bool db_lookup(const khash_t(c128) *db, u128 kmer, tax_t &tax) {
+    const khiter_t ki(kh_get(c128, db, kmer));
+    return ki != kh_end(db) ? (tax = kh_val(db, ki), true): false;
+}
+INLINE bool db_lookup(const MphfMap *db, u64 kmer, tax_t &tax) {return db->get(kmer, tax);}
+
+template<typename ScoreType, typename KmerType=u64, typename MapType=typename kmer_traits<KmerType>::lca_type>
 struct ClassifierGeneric {
-    const khash_t(c) *db_;
+    using traits     = kmer_traits<KmerType>;
+    using map_type   = MapType;
+    using score_type = ScoreType;
+    using kmer_type  = KmerType;
+    const map_type *db_;
     const Spacer sp_;
-    Encoder<ScoreType> enc_;
+    typename traits::template encoder_type<ScoreType> enc_;
     uint32_t          nt_:16;
     uint32_t output_flag_:16;
     mutable std::atomic<u64> classified_[2];
@@ -152,7 +168,7 @@ struct ClassifierGeneric {
     INLINE int get_emit_all()    const {return output_flag_ & output_format::EMIT_ALL;}
     INLINE int get_emit_kraken() const {return output_flag_ & output_format::KRAKEN;}
     INLINE int get_emit_fastq()  const {return output_flag_ & output_format::FASTQ;}
-    ClassifierGeneric(const khash_t(c) *map, const spvec_t &spaces, u8 k, std::uint16_t wsz, int num_threads=16,
+    ClassifierGeneric(const map_type *map, const spvec_t &spaces, u8 k, std::uint16_t wsz, int num_threads=16,
                       bool emit_all=true, bool emit_fastq=true, bool emit_kraken=false, bool canonicalize=true):
         db_(map),
         sp_(k, wsz, spaces),
@@ -166,7 +182,7 @@ struct ClassifierGeneric {
     }
     ClassifierGeneric(const char *dbpath, const spvec_t &spaces, u8 k, std::uint16_t wsz, int num_threads=16,
                       bool emit_all=true, bool emit_fastq=true, bool emit_kraken=false, bool canonicalize=true):
-        ClassifierGeneric(khash_load<khash_t(c)>(dbpath), spaces, k, wsz, num_threads, emit_all, emit_fastq, emit_kraken, canonicalize) {}
+        ClassifierGeneric(khash_load<map_type>(dbpath), spaces, k, wsz, num_threads, emit_all, emit_fastq, emit_kraken, canonicalize) {}
     u64 n_classified()   const {return classified_[0];}
     u64 n_unclassified() const {return classified_[1];}
 };
@@ -197,10 +213,13 @@ INLINE void append_counts(u32 count, const char character, kstring_t *ks) {
 }
 
 using Classifier = ClassifierGeneric<score::Lex>;
+using WideClassifier = ClassifierGeneric<score::Lex, u128>;
+using MphfClassifier = ClassifierGeneric<score::Lex, u64, MphfMap>;
 namespace {
+template<typename ClassifierType>
 struct kt_data {
-    const ClassifierGeneric<score::Lex> &c_;
-    const khash_t(p) *taxmap;
+    const ClassifierType &c_;
+    const Taxonomy *taxmap;
     bseq1_t *bs_;
     const unsigned per_set_;
     const unsigned total_;
@@ -209,12 +228,12 @@ struct kt_data {
 };
 }
 
-template<typename ScoreType>
-unsigned classify_seq(const ClassifierGeneric<ScoreType> &c,
-                      Encoder<ScoreType> &enc,
-                      const khash_t(p) *taxmap, bseq1_t *bs, const int is_paired, std::vector<tax_t> &taxa) {
+template<typename ScoreType, typename KmerType, typename MapType, typename EncoderType>
+unsigned classify_seq(const ClassifierGeneric<ScoreType, KmerType, MapType> &c,
+                      EncoderType &enc,
+                      const Taxonomy *taxmap, bseq1_t *bs, const int is_paired, std::vector<tax_t> &taxa) {
     LOG_DEBUG("starting classify_seq with bs at pointer = %p\n", static_cast<const void*>(bs));
-    khiter_t ki;
+    tax_t hit;
     tax_counter hit_counts;
     u32 missing_count(0);
     tax_t taxon(0);
@@ -222,10 +241,10 @@ unsigned classify_seq(const ClassifierGeneric<ScoreType> &c,
     bks.clear();
     taxa.clear();
 
-    auto fn = [&] (u64 kmer) {
+    auto fn = [&] (KmerType kmer) {
         //If the kmer is missing from our database, just say we don't know what it is.
-        if((ki = kh_get(c, c.db_, kmer)) == kh_end(c.db_)) ++missing_count;
-        else taxa.push_back(kh_val(c.db_, ki)), hit_counts.add(kh_val(c.db_, ki));
+        if(!db_lookup(c.db_, kmer, hit)) ++missing_count;
+        else taxa.push_back(hit), hit_counts.add(hit);
     };
     // This simplification loses information about the run of congituous labels. Do these matter?
     enc.for_each(fn, bs->seq, bs->l_seq);
@@ -251,11 +270,12 @@ unsigned classify_seq(const ClassifierGeneric<ScoreType> &c,
 }
 
 
-inline void kt_for_helper(void *data_, long index, int tid) {
-    kt_data *data((kt_data *)data_);
+template<typename ClassifierType>
+void kt_for_helper(void *data_, long index, int tid) {
+    kt_data<ClassifierType> *data((kt_data<ClassifierType> *)data_);
     size_t retstr_size(0);
     const int inc(!!data->is_paired_ + 1);
-    Encoder<score::Lex> enc(data->c_.enc_);
+    auto enc(data->c_.enc_);
     std::vector<tax_t> taxa;
     //static_assert(std::is_same_v<unsigned, std::decay_t<decltype((data->per_set_ + static_cast<unsigned>(1)) * index)>>, "Should be true.");
     for(unsigned i(index * data->per_set_); i < std::min((data->per_set_ + 1) * static_cast<unsigned>(index), data->total_); retstr_size += classify_seq(data->c_, enc, data->taxmap, data->bs_ + i, data->is_paired_, taxa), i += inc);
@@ -263,16 +283,14 @@ inline void kt_for_helper(void *data_, long index, int tid) {
 }
 
 
-
-using Classifier = ClassifierGeneric<score::Lex>;
-
-inline void classify_seqs(const Classifier &c, const khash_t(p) *taxmap, bseq1_t *bs,
+template<typename ClassifierType>
+void classify_seqs(const ClassifierType &c, const Taxonomy *taxmap, bseq1_t *bs,
                           ks::string &cks, const unsigned chunk_size, const unsigned per_set, const int is_paired, ForPool &pool) {
     assert(per_set && ((per_set & (per_set - 1)) == 0));
 
     std::atomic<u64> retstr_size(0);
-    kt_data data{c, taxmap, bs, per_set, chunk_size, retstr_size, is_paired};
-    pool.forpool(&kt_for_helper, (void *)&data, chunk_size / per_set + 1);
+    kt_data<ClassifierType> data{c, taxmap, bs, per_set, chunk_size, retstr_size, is_paired};
+    pool.forpool(&kt_for_helper<ClassifierType>, (void *)&data, chunk_size / per_set + 1);
     cks.resize(retstr_size.load());
     const int inc((is_paired != 0) + 1);
 #if !NDEBUG
@@ -293,13 +311,16 @@ struct del_data {
 };
 
 
-inline void process_dataset(const Classifier &c, const khash_t(p) *taxmap, const char *fq1, const char *fq2,
+template<typename ClassifierType>
+void process_dataset(const ClassifierType &c, const Taxonomy *taxmap, const char *fq1, const char *fq2,
                             std::FILE *out, unsigned chunk_size,
                             unsigned per_set) {
     // TODO: consider reusing buffers for processing large numbers of files.
     int nseq(0), max_nseq(0);
-    gzFile ifp1(gzopen(fq1, "rb")), ifp2(fq2 ? gzopen(fq2, "rb"): nullptr);
-    kseq_t *ks1(kseq_init(ifp1)), *ks2(ifp2 ? kseq_init(ifp2): nullptr);
+    // Decompress ahead on other threads. Classification threads are idle while a batch is read anyhow.
+    std::unique_ptr<GzReadAhead> ifp1(new GzReadAhead(fq1, c.nt_)), ifp2(fq2 ? new GzReadAhead(fq2, c.nt_): nullptr);
+    if(!ifp1->get() || (ifp2 && !ifp2->get())) LOG_EXIT("Could not open input file(s) %s%s%s.\n", fq1, fq2 ? ", ": "", fq2 ? fq2: "");
+    kseq_t *ks1(kseq_init(ifp1->get())), *ks2(ifp2 ? kseq_init(ifp2->get()): nullptr);
     ks::string cks(256u);
     const int fn = fileno(out), is_paired(fq2 != 0);
     del_data dd{nullptr, per_set, chunk_size};
@@ -330,10 +351,8 @@ inline void process_dataset(const Classifier &c, const khash_t(p) *taxmap, const
     free(dd.seqs_);
     fail:
     // Clean up.
-    gzclose(ifp1);
     kseq_destroy(ks1);
     if(ks2) kseq_destroy(ks2);
-    if(ifp2) gzclose(ifp2);
 }
 
 static void append_fastq_classification(const tax_counter &hit_counts,
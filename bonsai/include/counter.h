@@ -145,6 +145,14 @@ public:
         ++n_;
     }
 
+    // Adds count occurrences of elem at once.
+    void add(const T &elem, SizeType count) {
+        auto match(map_.find(elem));
+        if(match == map_.end()) map_.emplace(elem, count);
+        else                    match->second += count;
+        n_ += count;
+    }
+
     void set_nelem(SizeType nelem) {
         nelem_ = nelem;
     }
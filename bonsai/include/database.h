@@ -13,8 +13,39 @@
 namespace bns {
 
 
+// Opens a database for reading, decompressing .gz and .zst files through a pipe.
+// filetype is set to 0 for uncompressed files, which must be closed with fclose rather than pclose.
+inline std::FILE *open_database(const char *fn, int &filetype) {
+    filetype = 0;
+    std::string fns = fn;
+    std::string gzsuf   = ".gz";
+    std::string zstdsuf = ".zst";
+    if(std::equal(std::crbegin(gzsuf), std::crend(gzsuf), std::crbegin(fns))) filetype = 1;
+    else if(std::equal(std::crbegin(zstdsuf), std::crend(zstdsuf), std::crbegin(fns))) filetype = 2;
+    return filetype ? popen((std::string(filetype == 1 ? "gzip -dc " : "zstd -qdc ") + fn).data(), "rb"): std::fopen(fn, "rb");
+}
+
+// k for the database at fn, without loading it. Databases with k > 32 use 128-bit keys (khash_t(c128)).
+inline unsigned database_k(const char *fn) {
+    int filetype;
+    unsigned k(0);
+    std::FILE *fp(open_database(fn, filetype));
+    if(!fp) LOG_EXIT("Could not open %s for reading.\n", fn);
+    if(std::fread(&k, sizeof(k), 1, fp) != 1) LOG_EXIT("Could not read header from %s.\n", fn);
+    if(filetype) pclose(fp);
+    else         std::fclose(fp);
+    return k;
+}
+
+// Key type of a database's map: a khash's key type, or T::key_type for other maps (e.g., MphfMap).
+template<typename T, typename=void>
+struct map_key {using type = std::remove_pointer_t<decltype(std::declval<T>().keys)>;};
+template<typename T>
+struct map_key<T, std::void_t<typename T::key_type>> {using type = typename T::key_type;};
+
 template <typename T>
 struct Database {
+    using key_type = typename map_key<T>::type;
 
     unsigned k_, w_;
     T       *db_;
@@ -31,17 +62,12 @@ struct Database {
     }
 
     Database(const char *fn): owns_hash_(1), sp_(nullptr) {
-        int filetype(0);
-        {
-            std::string fns = fn;
-            std::string gzsuf   = ".gz";
-            std::string zstdsuf = ".zst";
-            if(std::equal(std::crbegin(gzsuf), std::crend(gzsuf), std::crbegin(fns))) filetype = 1;
-            else if(std::equal(std::crbegin(gzsuf), std::crend(gzsuf), std::crbegin(fns))) filetype = 2;
-        }
-        std::FILE *fp = filetype ? popen((std::string(filetype == 1 ? "gzip -dc " : "zstd -qdc ") + fn).data(), "rb"): std::fopen(fn, "rb");
+        int filetype;
+        std::FILE *fp(open_database(fn, filetype));
         if (fp) {
             __fr(k_, fp);
+            if((k_ > 32) != (sizeof(key_type) > sizeof(u64)))
+                LOG_EXIT("Database %s has k = %u, which needs %s-bit keys.\n", fn, k_, k_ > 32 ? "128": "64");
             __fr(w_, fp);
             s_ = spvec_t(k_ - 1);
             LOG_DEBUG("reading %zu bytes from file for vector, with %zu reserved\n", s_.size(), s_.capacity());
@@ -51,7 +77,8 @@ struct Database {
         sp_ = make_sp();
         assert(sp_);
         LOG_DEBUG("Read database!\n");
-        std::fclose(fp);
+        if(filetype) pclose(fp);
+        else         std::fclose(fp);
     }
     Database(unsigned k, unsigned w, const spvec_t &s, unsigned owns=1, T *db=nullptr):
         k_(k), w_(w), db_(db), owns_hash_(owns), s_(s), sp_(make_sp())
@@ -115,6 +142,12 @@ struct Database {
 #endif
     }
 
+    // Databases can only be combined if they were encoded the same way.
+    template<typename O>
+    bool compatible(const Database<O> &other) const {
+        return k_ == other.k_ && w_ == other.w_ && s_ == other.s_;
+    }
+
     template<typename Q=T>
     typename std::enable_if_t<std::is_same_v<khash_t(c), Q>, u32>
     get_lca(u64 kmer) {
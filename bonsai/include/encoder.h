@@ -1,7 +1,8 @@
 #ifndef _EMP_ENCODER_H__
 #define _EMP_ENCODER_H__
+#include <cmath>
+#include <memory>
 #include <thread>
-#include <future>
 #include <limits>
 
 #include <unistd.h>
@@ -12,6 +13,8 @@
 #include "entropy.h"
 #include "kseq_declare.h"
 #include "qmap.h"
+#include "readahead.h"
+#include "scoreindex.h"
 #include "spacer.h"
 #include "util.h"
 #include "klib/kthread.h"
@@ -64,21 +67,12 @@ using ScoringFunction = u64 (*)(u64, void*);
 static INLINE u64 lex_score(u64 i, UNUSED(void *data)) {return i ^ XOR_MASK;}
 static INLINE u64 ent_score(u64 i, void *data) {
     // For this, the highest-entropy kmers will be selected as "minimizers".
-    return UINT64_C(-1) - static_cast<u64>(UINT64_C(7958933093282078720) * kmer_entropy(i, *(unsigned *)data));
+    // data is the Encoder's EntropyTable.
+    return static_cast<const EntropyTable *>(data)->kmer_score(i);
 }
 static INLINE u64 hash_score(u64 i, void *data) {
-    khint_t k1;
-    khash_t(64) *hash((khash_t(64) *)data);
-    if(likely((k1 = kh_get(64, hash, i)) == kh_end(hash))) return kh_val(hash, k1);
-    for(k1 = 0; k1 != kh_end(hash); ++k1) {
-        LOG_DEBUG("Did not find key. Scanning.\n");
-        if(kh_key(hash, k1) == i) __ac_set_isdel_false(hash->flags, k1);
-        return kh_val(hash, k1);
-    }
-    std::fprintf(stderr, "i: %" PRIu64 "\n", i);
-    std::exit(EXIT_FAILURE);
-    __builtin_unreachable();
-    return 0uL;
+    // data is a ScoreIndex built from the phase 1 map. Missing kmers get its default score.
+    return static_cast<const ScoreIndex *>(data)->score(i);
 }
 
 namespace score {
@@ -91,18 +85,170 @@ DECHASH(Hash, hash_score);
 
 
 
+static constexpr uint64_t DEFAULT_ROLLING_SEED = UINT64_C(0xB0BAFE77C001D00D);
+
+// Random per-nucleotide seeds for ntHash, indexed by character. Non-ACGT characters map to 0.
 static std::array<u64, 256> make_nthash_lut(u64 seedseed) {
     aes::AesCtr<uint64_t> gen(seedseed);
-    uint64_t a = gen(), c = gen(), g = gen(), t = gen();
+    auto next = [&]() {u64 ret; while((ret = gen()) == 0); return ret;};
+    uint64_t a = next(), c = next(), g = next(), t = next();
     std::array<u64, 256> ret;
     std::fill(ret.begin(), ret.end(), 0);
-    ret[4] = ret['a'] = ret['A'] = a;
-    ret[7] = ret['c'] = ret['C'] = c;
-    ret[3] = ret['g'] = ret['G'] = g;
-    ret[1] = ret['t'] = ret['T'] = t;
+    ret['a'] = ret['A'] = a;
+    ret['c'] = ret['C'] = c;
+    ret['g'] = ret['G'] = g;
+    ret['t'] = ret['T'] = t;
     return ret;
 }
 
+/*
+ * RollingHasher:
+ * ntHash (Mohamadi et al., 2016) over contiguous kmers: O(1) work per base, independent of k,
+ * so it works for k > 32 as long as only hashes (not the kmers themselves) are needed, e.g. for sketching.
+ * The canonical hash is the sum of the forward and reverse-complement hashes, which is strand-independent
+ * and, unlike their minimum, still uniform.
+ * Extra hashes per kmer are derived by multiply/shift, as in ntHash's multi-hash variant.
+ */
+class RollingHasher {
+    std::array<u64, 256> fw_; // Seed for each base
+    std::array<u64, 256> rc_; // Seed for each base's complement
+    const unsigned        k_;
+    const unsigned    krot_, k1rot_;
+
+    static constexpr u64 MULTISEED  = UINT64_C(0x90b45d39fb6da1fa);
+    static constexpr unsigned MULTISHIFT = 27;
+
+    static INLINE u64 rol(u64 x, unsigned r) {return (x << r) | (x >> ((64 - r) & 63));}
+    static INLINE u64 ror(u64 x, unsigned r) {return (x >> r) | (x << ((64 - r) & 63));}
+
+public:
+    RollingHasher(unsigned k, u64 seed=DEFAULT_ROLLING_SEED):
+        fw_(make_nthash_lut(seed)), k_(k), krot_(k & 63), k1rot_((k - 1) & 63)
+    {
+        if(k == 0) RUNTIME_ERROR("k must be positive.");
+        for(unsigned i(0); i < 256; ++i) rc_[i] = fw_[(uint8_t)nuc_cmpl(i)];
+    }
+    unsigned k() const {return k_;}
+    static INLINE u64 reseed(u64 hash, unsigned i, unsigned k) {
+        if(i == 0) return hash;
+        hash *= (i ^ k * MULTISEED);
+        return hash ^ (hash >> MULTISHIFT);
+    }
+
+    // Core loop. func(fw_hash, rc_hash, pos), where pos is the index of the last base of the kmer.
+    // Kmers containing non-ACGT characters are skipped.
+    template<typename Functor>
+    INLINE void roll(const Functor &func, const char *s, u64 l) const {
+        u64 fh(0), rh(0);
+        unsigned filled(0);
+        for(u64 i(0); i < l; ++i) {
+            const uint8_t c(s[i]);
+            if(unlikely(fw_[c] == 0)) {
+                fh = rh = filled = 0;
+                continue;
+            }
+            if(filled < k_) {
+                fh = rol(fh, 1) ^ fw_[c];
+                rh ^= rol(rc_[c], filled % 64);
+                if(++filled < k_) continue;
+            } else {
+                const uint8_t out(s[i - k_]);
+                fh = rol(fh, 1) ^ rol(fw_[out], krot_) ^ fw_[c];
+                rh = ror(rh, 1) ^ ror(rc_[out], 1) ^ rol(rc_[c], k1rot_);
+            }
+            func(fh, rh, i);
+        }
+    }
+    template<typename Functor>
+    INLINE void for_each_hash(const Functor &func, const char *s, u64 l, bool canon=true) const {
+        if(canon) roll([&](u64 fh, u64 rh, u64) {func(fh + rh);}, s, l);
+        else      roll([&](u64 fh, u64,    u64) {func(fh);},      s, l);
+    }
+    // func(const u64 *hashes), with n hashes per kmer.
+    template<typename Functor>
+    INLINE void for_each_hash_n(const Functor &func, const char *s, u64 l, unsigned n, bool canon=true) const {
+        std::vector<u64> hashes(n);
+        for_each_hash([&](u64 hash) {
+            for(unsigned i(0); i < n; ++i) hashes[i] = reseed(hash, i, k_);
+            func(static_cast<const u64 *>(hashes.data()));
+        }, s, l, canon);
+    }
+    // Like for_each_hash, but also provides the 2-bit encoded kmer (canonical if canon), maintained
+    // by shifting in both orientations rather than recomputing the reverse complement. Requires k <= 32.
+    // func(kmer, hash)
+    template<typename Functor>
+    INLINE void for_each_kmer_hash(const Functor &func, const char *s, u64 l, bool canon=true) const {
+        assert(k_ <= 32);
+        const u64 mask(UINT64_C(-1) >> (64 - (k_ << 1)));
+        const unsigned rcshift((k_ - 1) << 1);
+        u64 fw(BF), rc(0);
+        roll([&](u64 fh, u64 rh, u64 i) {
+            if(fw == BF) { // First kmer after a reset: encode it.
+                fw = rc = 0;
+                for(u64 j(i + 1 - k_); j <= i; ++j) {
+                    const u64 code(cstr_lut[(uint8_t)s[j]]);
+                    fw = (fw << 2) | code;
+                    rc = (rc >> 2) | ((3 - code) << rcshift);
+                }
+            } else {
+                const u64 code(cstr_lut[(uint8_t)s[i]]);
+                fw = ((fw << 2) | code) & mask;
+                rc = (rc >> 2) | ((3 - code) << rcshift);
+            }
+            if(canon) func(fw < rc ? fw: rc, fh + rh);
+            else      func(fw, fh);
+            if(i + 1 < l && unlikely(fw_[(uint8_t)s[i + 1]] == 0)) fw = BF; // Next kmer starts over.
+        }, s, l);
+    }
+    template<typename Functor>
+    void for_each_hash(const Functor &func, kseq_t *ks, bool canon=true) const {
+        while(kseq_read(ks) >= 0) for_each_hash(func, ks->seq.s, ks->seq.l, canon);
+    }
+    template<typename Functor>
+    void for_each_hash(const Functor &func, const std::string &path, bool canon=true, kseq_t *ks=nullptr) const {
+        GzReadAhead fp(path.data());
+        if(!fp.get()) RUNTIME_ERROR(ks::sprintf("Could not open file at %s. Abort!\n", path.data()).data());
+        bool destroy;
+        if(ks == nullptr) ks = kseq_init(fp.get()), destroy = true;
+        else              kseq_assign(ks, fp.get()), destroy = false;
+        for_each_hash(func, ks, canon);
+        if(destroy) kseq_destroy(ks);
+    }
+};
+
+// Configurations (k, comb size, window size) with their own instantiations of the packed encoding loop,
+// in which masks, shifts, and loop bounds are constants. The spacing pattern itself is still applied through
+// the Encoder's SpacedExtractor, so any spacing with a matching comb size uses these.
+#define BNS_FIXED_ENCODERS(X) \
+    X(31, 31, 31) \
+    X(31, 31, 50) \
+    X(21, 21, 21) \
+    X(31, 32, 32) \
+    X(31, 32, 50)
+
+enum fixed_encoder_t: int {
+#define X(k, c, w) FIXED_K##k##_C##c##_W##w,
+    BNS_FIXED_ENCODERS(X)
+#undef X
+    FIXED_NONE
+};
+
+inline fixed_encoder_t fixed_encoder(const Spacer &sp) {
+#define X(k, c, w) if(sp.k_ == k && sp.c_ == c && sp.w_ == w) return FIXED_K##k##_C##c##_W##w;
+    BNS_FIXED_ENCODERS(X)
+#undef X
+    return FIXED_NONE;
+}
+
+inline const char *fixed_encoder_name(fixed_encoder_t val) {
+    switch(val) {
+#define X(k, c, w) case FIXED_K##k##_C##c##_W##w: return "k" #k ", comb " #c ", window " #w;
+        BNS_FIXED_ENCODERS(X)
+#undef X
+        default: return "generic";
+    }
+}
+
 /*
  *Encoder:
  * Uses a Spacer to control spacing.
@@ -119,26 +265,13 @@ public:
     const Spacer sp_; // Defines window size, spacing, and kmer size.
 private:
     u64         pos_; // Current position within the string s_ we're working with.
-    void      *data_; // A void pointer for using with scoring. Needed for hash_score.
-    std::array<u64, 256> *rolling_seeds_;
+    void      *data_; // A void pointer for using with scoring. Needed for hash_score (a ScoreIndex).
+    std::unique_ptr<RollingHasher> rolling_; // If set, unspaced windowed Lex minimizers are scored by ntHash.
     qmap_t     qmap_; // queue of max scores and std::map which keeps kmers, scores, and counts so that we can select the top kmer for a window.
+    const SpacedExtractor ext_; // Masks for pulling kmers out of a packed window of the comb.
+    const fixed_encoder_t fixed_; // Specialized encoding loop for this configuration, if any.
     const ScoreType  scorer_; // scoring struct
     bool canonicalize_;
-#if 0
-template<unsigned b1, unsigned b2, unsigned range=1>
-INLINE uint64_t swapbits(uint64_t x) {
-template<size_t lbits>
-INLINE uint64_t rol(uint64_t x, unsigned s) {
-template<size_t n>
-INLINE uint64_t lrot(uint64_t x) {
-    return (x << n) | (x >> (64 - n));
-}
-template<size_t n>
-INLINE uint64_t rrot(uint64_t x) {
-    return (x >> n) | (x << (64 - n));
-}
-#endif
-static constexpr uint64_t DEFAULT_ROLLING_SEED = UINT64_C(0xB0BAFE77C001D00D);
 
 public:
     Encoder(char *s, u64 l, const Spacer &sp, void *data=nullptr,
@@ -148,28 +281,24 @@ public:
       sp_(sp),
       pos_(0),
       data_(data),
-      rolling_seeds_(nullptr),
       qmap_(sp_.w_ - sp_.c_ + 1),
+      ext_(sp_),
+      fixed_(fixed_encoder(sp_)),
       scorer_{},
       canonicalize_(canonicalize)
     {
-        if(std::is_same<ScoreType, score::Entropy>::value && sp_.unspaced() && !sp_.unwindowed()) {
+        if(sp_.k_ > 32) RUNTIME_ERROR(ks::sprintf("k (%u) > 32 requires 128-bit kmers. Use WideEncoder.", unsigned(sp_.k_)).data());
+        if(std::is_same<ScoreType, score::Entropy>::value) {
             if(data_) RUNTIME_ERROR("No data pointer must be provided for lex::Entropy minimization.");
-            data_ = static_cast<void *>(new CircusEnt(sp_.k_));
-        }
-        if(rolling_seed) {
-            if((rolling_seeds_ = static_cast<std::array<u64, 256> *>(std::malloc(sizeof(*rolling_seeds_)))) == nullptr) throw std::bad_alloc();
-            *rolling_seeds_ = make_nthash_lut(rolling_seed);
+            data_ = static_cast<void *>(new EntropyTable(sp_.k_));
         }
+        if(rolling_seed) rolling_.reset(new RollingHasher(sp_.k_, rolling_seed));
     }
     Encoder(const Spacer &sp, void *data, bool canonicalize=true, uint64_t rolling_seed=0): Encoder(nullptr, 0, sp, data, canonicalize, rolling_seed) {}
     Encoder(const Spacer &sp, bool canonicalize=true, uint64_t rolling_seed=0): Encoder(sp, nullptr, canonicalize, rolling_seed) {}
-    Encoder(const Encoder &other): Encoder(other.sp_, other.data_) {
+    Encoder(const Encoder &other): Encoder(other.sp_, std::is_same<ScoreType, score::Entropy>::value ? nullptr: other.data_) {
         canonicalize_ = other.canonicalize_;
-        if(other.rolling_seeds_) {
-            if((rolling_seeds_ = static_cast<std::array<u64, 256> *>(std::malloc(sizeof(*rolling_seeds_)))) == nullptr) throw std::bad_alloc();
-            std::memcpy(rolling_seeds_, other.rolling_seeds_, sizeof(std::array<u64, 256>));
-        }
+        if(other.rolling_) rolling_.reset(new RollingHasher(*other.rolling_));
     }
     Encoder(unsigned k, bool canonicalize=true, uint64_t rolling_seed=0): Encoder(nullptr, 0, Spacer(k), nullptr, canonicalize, rolling_seed) {}
 
@@ -184,53 +313,110 @@ public:
     }
     INLINE void assign(kstring_t *ks) {assign(ks->s, ks->l);}
     INLINE void assign(kseq_t    *ks) {assign(&ks->seq);}
-#if THEY_SEE_ME_ROLLIN
+    // ntHash-based rolling hashes of every kmer in the remainder of the current string.
+    // These use the seed provided at construction, or DEFAULT_ROLLING_SEED if none was.
+    const RollingHasher &rolling_hasher() {
+        if(unlikely(!sp_.unspaced())) throw std::runtime_error(std::string("Can't perform rolling hashing for spaced seeds. Use for_each and hash it yourself."));
+        if(!rolling_) rolling_.reset(new RollingHasher(sp_.k_));
+        return *rolling_;
+    }
     template<typename Functor>
-    INLINE void for_each_rolling_hash(const Functor &func, u64 seed=0xB0BAF377C001D00D) {
-        // Uses nthash, a rolling hash for nucleotides.
-        if(unlikely(!sp_.unspaced())) throw std::runtime_error("Can't perform "s + __PRETTY_FUNCTION__ + " for spaced seeds. Use for_each and hash it yourself.");
-        if((!sp_.unwindowed())) throw std::runtime_error("Can't perform "s + __PRETTY_FUNCTION__ + " for windowed seeds. Use for_each and hash it yourself.");
-        const u64 mask((UINT64_C(-1)) >> (64 - (sp_.k_ << 1)));
-        u64 min;
-        unsigned filled;
-        loop_start:
-        min = filled = 0;
-        // TODO: this
-#if 0
-        while(likely(pos_ < l_)) {
-            while(filled < sp_.k_ && likely(pos_ < l_)) {
-                min <<= 2;
-                //std::fprintf(stderr, "Encoding character %c with value %u at last position.\n", s_[pos_], (unsigned)cstr_lut[s_[pos_]]);
-                if(unlikely((min |= cstr_lut[s_[pos_++]]) == BF) && (sp_.k_ < 31 || cstr_lut[s_[pos_ - 1]] != 'T')) {
-                    goto loop_start;
-                }
-                ++filled;
-            }
-            if(likely(filled == sp_.k_)) {
-                min &= mask;
-                func(min);
-                --filled;
-            }
-        }
-#endif
+    INLINE void for_each_rolling_hash(const Functor &func) {
+        rolling_hasher().for_each_hash(func, s_ + pos_, l_ - pos_, false);
+        pos_ = l_;
     }
     template<typename Functor>
     INLINE void for_each_rolling_hash_canon(const Functor &func) {
-        // TODO: this
+        rolling_hasher().for_each_hash(func, s_ + pos_, l_ - pos_, true);
+        pos_ = l_;
     }
+    // func(const std::array<u64, N> &)
     template<typename Functor, size_t N>
     INLINE void for_each_rolling_hash_seed_multiply(const Functor &func) {
-        // TODO: this (uses a stack of values with seeds to perform the hashing)
+        const RollingHasher &rh(rolling_hasher());
+        std::array<u64, N> hashes;
+        rh.for_each_hash([&](u64 hash) {
+            for(unsigned i(0); i < N; ++i) hashes[i] = RollingHasher::reseed(hash, i, sp_.k_);
+            func(static_cast<const std::array<u64, N> &>(hashes));
+        }, s_ + pos_, l_ - pos_, canonicalize_);
+        pos_ = l_;
     }
+    // func(const u64 *), with n hashes
     template<typename Functor>
     INLINE void for_each_rolling_hash_seed_multiply_n(const Functor &func, size_t n) {
-
-        // TODO: this (uses a heap-allocated array of seeds to perform the hashing)
+        rolling_hasher().for_each_hash_n(func, s_ + pos_, l_ - pos_, n, canonicalize_);
+        pos_ = l_;
+    }
+    template<typename Functor>
+    INLINE void for_each_rolling_minimizer_(const Functor &func) {
+        // NEVER CALL THIS DIRECTLY.
+        // Unspaced, windowed minimizers scored by ntHash rather than scorer_.
+        u64 min;
+        rolling_->for_each_kmer_hash([&](u64 kmer, u64 hash) {
+            if((min = qmap_.next_value(kmer, hash)) != BF) func(min);
+        }, s_ + pos_, l_ - pos_, canonicalize_);
+        pos_ = l_;
     }
-#endif /* THEY_SEE_ME_ROLLIN */
 
+    template<bool canon, typename WindowType, typename Functor, unsigned K=0, unsigned C=0, unsigned W=0>
+    INLINE void for_each_packed_(const Functor &func) {
+        // NEVER CALL THIS DIRECTLY.
+        // Rolls packed 2-bit windows of the comb in both orientations and extracts (spaced) kmers from them,
+        // so each base costs O(1) instead of O(k).
+        // If C is nonzero, (K, C, W) are compile-time constants for one of BNS_FIXED_ENCODERS.
+        static constexpr bool fixed(C != 0);
+        const unsigned c(fixed ? C: unsigned(sp_.c_)), rcshift((c - 1) << 1);
+        const WindowType wmask(WindowType(-1) >> (sizeof(WindowType) * CHAR_BIT - (c << 1)));
+        const u64 bmask(UINT64_C(-1) >> (64 - c)), used(ext_.used());
+        const bool windowed(fixed ? W > C: sp_.w_ > c);
+        WindowType fw(0), rc(0);
+        u64 bad(bmask), code, kmer, min;
+        for(unsigned nread(0); likely(pos_ < l_);) {
+            // bad marks non-ACGT characters in the window, starting with the part we haven't filled.
+            bad = (bad << 1) & bmask;
+            if(unlikely((code = cstr_lut[s_[pos_++]]) == BF)) bad |= 1, code = 0;
+            fw = ((fw << 2) | code) & wmask;
+            if(canon) rc = (rc >> 2) | (WindowType(3 - code) << rcshift);
+            if(nread < c - 1) {++nread; continue;}
+            if(unlikely(bad & used)) kmer = BF;
+            else if constexpr(fixed && K == C) { // Contiguous: the windows are the kmers.
+                kmer = canon && u64(rc) < u64(fw) ? u64(rc): u64(fw);
+            } else if(canon) {
+                kmer = ext_.fw(fw);
+                const u64 rkmer(ext_.rc(rc));
+                if(rkmer < kmer) kmer = rkmer;
+            } else kmer = ext_.fw(fw);
+            if(windowed) {
+                if((min = qmap_.next_value(kmer, kmer == BF ? BF: scorer_(kmer, data_))) != BF) func(min);
+            } else if(kmer != BF) func(kmer);
+        }
+    }
+    template<typename Functor>
+    INLINE void for_each_fixed_(const Functor &func) {
+        // NEVER CALL THIS DIRECTLY.
+        switch(fixed_) {
+#define X(k, c, w) case FIXED_K##k##_C##c##_W##w: {\
+                using WindowType = std::conditional_t<(c <= 32), u64, SpacedExtractor::u128>;\
+                if(canonicalize_) for_each_packed_<true, WindowType, Functor, k, c, w>(func);\
+                else              for_each_packed_<false, WindowType, Functor, k, c, w>(func);\
+                break;\
+            }
+            BNS_FIXED_ENCODERS(X)
+#undef X
+            default: __builtin_unreachable();
+        }
+    }
+    template<bool canon, typename Functor>
+    INLINE void for_each_packed(const Functor &func) {
+        if(sp_.c_ <= 32) for_each_packed_<canon, u64, Functor>(func);
+        else             for_each_packed_<canon, SpacedExtractor::u128, Functor>(func);
+    }
     template<typename Functor>
     INLINE void for_each_canon_windowed(const Functor &func) {
+        if(likely(ext_.valid())) {
+            for_each_packed<true>(func);
+            return;
+        }
         u64 min;
         while(likely(has_next_kmer()))
             if((min = next_canonicalized_minimizer()) != BF)
@@ -238,9 +424,25 @@ public:
     }
     template<typename Functor>
     INLINE void for_each_canon_unwindowed(const Functor &func) {
-        if(sp_.unspaced())
-            for_each_uncanon_unspaced_unwindowed([&](u64 min) {return func(canonical_representation(min, sp_.k_));});
-        else {
+        if(sp_.unspaced()) {
+            // Keep the reverse complement up to date as we go instead of recomputing it for each kmer.
+            const u64 mask((UINT64_C(-1)) >> (64 - (sp_.k_ << 1)));
+            const unsigned rcshift((sp_.k_ - 1) << 1);
+            u64 fw(0), rc(0), code;
+            unsigned filled(0);
+            while(likely(pos_ < l_)) {
+                if(unlikely((code = cstr_lut[(uint8_t)s_[pos_++]]) == BF)) {
+                    filled = 0;
+                    continue;
+                }
+                fw = ((fw << 2) | code) & mask;
+                rc = (rc >> 2) | ((3 - code) << rcshift);
+                if(filled + 1 < sp_.k_) ++filled;
+                else func(fw < rc ? fw: rc);
+            }
+        } else if(likely(ext_.valid())) {
+            for_each_packed<true>(func);
+        } else {
             u64 min;
             while(likely(has_next_kmer()))
                 if((min = next_kmer()) != BF)
@@ -249,6 +451,10 @@ public:
     }
     template<typename Functor>
     INLINE void for_each_uncanon_spaced(const Functor &func) {
+        if(likely(ext_.valid())) {
+            for_each_packed<false>(func);
+            return;
+        }
         u64 min;
         while(likely(has_next_kmer()))
             if((min = next_minimizer()) != BF)
@@ -302,28 +508,22 @@ public:
     INLINE void for_each_uncanon_unspaced_windowed_entropy_(const Functor &func) {
         // NEVER CALL THIS DIRECTLY.
         // This contains instructions for generating uncanonicalized but windowed entropy-minimized kmers.
+        // Base counts are tracked as an index into the entropy table, updated as bases enter and leave.
         const u64 mask((UINT64_C(-1)) >> (64 - (sp_.k_ << 1)));
-        u64 min, kmer;
+        const unsigned outshift((sp_.k_ - 1) << 1);
+        const EntropyTable &ent(*static_cast<const EntropyTable *>(data_));
+        u64 min, kmer, code;
+        u32 index;
         unsigned filled;
-        CircusEnt &ent = *(static_cast<CircusEnt *>(data_));
         windowed_loop_start:
-        filled = min = 0;
+        filled = min = index = 0;
         while(likely(pos_ < l_)) {
-            while(filled < sp_.k_ && likely(pos_ < l_)) {
-                min <<= 2;
-                if(unlikely((min |= cstr_lut[s_[pos_]]) == BF) && likely(sp_.k_ < 31 || cstr_lut[s_[pos_]] != 'T')) {
-                    ++pos_;
-                    goto windowed_loop_start;
-                }
-                ent.push(s_[pos_]);
-                ++pos_;
-                ++filled;
-            }
-            if(likely(filled == sp_.k_)) {
-                min &= mask;
-                if((kmer = qmap_.next_value(min, ent.score())) != BF) func(kmer);
-                --filled;
-            }
+            if(unlikely((code = cstr_lut[s_[pos_++]]) == BF)) goto windowed_loop_start;
+            if(likely(filled == sp_.k_)) index -= ent.delta((min >> outshift) & 3);
+            else                         ++filled;
+            min = ((min << 2) | code) & mask;
+            index += ent.delta(code);
+            if(likely(filled == sp_.k_) && (kmer = qmap_.next_value(min, ent.score(index))) != BF) func(kmer);
         }
     }
     template<typename Functor>
@@ -335,6 +535,14 @@ public:
     INLINE void for_each(const Functor &func, const char *str, u64 l) {
         this->assign(str, l);
         if(!has_next_kmer()) return;
+        if(rolling_ && std::is_same<ScoreType, score::Lex>::value && sp_.unspaced() && !sp_.unwindowed()) {
+            for_each_rolling_minimizer_(func);
+            return;
+        }
+        if(fixed_ != FIXED_NONE && !std::is_same<ScoreType, score::Entropy>::value && !rolling_) {
+            for_each_fixed_(func);
+            return;
+        }
         if(canonicalize_) {
             if(sp_.unwindowed()) {
                  for_each_canon_unwindowed(func);
@@ -357,7 +565,7 @@ public:
     }
     template<typename Functor>
     INLINE void for_each(const Functor &func, kseq_t *ks) {
-        while(kseq_read(ks) >= 0) assign(ks), for_each<Functor>(func, ks->seq.s, ks->seq.l);
+        while(kseq_read(ks) >= 0) for_each<Functor>(func, ks->seq.s, ks->seq.l);
     }
     template<typename Functor>
     INLINE void for_each_canon(const Functor &func, kseq_t *ks) {
@@ -409,17 +617,16 @@ public:
         bool destroy;
         if(ks == nullptr) ks = kseq_init(fp), destroy = true;
         else            kseq_assign(ks, fp), destroy = false;
-        if(canonicalize_) for_each_canon<Functor>(func, ks);
-        else              for_each_uncanon<Functor>(func, ks);
+        // Dispatch per record through for_each(func, str, l) so that files, records, and chunks of records
+        // all take the same (scoring-specific) path.
+        for_each<Functor>(func, ks);
         if(destroy) kseq_destroy(ks);
     }
     template<typename Functor>
     void for_each(const Functor &func, const char *path, kseq_t *ks=nullptr) {
-        gzFile fp(gzopen(path, "rb"));
-        if(!fp) RUNTIME_ERROR(ks::sprintf("Could not open file at %s. Abort!\n", path).data());
-        if(canonicalize_) for_each_canon<Functor>(func, fp, ks);
-        else              for_each_uncanon<Functor>(func, fp, ks);
-        gzclose(fp);
+        GzReadAhead fp(path);
+        if(!fp.get()) RUNTIME_ERROR(ks::sprintf("Could not open file at %s. Abort!\n", path).data());
+        for_each<Functor>(func, fp.get(), ks);
     }
     template<typename Functor, typename ContainerType,
              typename=typename std::enable_if<std::is_same<typename ContainerType::value_type::value_type, char>::value ||
@@ -484,31 +691,133 @@ public:
     // This is the actual point of entry for fetching our minimizers.
     // It wraps encoding and scoring a kmer, updates qmap, and returns the minimizer
     // for the next window.
+    // K-mers with non-ACGT characters (BF) get the worst score so that they aren't selected.
     INLINE u64 next_minimizer() {
         //if(unlikely(!has_next_kmer())) return BF;
-        const u64 k(kmer(pos_++)), kscore(scorer_(k, data_));
+        const u64 k(kmer(pos_++)), kscore(k == BF ? BF: scorer_(k, data_));
         return qmap_.next_value(k, kscore);
     }
     INLINE u64 next_canonicalized_minimizer() {
         assert(has_next_kmer());
-        const u64 k(canonical_representation(kmer(pos_++), sp_.k_)), kscore(scorer_(k, data_));
+        u64 k(kmer(pos_++));
+        if(k != BF) k = canonical_representation(k, sp_.k_);
+        const u64 kscore(k == BF ? BF: scorer_(k, data_));
         return qmap_.next_value(k, kscore);
     }
     elscore_t max_in_queue() const {
         return qmap_.begin()->first;
     }
     bool canonicalize() const {return canonicalize_;}
+    fixed_encoder_t fixed() const {return fixed_;}
     void set_canonicalize(bool value) {canonicalize_ = value;}
     auto pos()   const {return pos_;}
     uint32_t k() const {return sp_.k_;}
     ~Encoder() {
-        if(std::is_same_v<ScoreType, score::Entropy> && sp_.unspaced() && !sp_.unwindowed()) {
-            delete static_cast<CircusEnt *>(data_);
+        if(std::is_same_v<ScoreType, score::Entropy>) {
+            delete static_cast<EntropyTable *>(data_);
+        }
+    }
+};
+
+/*
+ * WideEncoder:
+ * Encoder for k up to 64 (and combs of up to 64 bases), producing 128-bit kmers.
+ * It rolls packed windows like Encoder's packed path. For windows, kmers are folded to
+ * 64 bits before scoring, so ScoreType must work on arbitrary 64-bit values (not Entropy).
+ * A 64-mer of all Ts collides with the invalid kmer sentinel and is skipped,
+ * as is a 32-mer of all Ts with 64-bit kmers.
+ */
+template<typename ScoreType=score::Lex>
+class WideEncoder {
+    static_assert(!std::is_same<ScoreType, score::Entropy>::value, "Entropy scoring requires 64-bit kmers.");
+public:
+    static constexpr u128 INVALID = ~u128(0);
+    const Spacer sp_;
+private:
+    void                  *data_;
+    QueueMap<u128, u64>    qmap_;
+    const SpacedExtractor   ext_;
+    const ScoreType      scorer_;
+    bool           canonicalize_;
+public:
+    WideEncoder(const Spacer &sp, void *data=nullptr, bool canonicalize=true):
+        sp_(sp), data_(data), qmap_(sp_.w_ - sp_.c_ + 1), ext_(sp_), scorer_{}, canonicalize_(canonicalize)
+    {
+        if(sp_.c_ > SpacedExtractor::MAX_COMB)
+            RUNTIME_ERROR(ks::sprintf("Comb size %u exceeds %u, the most WideEncoder supports.", unsigned(sp_.c_), SpacedExtractor::MAX_COMB).data());
+    }
+    WideEncoder(const Spacer &sp, bool canonicalize): WideEncoder(sp, nullptr, canonicalize) {}
+    WideEncoder(const WideEncoder &other): WideEncoder(other.sp_, other.data_, other.canonicalize_) {}
+    static INLINE u64 fold(u128 kmer) {return u64(kmer) ^ wang_hash(u64(kmer >> 64));}
+    bool canonicalize() const {return canonicalize_;}
+    void set_canonicalize(bool value) {canonicalize_ = value;}
+    fixed_encoder_t fixed() const {return FIXED_NONE;}
+
+    template<typename Functor>
+    void for_each(const Functor &func, const char *s, u64 l) {
+        const unsigned c(sp_.c_), rcshift((c - 1) << 1);
+        const u128 wmask(~u128(0) >> (128 - (c << 1)));
+        const u64 bmask(UINT64_C(-1) >> (64 - c)), used(ext_.used());
+        const bool windowed(sp_.w_ > c), contiguous(c == sp_.k_);
+        u128 fw(0), rc(0), kmer, min;
+        u64 bad(bmask), code;
+        if(windowed) qmap_.reset();
+        for(u64 i(0); i < l; ++i) {
+            bad = (bad << 1) & bmask;
+            if(unlikely((code = cstr_lut[s[i]]) == BF)) bad |= 1, code = 0;
+            fw = ((fw << 2) | code) & wmask;
+            rc = (rc >> 2) | (u128(3 - code) << rcshift);
+            if(i + 1 < c) continue;
+            if(unlikely(bad & used)) kmer = INVALID;
+            else if(contiguous) kmer = canonicalize_ && rc < fw ? rc: fw;
+            else {
+                kmer = ext_.fw128(fw);
+                if(canonicalize_) {
+                    const u128 rkmer(ext_.rc128(rc));
+                    if(rkmer < kmer) kmer = rkmer;
+                }
+            }
+            if(windowed) {
+                if((min = qmap_.next_value(kmer, kmer == INVALID ? BF: scorer_(fold(kmer), data_))) != INVALID) func(min);
+            } else if(kmer != INVALID) func(kmer);
         }
-        std::free(rolling_seeds_);
+    }
+    template<typename Functor>
+    void for_each(const Functor &func, kseq_t *ks) {
+        while(kseq_read(ks) >= 0) for_each(func, ks->seq.s, ks->seq.l);
+    }
+    template<typename Functor>
+    void for_each(const Functor &func, const char *path, kseq_t *ks=nullptr) {
+        GzReadAhead fp(path);
+        if(!fp.get()) RUNTIME_ERROR(ks::sprintf("Could not open file at %s. Abort!\n", path).data());
+        bool destroy;
+        if(ks == nullptr) ks = kseq_init(fp.get()), destroy = true;
+        else              kseq_assign(ks, fp.get()), destroy = false;
+        for_each(func, ks);
+        if(destroy) kseq_destroy(ks);
+    }
+    void add(khash_t(all128) *set, const char *path, kseq_t *ks=nullptr) {
+        int khr;
+        this->for_each([&](u128 min) {
+            kh_put(all128, set, min, &khr);
+            if(unlikely(khr < 0)) throw std::runtime_error(ks::sprintf("Failed to insert key into hash map. Size of map: %zu\n", kh_size(set)).data());
+        }, path, ks);
     }
 };
 
+// Which kmer representation, hash tables and encoder go together.
+template<typename KmerType> struct kmer_traits;
+template<> struct kmer_traits<u64> {
+    using set_type = khash_t(all);
+    using lca_type = khash_t(c);
+    template<typename ScoreType> using encoder_type = Encoder<ScoreType>;
+};
+template<> struct kmer_traits<u128> {
+    using set_type = khash_t(all128);
+    using lca_type = khash_t(c128);
+    template<typename ScoreType> using encoder_type = WideEncoder<ScoreType>;
+};
+
 template<typename ScoreType, typename KhashType>
 void add_to_khash(KhashType *kh, Encoder<ScoreType> &enc, kseq_t *ks) {
     u64 min(BF);
@@ -550,6 +859,71 @@ khash_t(all) *hashcount_lmers(const std::string &path, const Spacer &space,
     return ret;
 }
 
+// Splitting single large inputs across threads.
+// Sequences are cut into chunks which overlap by w - 1 bases, so that every window (or k-mer, if unwindowed)
+// lies entirely within at least one chunk. Windows in the overlap are emitted twice, so this is only for
+// consumers which are insensitive to duplicates, like filling sets.
+// Records shorter than a chunk are batched together (but never joined) so that small records still spread across threads.
+template<typename ScoreType, typename Functor>
+struct chunk_helper {
+    const std::vector<std::pair<const char *, u64>>        &chunks_;
+    std::vector<std::unique_ptr<Encoder<ScoreType>>>          &encs_;
+    const Functor                                             &func_;
+};
+
+template<typename ScoreType, typename Functor>
+void chunk_helper_fn(void *data_, long index, int tid) {
+    auto &h(*(chunk_helper<ScoreType, Functor> *)data_);
+    const auto &chunk(h.chunks_[index]);
+    h.encs_[tid]->for_each([&](u64 min) {h.func_(min, tid);}, chunk.first, chunk.second);
+}
+
+template<typename ScoreType, typename Functor>
+void for_each_chunked(const Functor &func, const char *path, const Spacer &sp, void *data, bool canon,
+                      int num_threads, u64 chunk_size=1 << 22, kseq_t *ks=nullptr) {
+    // func is called as func(min, tid), with tid in [0, num_threads).
+    if(num_threads <= 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+    const u64 overlap(sp.w_ - 1);
+    if(chunk_size <= overlap) chunk_size = overlap + 1;
+    std::vector<std::unique_ptr<Encoder<ScoreType>>> encs;
+    while(encs.size() < (unsigned)num_threads) encs.emplace_back(new Encoder<ScoreType>(nullptr, 0, sp, data, canon));
+    std::vector<std::pair<const char *, u64>> chunks;
+    std::string batch; // Holds small records until there are enough bases to split across threads.
+    std::vector<std::pair<u64, u64>> batch_spans;
+    const u64 batch_limit(chunk_size * num_threads);
+    chunk_helper<ScoreType, Functor> helper{chunks, encs, func};
+    auto run = [&]() {
+        kt_for(num_threads, &chunk_helper_fn<ScoreType, Functor>, &helper, chunks.size());
+        chunks.clear();
+    };
+    auto flush_batch = [&]() {
+        for(const auto &span: batch_spans) chunks.emplace_back(batch.data() + span.first, span.second);
+        run();
+        batch.clear(), batch_spans.clear();
+    };
+    GzReadAhead fp(path, num_threads);
+    if(!fp.get()) RUNTIME_ERROR(ks::sprintf("Could not open file at %s. Abort!\n", path).data());
+    bool destroy;
+    if(ks == nullptr) ks = kseq_init(fp.get()), destroy = true;
+    else              kseq_assign(ks, fp.get()), destroy = false;
+    while(kseq_read(ks) >= 0) {
+        const u64 l(ks->seq.l);
+        if(l < sp.c_) continue;
+        if(l <= chunk_size) {
+            batch_spans.emplace_back(batch.size(), l);
+            batch.append(ks->seq.s, l);
+            if(batch.size() >= batch_limit) flush_batch();
+            continue;
+        }
+        // Large record: split in place. ks->seq is untouched until the next kseq_read.
+        for(u64 start(0); start + overlap < l; start += chunk_size)
+            chunks.emplace_back(ks->seq.s + start, std::min(chunk_size + overlap, l - start));
+        run();
+    }
+    if(batch_spans.size()) flush_batch();
+    if(destroy) kseq_destroy(ks);
+}
+
 template<typename ScoreType>
 void add_to_hll(hll::hll_t &hll, kseq_t *ks, Encoder<ScoreType> &enc) {
     u64 min(BF);
@@ -579,9 +953,27 @@ void add_to_hll(hll::hll_t &hll, kseq_t *ks, Encoder<ScoreType> &enc) {
     }
 }
 
+// Adds an already-hashed value. hll_t can take it directly; other sketches hash again.
+template<typename SketchType>
+INLINE void add_hashed(SketchType &sketch, u64 hashval) {sketch.addh(hashval);}
+INLINE void add_hashed(hll::hll_t &sketch, u64 hashval) {sketch.add(hashval);}
+
+// Sketches every kmer of length k (which may exceed 32) by its ntHash value.
+template<typename SketchType>
+void fill_rolling_lmers(SketchType &sketch, const std::string &path, unsigned k, bool canonicalize=true,
+                        u64 seed=DEFAULT_ROLLING_SEED, kseq_t *ks=nullptr) {
+    sketch.not_ready();
+    RollingHasher(k, seed).for_each_hash([&](u64 hash) {add_hashed(sketch, hash);}, path, canonicalize, ks);
+}
+
 template<typename ScoreType, typename SketchType>
 void fill_lmers(SketchType &sketch, const std::string &path, const Spacer &space, bool canonicalize=true,
                 void *data=nullptr, kseq_t *ks=nullptr) {
+    if(space.unspaced() && space.unwindowed()) {
+        // Every kmer is kept, so hash them as we roll instead of encoding, canonicalizing and hashing each one.
+        fill_rolling_lmers(sketch, path, space.k_, canonicalize, DEFAULT_ROLLING_SEED, ks);
+        return;
+    }
 #if USE_HASH_FILLER
     detail::HashFiller<SketchType> hf(sketch);
 #endif
@@ -600,52 +992,87 @@ void hll_fill_lmers(hll::hll_t &hll, const std::string &path, const Spacer &spac
     fill_lmers<ScoreType>(hll, path, space, canonicalize, data, nullptr);
 }
 
-#define SUB_CALL \
-    std::async(std::launch::async,\
-               hashcount_lmers<ScoreType>, paths[submitted], space, canonicalize, data)
+// Exact distinct k-mer counting.
+// K-mers are routed by hash to one of nparts partitions, each a khash set behind its own lock.
+// Workers buffer k-mers per partition and flush in batches, so a lock is taken once per batch, not per k-mer,
+// and every distinct k-mer is stored once (no per-file tables and no serial union at the end).
+// With npasses > 1, each pass over the input keeps only 1/npasses of the partitions, trading re-reading input
+// for a proportional cut in peak memory.
+struct count_part {
+    khash_t(all) set_;
+    std::mutex     m_;
+    count_part(): set_{0, 0, 0, 0, nullptr, nullptr, nullptr} {}
+    ~count_part() {std::free(set_.keys), std::free(set_.flags);}
+};
+
+template<typename ScoreType>
+struct count_helper {
+    const Spacer                      &sp_;
+    const std::vector<std::string> &paths_;
+    std::vector<count_part>         &parts_;
+    kseq_t                            *ks_;
+    const bool                      canon_;
+    void                            *data_;
+    const unsigned                 npasses_;
+    unsigned                          pass_;
+    static constexpr size_t BATCH_SIZE = 1 << 10;
+
+    void flush(std::vector<u64> &buf, size_t part) {
+        if(buf.empty()) return;
+        int khr;
+        auto &p(parts_[part]);
+        {
+            std::lock_guard<std::mutex> lock(p.m_);
+            for(const u64 kmer: buf) kh_put(all, &p.set_, kmer, &khr);
+        }
+        buf.clear();
+    }
+};
+
+template<typename ScoreType>
+void count_helper_fn(void *data_, long index, int tid) {
+    count_helper<ScoreType> &h(*(count_helper<ScoreType> *)(data_));
+    const size_t nparts(h.parts_.size());
+    // Route by the high bits: khash takes its buckets from the low bits of the same hash,
+    // so masking them would leave each partition's table using only 1/nparts of its buckets.
+    const int shift(64 - log2_64(nparts));
+    std::vector<std::vector<u64>> bufs(nparts);
+    Encoder<ScoreType> enc(nullptr, 0, h.sp_, h.data_, h.canon_);
+    enc.for_each([&](u64 min) {
+        const size_t part(wang_hash(min) >> shift);
+        if(part % h.npasses_ != h.pass_) return;
+        auto &buf(bufs[part]);
+        buf.push_back(min);
+        if(buf.size() == count_helper<ScoreType>::BATCH_SIZE) h.flush(buf, part);
+    }, h.paths_[index].data(), h.ks_ + tid);
+    for(size_t i(0); i < nparts; ++i) h.flush(bufs[i], i);
+}
 
 template<typename ScoreType>
 u64 count_cardinality(const std::vector<std::string> paths,
                       unsigned k, uint16_t w, spvec_t spaces,
                       bool canonicalize,
-                      void *data=nullptr, int num_threads=-1) {
+                      void *data=nullptr, int num_threads=-1, unsigned npasses=1) {
     // Default to using all available threads.
     if(num_threads < 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(num_threads == 0) num_threads = 1;
+    if(npasses == 0) npasses = 1;
     const Spacer space(k, w, spaces);
-    u64 submitted(0), completed(0), todo(paths.size());
-    std::vector<std::future<khash_t(all) *>> futures;
-    std::vector<khash_t(all) *> hashes;
-    // Submit the first set of jobs
-    while(futures.size() < (unsigned)num_threads && futures.size() < todo)
-        futures.emplace_back(SUB_CALL), ++submitted;
-    // Daemon -- check the status of currently running jobs, submit new ones when available.
-    while(submitted < todo) {
-        static const int max_retries = 10;
-        for(auto &f: futures) {
-            if(is_ready(f)) {
-                hashes.push_back(f.get());
-                int success(0), tries(0);
-                while(!success) {
-                    try {
-                        f = SUB_CALL;
-                        ++submitted;
-                        ++completed;
-                        success = 1;
-                    } catch (std::system_error &se) {
-                          LOG_WARNING("System error: resource temporarily available. Retry #%i\n", tries + 1);
-                          if(++tries >= max_retries) {LOG_EXIT("Exceeded maximum retries\n"); throw;}
-                          sleep(1);
-                    }
-                }
-            }
+    // Plenty of partitions to keep lock contention low; a power of two so routing is a shift.
+    size_t nparts(roundup64((u64)num_threads * 16));
+    while(nparts < npasses) nparts <<= 1;
+    KSeqBufferHolder kseqs(num_threads);
+    u64 ret(0);
+    for(unsigned pass(0); pass < npasses; ++pass) {
+        std::vector<count_part> parts(nparts);
+        count_helper<ScoreType> helper{space, paths, parts, kseqs.data(), canonicalize, data, npasses, pass};
+        {
+            ForPool pool(num_threads);
+            pool.forpool(&count_helper_fn<ScoreType>, &helper, paths.size());
         }
+        for(const auto &part: parts) ret += kh_size(&part.set_);
+        if(npasses > 1) LOG_DEBUG("Pass %u/%u: %" PRIu64 " distinct k-mers so far.\n", pass + 1, npasses, ret);
     }
-    // Get values from the rest of these threads.
-    for(auto &f: futures) if(f.valid()) hashes.push_back(f.get());
-    // Combine them all for a final count
-    for(auto i(hashes.begin() + 1), end = hashes.end(); i != end; ++i) kset_union(hashes[0], *i);
-    u64 ret(hashes[0]->n_occupied);
-    for(auto i: hashes) khash_destroy(i);
     return ret;
 }
 
@@ -737,5 +1164,40 @@ u64 estimate_cardinality(const std::vector<std::string> &paths,
     return tmp.report();
 }
 
+struct rolling_est_helper {
+    const std::vector<std::string> &paths_;
+    std::vector<hll::hll_t>         &hlls_;
+    kseq_t                            *ks_;
+    const unsigned                      k_;
+    const bool                      canon_;
+};
+
+inline void rolling_est_helper_fn(void *data_, long index, int tid) {
+    auto &h(*(rolling_est_helper *)data_);
+    fill_rolling_lmers(h.hlls_[tid], h.paths_[index], h.k_, h.canon_, DEFAULT_ROLLING_SEED, h.ks_ + tid);
+}
+
+// Estimates the number of distinct kmers for any k, including k > 32.
+inline u64 estimate_rolling_cardinality(const std::vector<std::string> &paths, unsigned k, bool canon=true,
+                                        int num_threads=-1, u64 np=23) {
+    if(num_threads <= 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<hll::hll_t> hlls;
+    while(hlls.size() < (unsigned)num_threads) hlls.emplace_back(np);
+    KSeqBufferHolder kseqs(num_threads);
+    rolling_est_helper helper{paths, hlls, kseqs.data(), k, canon};
+    {
+        ForPool pool(num_threads);
+        pool.forpool(&rolling_est_helper_fn, &helper, paths.size());
+    }
+    for(size_t i(1); i < hlls.size(); hlls[0] += hlls[i++]);
+    return hlls[0].report();
+}
+
+// HLL relative standard error is ~1.04/sqrt(2^np). Padding by a few of those gives a size
+// that the true cardinality will essentially never exceed.
+inline u64 cardinality_upper_bound(u64 est, u64 np, double nsigma=3.) {
+    return static_cast<u64>(est * (1. + nsigma * 1.03896 / std::sqrt(static_cast<double>(u64(1) << np))));
+}
+
 } //namespace bns
 #endif // _EMP_ENCODER_H__
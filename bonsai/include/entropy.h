@@ -1,69 +1,51 @@
 #pragma once
-#include "circular_buffer.h"
+#include <cmath>
+#include <vector>
 #include "kmerutil.h"
 
 namespace bns {
 
-class CircusEnt {
-    circ::deque<char> q_;
-    uint8_t   counts_[4];
-    uint8_t        cqsz_;
-    const uint8_t   qsz_;
-    const double qszinv_;
+/*
+ * EntropyTable:
+ * Integer entropy scores for every (A, C, G, T) count tuple of a k-mer,
+ * so that scoring needs no log2 or floating point on the hot path.
+ * Counts index the table as (nA * (k + 1) + nC) * (k + 1) + nG; nT is implied by k.
+ * Scores are UINT64_MAX - SCALE * H, where H is the Shannon entropy in bits, in [0, 2],
+ * so that the highest-entropy k-mers have the lowest scores and are selected as minimizers.
+ */
+class EntropyTable {
+    std::vector<u64> scores_;
+    u32      delta_[4];
+    const u32       k_;
 public:
-    static constexpr double NOT_FULL = -1.;
-    CircusEnt(unsigned qsz): q_(qsz), counts_{0}, cqsz_(0), qsz_(qsz), qszinv_(1./qsz) {
-        if(qsz == 0 || qsz > 255) RUNTIME_ERROR(std::string("Illegal queue size with qsz = " + std::to_string(qsz) + " and maximum value " + std::to_string(std::numeric_limits<uint8_t>::max())));
+    static constexpr u64 SCALE = UINT64_C(7958933093282078720);
+    static double entropy(unsigned a, unsigned c, unsigned g, unsigned t, unsigned k) {
+        const double kinv(1. / k);
+        double ret(0.);
+        for(const unsigned count: {a, c, g, t})
+            if(count) ret -= kinv * count * std::log2(kinv * count);
+        return ret;
     }
-    CircusEnt(const CircusEnt &other): q_(other.q_), qsz_(other.qsz_), qszinv_(other.qszinv_) {
-        std::memcpy(counts_, other.counts_, sizeof(counts_));
+    EntropyTable(unsigned k): k_(k) {
+        if(k == 0 || k > 32) RUNTIME_ERROR(std::string("Illegal k for entropy table: ") + std::to_string(k));
+        const u32 stride(k + 1);
+        delta_[0] = stride * stride, delta_[1] = stride, delta_[2] = 1, delta_[3] = 0;
+        scores_.resize(size_t(stride) * stride * stride, UINT64_C(-1));
+        for(unsigned a(0); a <= k; ++a)
+            for(unsigned c(0); a + c <= k; ++c)
+                for(unsigned g(0); a + c + g <= k; ++g)
+                    scores_[a * delta_[0] + c * delta_[1] + g] = UINT64_C(-1) - static_cast<u64>(SCALE * entropy(a, c, g, k - a - c - g, k));
     }
-    CircusEnt(CircusEnt &&other) = default;
-    void clear() {
-        *(reinterpret_cast<uint32_t *>(counts_)) = cqsz_ = 0;
-        q_.clear();
-    }
-    void push(char c) {
-#if !NDEBUG
-        if(cqsz_ == qsz_) {
-            auto to_pop = cstr_lut[q_.pop()];
-            assert(to_pop != static_cast<int8_t>(-1));
-            assert(counts_[to_pop]);
-            --counts_[to_pop];
-        }
-        q_.push(c);
-        assert(cstr_lut[c] != static_cast<int8_t>(-1));
-        ++counts_[cstr_lut[c]];
-        static_assert(std::is_unsigned_v<std::decay_t<decltype(q_.size())>>, "q's size should be unsigned.");
-        assert(unsigned(counts_[0] + counts_[1] + counts_[2] + counts_[3]) == q_.size());
-#else
-        // Increment count of added nucleotide
-        // If not fu
-        ++counts_[cstr_lut[c]];
-        if(cqsz_ == qsz_) {
-            --counts_[cstr_lut[q_.pop()]]; // Pop and decrement
-        } else {
-            ++cqsz_;                       // Or just keep filling the window
-        }
-        q_.push(c);
-#endif
-    }
-    double value() const {
-        if(unlikely(cqsz_ < qsz_)) return NOT_FULL;
-        assert(cqsz_ == q_.size());
-        double tmp(qszinv_ * (counts_[0])), sum(tmp * std::log2(tmp));
-        tmp = qszinv_ * counts_[1], sum += tmp * std::log2(tmp);
-        tmp = qszinv_ * counts_[2], sum += tmp * std::log2(tmp);
-        tmp = qszinv_ * counts_[3], sum += tmp * std::log2(tmp);
-        return sum;
-    }
-    u64 score() const {
-        return UINT64_MAX - static_cast<u64>(UINT64_C(7958933093282078720) * value());
-    }
-    double next_ent(char c) {
-        push(c);
-        return value();
+    u32 k() const {return k_;}
+    // Index change when a base (2-bit code) enters the window. Subtract it when the base leaves.
+    INLINE u32 delta(u64 code) const {return delta_[code];}
+    INLINE u64 score(u32 index) const {return scores_[index];}
+    INLINE u32 index(u64 kmer) const {
+        const u64 lo(kmer & UINT64_C(0x5555555555555555)), hi((kmer >> 1) & UINT64_C(0x5555555555555555));
+        const u32 nt(__builtin_popcountll(lo & hi)), ng(__builtin_popcountll(hi & ~lo)), nc(__builtin_popcountll(lo & ~hi));
+        return (k_ - nt - ng - nc) * delta_[0] + nc * delta_[1] + ng;
     }
+    INLINE u64 kmer_score(u64 kmer) const {return scores_[index(kmer)];}
 };
 
 } // namespace bns
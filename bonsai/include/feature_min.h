@@ -3,9 +3,9 @@
 #include "encoder.h"
 #include "spacer.h"
 #include "khash64.h"
-#include "util.h"
+#include "taxonomy.h"
 #include "klib/kthread.h"
-#include <set>
+#include <mutex>
 
 // Decode 64-bit hash (contains both tax id and taxonomy depth for id)
 #define TDtax(key) ((tax_t)key)
@@ -23,44 +23,113 @@
 namespace bns {
 
 
-inline khash_t(c) *make_depth_hash(khash_t(c) *lca_map, khash_t(p) *tax_map);
-inline void lca2depth(khash_t(c) *lca_map, khash_t(p) *tax_map);
+inline khash_t(c) *make_depth_hash(khash_t(c) *lca_map, const Taxonomy *tax_map);
+inline void lca2depth(khash_t(c) *lca_map, const Taxonomy *tax_map);
 
-inline khash_t(64) *make_taxdepth_hash(khash_t(c) *kc, const khash_t(p) *tax);
+inline khash_t(64) *make_taxdepth_hash(khash_t(c) *kc, const Taxonomy *tax);
 
 
-inline void update_lca_map(khash_t(c) *kc, const khash_t(all) *set, const khash_t(p) *tax, tax_t taxid);
-inline void update_td_map(khash_t(64) *kc, const khash_t(all) *set, const khash_t(p) *tax, tax_t taxid);
-inline void update_feature_counter(khash_t(64) *kc, const khash_t(all) *set, const khash_t(p) *tax, tax_t taxid);
-inline void update_minimized_map(const khash_t(all) *set, const khash_t(64) *full_map, khash_t(c) *ret);
+inline void update_lca_map(khash_t(c) *kc, const khash_t(all) *set, LcaCache &cache, tax_t taxid, int num_threads);
+inline void lca_merge(khash_t(c) *dest, const khash_t(c) *src, const Taxonomy *tax, int num_threads);
+struct lca_merge_helper {
+    khash_t(c)                                       *dest_;
+    const khash_t(c)                                  *src_;
+    std::vector<LcaCache>                            &caches_;
+    std::vector<std::vector<std::pair<u64, tax_t>>> &missing_;
+    const khint_t                                    chunk_;
+};
+
+inline void lca_merge_helper_fn(void *data_, long index, int tid) {
+    // Lookups in dest are read-only and each src key owns a distinct slot in dest,
+    // so shared keys can be updated in place without locking.
+    lca_merge_helper &h(*(lca_merge_helper *)data_);
+    LcaCache &cache(h.caches_[tid]);
+    khiter_t kd;
+    for(khiter_t ki(index * h.chunk_), end(std::min(ki + h.chunk_, kh_end(h.src_))); ki < end; ++ki) {
+        if(!kh_exist(h.src_, ki)) continue;
+        if((kd = kh_get(c, h.dest_, kh_key(h.src_, ki))) == kh_end(h.dest_))
+            h.missing_[tid].emplace_back(kh_key(h.src_, ki), kh_val(h.src_, ki));
+        else if(kh_val(h.dest_, kd) != kh_val(h.src_, ki))
+            kh_val(h.dest_, kd) = cache.lca(kh_val(h.dest_, kd), kh_val(h.src_, ki));
+    }
+}
+
+// LCA-union of src into dest.
+inline void lca_merge(khash_t(c) *dest, const khash_t(c) *src, const Taxonomy *tax, int num_threads) {
+    if(num_threads <= 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::vector<std::pair<u64, tax_t>>> missing(num_threads);
+    std::vector<LcaCache> caches;
+    for(int i(0); i < num_threads; ++i) caches.emplace_back(tax);
+    const khint_t chunk(1 << 16);
+    lca_merge_helper helper{dest, src, caches, missing, chunk};
+    {
+        ForPool pool(num_threads);
+        pool.forpool(&lca_merge_helper_fn, &helper, (kh_end(src) + chunk - 1) / chunk);
+    }
+    size_t nmissing(0);
+    for(const auto &v: missing) nmissing += v.size();
+    LOG_INFO("Merging %zu keys: %zu shared, %zu new.\n", kh_size(src), kh_size(src) - nmissing, nmissing);
+    const size_t needed(khash_buckets_for(kh_size(dest) + nmissing));
+    if(needed > dest->n_buckets) kh_resize(c, dest, needed);
+    int khr;
+    khiter_t kd;
+    for(auto &v: missing) {
+        for(const auto &pair: v) {
+            kd = kh_put(c, dest, pair.first, &khr);
+            if(unlikely(khr < 0))
+                RUNTIME_ERROR(ks::sprintf("Could not insert key %" PRIu64 " to table of size %zu.", pair.first, kh_size(dest)).data());
+            kh_val(dest, kd) = pair.second;
+        }
+        std::vector<std::pair<u64, tax_t>>().swap(v);
+    }
+}
+
+inline void update_lca_map(khash_t(c128) *kc, const khash_t(all128) *set, LcaCache &cache, tax_t taxid) {
+    // khash_parallel_grow only handles 64-bit keys, so these tables grow the usual way.
+    int khr;
+    khint_t k2;
+    for(khiter_t ki(kh_begin(set)); ki < kh_end(set); ++ki) {
+        if(!kh_exist(set, ki)) continue;
+        if((k2 = kh_get(c128, kc, kh_key(set, ki))) == kh_end(kc)) {
+            k2 = kh_put(c128, kc, kh_key(set, ki), &khr);
+            if(unlikely(khr < 0))
+                RUNTIME_ERROR(ks::sprintf("Could not insert key to table of size %zu.", kh_size(kc)).data());
+            kh_val(kc, k2) = taxid;
+        } else if(kh_val(kc, k2) != taxid) kh_val(kc, k2) = cache.lca(taxid, kh_val(kc, k2));
+    }
+}
+
+inline void update_td_map(khash_t(64) *kc, const khash_t(all) *set, LcaCache &cache, tax_t taxid, int num_threads);
+inline void update_feature_counter(khash_t(64) *kc, const khash_t(all) *set, LcaCache &cache, tax_t taxid, int num_threads);
+inline void update_minimized_map(const khash_t(all) *set, const ScoreIndex *full_map, khash_t(c) *ret, int num_threads);
 
 // Wrap these in structs so that downstream code can be managed as a set, not updated one-by-one.
 struct LcaMap {
     using ReturnType = khash_t(c) *;
     static constexpr size_t ValSize = sizeof(*(ReturnType{0})->vals);
-    static void update(const khash_t(p) *tax, const khash_t(all) *set, const khash_t(64) *d64, khash_t(c) *r32, khash_t(64) *r64, tax_t taxid) {
-        update_lca_map(r32, set, tax, taxid);
+    static void update(LcaCache &cache, const khash_t(all) *set, const ScoreIndex *index, khash_t(c) *r32, khash_t(64) *r64, tax_t taxid, int num_threads) {
+        update_lca_map(r32, set, cache, taxid, num_threads);
     }
 };
 struct TdMap {
     using ReturnType = khash_t(64) *;
     static constexpr size_t ValSize = sizeof(*(ReturnType{0})->vals);
-    static void update(const khash_t(p) *tax, const khash_t(all) *set, const khash_t(64) *d64, khash_t(c) *r32, khash_t(64) *r64, tax_t taxid) {
-        update_td_map(r64, set, tax, taxid);
+    static void update(LcaCache &cache, const khash_t(all) *set, const ScoreIndex *index, khash_t(c) *r32, khash_t(64) *r64, tax_t taxid, int num_threads) {
+        update_td_map(r64, set, cache, taxid, num_threads);
     }
 };
 struct FcMap {
     using ReturnType = khash_t(64) *;
     static constexpr size_t ValSize = sizeof(*(ReturnType{0})->vals);
-    static void update(const khash_t(p) *tax, const khash_t(all) *set, const khash_t(64) *d64, khash_t(c) *r32, khash_t(64) *r64, tax_t taxid) {
-        update_feature_counter(r64, set, tax, taxid);
+    static void update(LcaCache &cache, const khash_t(all) *set, const ScoreIndex *index, khash_t(c) *r32, khash_t(64) *r64, tax_t taxid, int num_threads) {
+        update_feature_counter(r64, set, cache, taxid, num_threads);
     }
 };
 struct MinMap {
     using ReturnType = khash_t(c) *;
     static constexpr size_t ValSize = sizeof(*(ReturnType{0})->vals);
-    static void update(const khash_t(p) *tax, const khash_t(all) *set, const khash_t(64) *d64, khash_t(c) *r32, khash_t(64) *r64, tax_t taxid) {
-        update_minimized_map(set, d64, r32);
+    static void update(LcaCache &cache, const khash_t(all) *set, const ScoreIndex *index, khash_t(c) *r32, khash_t(64) *r64, tax_t taxid, int num_threads) {
+        update_minimized_map(set, index, r32, num_threads);
     }
 };
 
@@ -86,70 +155,76 @@ size_t fill_set_genome_container(Container &container, const Spacer &sp, khash_t
 
 
 template<typename ScoreType, typename MapUpdater>
-typename MapUpdater::ReturnType
-make_map(const std::vector<std::string> fns, const khash_t(p) *tax_map, const char *seq2tax_path, const Spacer &sp, int num_threads, bool canon, size_t start_size, const khash_t(64) *data) {
-    MapUpdater mu;
+struct map_helper {
+    const std::vector<std::string> &fns_;
+    const std::vector<tax_t>    &taxids_;
+    LcaCache                    &cache_;
+    const Spacer                   &sp_;
+    const ScoreIndex             *data_;
+    khash_t(c)                    *r32_;
+    khash_t(64)                   *r64_;
+    khash_t(all)             *counters_;
+    kseq_t                        *kseqs_;
+    std::mutex                        &m_;
+    const bool                    canon_;
+    const int               num_threads_;
+};
 
-    khash_t(c) *r32 = nullptr;
-    khash_t(64) *r64 = nullptr;
-    // Update this to include tax ids in the hash map.
-    size_t submitted(0), completed(0), todo(fns.size());
+template<typename ScoreType, typename MapUpdater>
+void map_helper_fn(void *data_, long index, int tid) {
+    // Each worker owns counters_[tid] and kseqs_[tid]; only the merge into the shared map (and the LCA memo) is serialized.
+    map_helper<ScoreType, MapUpdater> &h(*(map_helper<ScoreType, MapUpdater> *)data_);
+    khash_t(all) *counter(h.counters_ + tid);
+    kh_clear(all, counter);
+    fill_set_genome<ScoreType>(h.fns_[index].data(), h.sp_, counter, index, (void *)h.data_, h.canon_, h.kseqs_ + tid);
+    {
+        LockSmith<std::mutex> lock(h.m_);
+        MapUpdater::update(h.cache_, counter, h.data_, h.r32_, h.r64_, h.taxids_[index], h.num_threads_);
+    }
+    LOG_DEBUG("Finished genome %ld (%s) on thread %i\n", index, h.fns_[index].data(), tid);
+}
+
+// Files at least this large (on disk) are encoded by all threads rather than one.
+static constexpr size_t BIG_GENOME_BYTES = size_t(1) << 28;
+// log2 of the entries in the LCA memo shared by all genomes of a build (1 MiB).
+static constexpr unsigned BUILD_LCA_CACHE_BITS = 16;
+
+// Encodes each genome in fns and merges it into r32/r64 (whichever MapUpdater uses), which may already be populated.
+template<typename ScoreType, typename MapUpdater>
+void fill_map(khash_t(c) *r32, khash_t(64) *r64, const std::vector<std::string> &fns, const Taxonomy *tax_map, const char *seq2tax_path, const Spacer &sp, int num_threads, bool canon, const ScoreIndex *data) {
     if(num_threads < 0) num_threads = std::thread::hardware_concurrency();
+    if(num_threads == 0) num_threads = 1;
     std::vector<khash_t(all)> counters(num_threads);
     std::memset(counters.data(), 0, sizeof(khash_t(all)) * counters.size());
-    LOG_DEBUG("Started things\n");
-    if(MapUpdater::ValSize == 8) {
-        r64 = static_cast<khash_t(64) *>(std::calloc(sizeof(khash_t(64)), 1));
-        kh_resize(64, r64, start_size);
-    } else {
-        r32 = static_cast<khash_t(c) *>(std::calloc(sizeof(khash_t(c)), 1));
-        kh_resize(c, r32, start_size);
-    }
     khash_t(name) *name_hash(build_name_hash(seq2tax_path));
-    std::vector<std::future<size_t>> futures;
-    // Mkae the future return the kseq pointer and then use it for resubmission.
-    // TODO: Also use a fixed st of kh_all sets to reduce memory allocations.
+    const std::vector<tax_t> taxids(get_taxids(fns, name_hash, num_threads));
+    destroy_name_hash(name_hash);
     KSeqBufferHolder kseqs(num_threads);
-    std::vector<uint32_t> counter_map;
-
-    // Submit the first set of jobs
-    std::set<size_t> used;
-    for(size_t i(0); i < (unsigned)num_threads && i < todo; ++i) {
-        futures.emplace_back(std::async(
-          std::launch::async, fill_set_genome<ScoreType>, fns[i].data(), sp, counters.data() + i, i, (void *)data, canon, kseqs.data() + submitted));
-        counter_map.emplace_back(submitted);
-        LOG_DEBUG("Submitted for %zu.\n", submitted);
-        ++submitted;
-    }
-
-    // Daemon -- check the status of currently running jobs, submit new ones when available.
-    while(submitted < todo) {
-        if(auto it = std::find_if(std::begin(futures), std::end(futures), [](auto &f) {return is_ready(f);}); it != futures.end()) {
-            auto &f(*it);
-            const size_t index(f.get());
-            if(submitted == todo) break;
-            if(used.find(index) != used.end()) continue;
-            used.insert(index);
-            const auto coffset = counter_map.at(index);
-            khash_t(all) *counter = counters.data() + coffset; // Pointer to the counter to use
-            kseq_t *ks_to_submit = kseqs.data() + coffset;
-            f = std::async(
-              std::launch::async, fill_set_genome<ScoreType>, fns[submitted].data(),
-              sp, counter, submitted, (void *)data, canon, ks_to_submit);
-            counter_map.emplace_back(coffset);
-            ++submitted, ++completed;
-            LOG_DEBUG("Have now submitted %zu element\n", submitted);
-            const tax_t taxid(get_taxid(fns[index].data(), name_hash));
-            mu.update(tax_map, counter, data, r32, r64, taxid);
+    // One memo for the whole build, since updates are serialized: related genomes keep asking for the same pairs.
+    LcaCache cache(tax_map, BUILD_LCA_CACHE_BITS);
+    // Genomes too large to leave on one thread are split into chunks and encoded by all threads, one at a time.
+    // Everything else is handed out a genome per thread.
+    std::vector<std::string> small;
+    std::vector<tax_t> small_taxids;
+    for(size_t i(0); i < fns.size(); ++i) {
+        const std::string &fn(fns[i]);
+        if(num_threads == 1 || filesize(fn.data()) < static_cast<ssize_t>(BIG_GENOME_BYTES)) {
+            small.push_back(fn);
+            small_taxids.push_back(taxids[i]);
+            continue;
         }
+        LOG_INFO("Splitting %s across %i threads.\n", fn.data(), num_threads);
+        for(auto &counter: counters) kh_clear(all, &counter);
+        for_each_chunked<ScoreType>([&](u64 min, int tid) {int khr; kh_put(all, &counters[tid], min, &khr);},
+                                    fn.data(), sp, (void *)data, canon, num_threads, 1 << 22, kseqs.data());
+        for(int j(1); j < num_threads; ++j) kset_union(&counters[0], &counters[j]);
+        MapUpdater::update(cache, &counters[0], data, r32, r64, taxids[i], num_threads);
     }
-
-    // Join
-    for(auto &f: futures) if(f.valid()) {
-        const size_t index(f.get());
-        const tax_t taxid(get_taxid(fns[index].data(), name_hash));
-        mu.update(tax_map, counters.data() + index, data, r32, r64, taxid);
-        ++completed;
+    std::mutex m;
+    map_helper<ScoreType, MapUpdater> helper{small, small_taxids, cache, sp, data, r32, r64, counters.data(), kseqs.data(), m, canon, num_threads};
+    {
+        ForPool pool(num_threads);
+        pool.forpool(&map_helper_fn<ScoreType, MapUpdater>, &helper, small.size());
     }
 
     // Clean up
@@ -157,7 +232,21 @@ make_map(const std::vector<std::string> fns, const khash_t(p) *tax_map, const ch
         std::free(counter.flags);
         std::free(counter.keys);
     }
-    kh_destroy(name, name_hash);
+}
+
+template<typename ScoreType, typename MapUpdater>
+typename MapUpdater::ReturnType
+make_map(const std::vector<std::string> fns, const Taxonomy *tax_map, const char *seq2tax_path, const Spacer &sp, int num_threads, bool canon, size_t start_size, const ScoreIndex *data) {
+    khash_t(c) *r32 = nullptr;
+    khash_t(64) *r64 = nullptr;
+    if(MapUpdater::ValSize == 8) {
+        r64 = static_cast<khash_t(64) *>(std::calloc(sizeof(khash_t(64)), 1));
+        kh_resize(64, r64, khash_buckets_for(start_size));
+    } else {
+        r32 = static_cast<khash_t(c) *>(std::calloc(sizeof(khash_t(c)), 1));
+        kh_resize(c, r32, khash_buckets_for(start_size));
+    }
+    fill_map<ScoreType, MapUpdater>(r32, r64, fns, tax_map, seq2tax_path, sp, num_threads, canon, data);
     LOG_DEBUG("Finished making map!\n");
     if (MapUpdater::ValSize == 8)
         r32 = reinterpret_cast<khash_t(c) *>(r64);
@@ -165,38 +254,111 @@ make_map(const std::vector<std::string> fns, const khash_t(p) *tax_map, const ch
 }
 
 template<typename ScoreType>
-auto feature_count_map(const std::vector<std::string> fns, const khash_t(p) *tax_map, const char *seq2tax_path, const Spacer &sp, int num_threads, bool canon, size_t start_size) {
+auto feature_count_map(const std::vector<std::string> fns, const Taxonomy *tax_map, const char *seq2tax_path, const Spacer &sp, int num_threads, bool canon, size_t start_size) {
     return make_map<ScoreType, FcMap>(fns, tax_map, seq2tax_path, sp, num_threads, canon, start_size, nullptr);
 }
 
 template<typename ScoreType>
-khash_t(c) *lca_map(const std::vector<std::string> &fns, const khash_t(p) *tax_map,
+khash_t(c) *lca_map(const std::vector<std::string> &fns, const Taxonomy *tax_map,
                     const char *seq2tax_path,
                     const Spacer &sp, int num_threads, bool canon, size_t start_size) {
     return make_map<ScoreType, LcaMap>(fns, tax_map, seq2tax_path, sp, num_threads, canon, start_size, nullptr);
 }
 
+// Adds genomes to an existing LCA map in place.
+// nnew is the expected number of new keys, used to grow the table once before merging.
+template<typename ScoreType>
+void lca_map_update(khash_t(c) *map, const std::vector<std::string> &fns, const Taxonomy *tax_map,
+                    const char *seq2tax_path, const Spacer &sp, int num_threads, bool canon, size_t nnew) {
+    const size_t oldsz(kh_size(map)), needed(khash_buckets_for(oldsz + nnew));
+    if(needed > map->n_buckets) kh_resize(c, map, needed);
+    fill_map<ScoreType, LcaMap>(map, nullptr, fns, tax_map, seq2tax_path, sp, num_threads, canon, nullptr);
+    LOG_INFO("Added %zu new keys to database (now %zu) from %zu genomes.\n", kh_size(map) - oldsz, kh_size(map), fns.size());
+}
+
+// 128-bit kmers (k > 32). Only LCA maps are built this way.
+inline void update_lca_map(khash_t(c128) *kc, const khash_t(all128) *set, LcaCache &cache, tax_t taxid);
+
+template<typename ScoreType>
+struct wide_map_helper {
+    const std::vector<std::string> &fns_;
+    const std::vector<tax_t>    &taxids_;
+    LcaCache                    &cache_;
+    const Spacer                   &sp_;
+    khash_t(c128)                 *ret_;
+    khash_t(all128)          *counters_;
+    kseq_t                        *kseqs_;
+    std::mutex                        &m_;
+    const bool                    canon_;
+};
+
+template<typename ScoreType>
+void wide_map_helper_fn(void *data_, long index, int tid) {
+    auto &h(*(wide_map_helper<ScoreType> *)data_);
+    khash_t(all128) *counter(h.counters_ + tid);
+    kh_clear(all128, counter);
+    WideEncoder<ScoreType>(h.sp_, h.canon_).add(counter, h.fns_[index].data(), h.kseqs_ + tid);
+    {
+        LockSmith<std::mutex> lock(h.m_);
+        update_lca_map(h.ret_, counter, h.cache_, h.taxids_[index]);
+    }
+}
+
+template<typename ScoreType>
+khash_t(c128) *wide_lca_map(const std::vector<std::string> &fns, const Taxonomy *tax_map,
+                            const char *seq2tax_path,
+                            const Spacer &sp, int num_threads, bool canon, size_t start_size) {
+    if(num_threads < 0) num_threads = std::thread::hardware_concurrency();
+    if(num_threads == 0) num_threads = 1;
+    khash_t(c128) *ret(kh_init(c128));
+    kh_resize(c128, ret, khash_buckets_for(start_size));
+    std::vector<khash_t(all128)> counters(num_threads);
+    std::memset(counters.data(), 0, sizeof(khash_t(all128)) * counters.size());
+    khash_t(name) *name_hash(build_name_hash(seq2tax_path));
+    const std::vector<tax_t> taxids(get_taxids(fns, name_hash, num_threads));
+    destroy_name_hash(name_hash);
+    KSeqBufferHolder kseqs(num_threads);
+    LcaCache cache(tax_map, BUILD_LCA_CACHE_BITS);
+    std::mutex m;
+    wide_map_helper<ScoreType> helper{fns, taxids, cache, sp, ret, counters.data(), kseqs.data(), m, canon};
+    {
+        ForPool pool(num_threads);
+        pool.forpool(&wide_map_helper_fn<ScoreType>, &helper, fns.size());
+    }
+    for(auto &counter: counters) {
+        std::free(counter.flags);
+        std::free(counter.keys);
+    }
+    return ret;
+}
+
 template<typename ScoreType>
 khash_t(c) *minimized_map(std::vector<std::string> fns,
-                          const khash_t(64) *full_map, const char *seq2tax_path, const khash_t(p) *tax_map,
+                          const ScoreIndex &full_map, const char *seq2tax_path, const Taxonomy *tax_map,
                           const Spacer &sp, int num_threads, size_t start_size, bool canon) {
-    return make_map<ScoreType, MinMap>(fns, tax_map, seq2tax_path, sp, num_threads, canon, start_size, full_map);
+    return make_map<ScoreType, MinMap>(fns, tax_map, seq2tax_path, sp, num_threads, canon, start_size, &full_map);
+}
+template<typename ScoreType>
+khash_t(c) *minimized_map(std::vector<std::string> fns,
+                          const khash_t(64) *full_map, const char *seq2tax_path, const Taxonomy *tax_map,
+                          const Spacer &sp, int num_threads, size_t start_size, bool canon) {
+    return minimized_map<ScoreType>(std::move(fns), ScoreIndex(full_map, num_threads), seq2tax_path, tax_map, sp, num_threads, start_size, canon);
 }
 
 template<typename ScoreType>
-khash_t(64) *ftct_map(const std::vector<std::string> &fns, const khash_t(p) *tax_map,
+khash_t(64) *ftct_map(const std::vector<std::string> &fns, const Taxonomy *tax_map,
                       const char *seq2tax_path,
                       const Spacer &sp, int num_threads, bool canon, size_t start_size) {
     return feature_count_map<ScoreType>(fns, tax_map, seq2tax_path, sp, num_threads, canon, start_size);
 }
 template<typename ScoreType>
-khash_t(64) *taxdepth_map(const std::vector<std::string> &fns, const khash_t(p) *tax_map,
+khash_t(64) *taxdepth_map(const std::vector<std::string> &fns, const Taxonomy *tax_map,
                           const char *seq2tax_path, const Spacer &sp,
                           int num_threads, bool canon, size_t start_size=1<<10) {
     return make_map<ScoreType, TdMap>(fns, tax_map, seq2tax_path, sp, num_threads, canon, start_size, nullptr);
 }
 
-inline void update_lca_map(khash_t(c) *kc, const khash_t(all) *set, const khash_t(p) *tax, tax_t taxid) {
+inline void update_lca_map(khash_t(c) *kc, const khash_t(all) *set, LcaCache &cache, tax_t taxid, int num_threads) {
     int khr;
     khint_t k2;
     static int warn_missing = 1;
@@ -204,6 +366,7 @@ inline void update_lca_map(khash_t(c) *kc, const khash_t(all) *set, const khash_
     for(khiter_t ki(kh_begin(set)); ki < kh_end(set); ++ki) {
         if(kh_exist(set, ki)) {
             if((k2 = kh_get(c, kc, kh_key(set, ki))) == kh_end(kc)) {
+                khash_check_load(kc, num_threads);
                 k2 = kh_put(c, kc, kh_key(set, ki), &khr);
                 if(unlikely(khr < 0))
                     RUNTIME_ERROR(ks::sprintf("Could not insert key %" PRIu64 " to table of size %zu.", kh_key(set, ki), kh_size(kc)).data());
@@ -212,7 +375,7 @@ inline void update_lca_map(khash_t(c) *kc, const khash_t(all) *set, const khash_
                 if(unlikely(kh_size(kc) % 1000000 == 0)) LOG_DEBUG("Final hash size %zu\n", kh_size(kc));
 #endif
             } else if(kh_val(kc, k2) != taxid) {
-                kh_val(kc, k2) = lca(tax, taxid, kh_val(kc, k2));
+                kh_val(kc, k2) = cache.lca(taxid, kh_val(kc, k2));
                 if(kh_val(kc, k2) == UINT32_C(1))
                     if(warn_missing) LOG_WARNING("ancestor of %u missing from taxonomy. This is not unexpected considering the issues the NCBI taxonomy has.\n", taxid), warn_missing = 0;
             }
@@ -221,66 +384,72 @@ inline void update_lca_map(khash_t(c) *kc, const khash_t(all) *set, const khash_
     LOG_DEBUG("After updating with set of size %zu, total set current size is %zu.\n", kh_size(set), kh_size(kc));
 }
 
-inline void update_td_map(khash_t(64) *kc, const khash_t(all) *set, const khash_t(p) *tax, tax_t taxid) {
+inline void update_td_map(khash_t(64) *kc, const khash_t(all) *set, LcaCache &cache, tax_t taxid, int num_threads) {
+    // Depths are computed once for the genome's taxid and memoized with each LCA, so the loop never walks the tree.
+    const u64 encoded(TDencode(node_depth(cache.taxonomy(), taxid), taxid));
     int khr;
     khint_t k2;
     tax_t val;
+    unsigned depth;
     LOG_DEBUG("Adding set of size %zu to total set of current size %zu.\n", kh_size(set), kh_size(kc));
     for(khiter_t ki(kh_begin(set)); ki < kh_end(set); ++ki) {
         if(kh_exist(set, ki)) {
             if((k2 = kh_get(64, kc, kh_key(set, ki))) == kh_end(kc)) {
+                khash_check_load(kc, num_threads);
                 k2 = kh_put(64, kc, kh_key(set, ki), &khr);
                 if(unlikely(khr < 0))
                     RUNTIME_ERROR(ks::sprintf("Could not insert key %" PRIu64 " to table of size %zu.", kh_key(set, ki), kh_size(kc)).data());
-                kh_val(kc, k2) = TDencode(node_depth(tax, kh_val(kc, ki)), kh_val(kc, ki));
+                kh_val(kc, k2) = encoded;
                 if(unlikely(kh_size(kc) % 1000000 == 0)) LOG_INFO("Final hash size %zu\n", kh_size(kc));
-            } else if(kh_val(kc, k2) != taxid) {
-                do val = lca(tax, taxid, kh_val(kc, k2));
-                while(!kh_try_set(64, kc, k2, val == (tax_t)-1 ? 1: TDencode(node_depth(tax, val), val)));
+            } else if(kh_val(kc, k2) != encoded) {
+                do val = cache.lca(taxid, TDtax(kh_val(kc, k2)), depth);
+                while(!kh_try_set(64, kc, k2, val == (tax_t)-1 ? 1: TDencode(depth, val)));
             }
         }
     }
     LOG_DEBUG("After updating with set of size %zu, total set current size is %zu.\n", kh_size(set), kh_size(kc));
 }
-inline void update_feature_counter(khash_t(64) *kc, const khash_t(all) *set, const khash_t(p) *tax, const tax_t taxid) {
+inline void update_feature_counter(khash_t(64) *kc, const khash_t(all) *set, LcaCache &cache, const tax_t taxid, int num_threads) {
     // TODO: make this threadsafe.
     int khr;
     khint_t k2;
     for(khiter_t ki(kh_begin(set)); ki < kh_end(set); ++ki) {
         if(kh_exist(set, ki)) {
            if((k2 = kh_get(64, kc, kh_key(set, ki))) == kh_end(kc)) {
+                khash_check_load(kc, num_threads);
                 k2 = kh_put(64, kc, kh_key(set, ki), &khr);
                 if(unlikely(khr < 0))
                     RUNTIME_ERROR(ks::sprintf("Could not insert key %" PRIu64 " to table of size %zu.", kh_key(set, ki), kh_size(kc)).data());
-                kh_val(kc, k2) = FMencode(1, node_depth(tax, taxid));
-            } else while(!kh_try_set(64, kc, k2, FMencode(FMcount(kh_val(kc, k2)), lca(tax, taxid, kh_val(kc, k2)))));
+                kh_val(kc, k2) = FMencode(1, taxid);
+            } else while(!kh_try_set(64, kc, k2, FMencode(FMcount(kh_val(kc, k2)) + 1, cache.lca(taxid, FMtax(kh_val(kc, k2))))));
         }
     }
 }
 
-inline void update_minimized_map(const khash_t(all) *set, const khash_t(64) *full_map, khash_t(c) *ret) {
-    khiter_t kif;
+inline void update_minimized_map(const khash_t(all) *set, const ScoreIndex *full_map, khash_t(c) *ret, int num_threads) {
+    const ScoreIndex::entry_t *e;
     LOG_DEBUG("Size of set: %zu\n", kh_size(set));
     for(khiter_t ki(0); ki < kh_end(set); ++ki) {
         if(!kh_exist(set, ki) || kh_get(c, ret, kh_key(set, ki)) != kh_end(ret))
             continue;
             // If the key is already in the main map, what's the problem?
-        if(unlikely((kif = kh_get(64, full_map, kh_key(set, ki))) == kh_end(full_map)))
+        if(unlikely((e = full_map->find(kh_key(set, ki))) == nullptr))
             LOG_EXIT("Missing kmer from database... Check for matching spacer and kmer size.\n");
-        if(unlikely(kh_set(c, ret, kh_key(full_map, kif), kh_val(full_map, kif)) < 0))
+        khash_check_load(ret, num_threads);
+        if(unlikely(kh_set(c, ret, e->key_, e->val_) < 0))
             RUNTIME_ERROR(ks::sprintf("Failed to update minimized map with kh_set to table of size %zu.", kh_size(ret)).data());
         if(unlikely((kh_size(ret) & 0xFFFFF) == 0)) LOG_INFO("Final hash size %zu\n", kh_size(ret));
     }
     return;
 }
 
-inline void lca2depth(khash_t(c) *lca_map, const khash_t(p) *tax_map) {
+inline void lca2depth(khash_t(c) *lca_map, const Taxonomy *tax_map) {
     for(khiter_t ki(kh_begin(lca_map)); ki < kh_end(lca_map); ++ki)
         if(kh_exist(lca_map, ki))
             kh_val(lca_map, ki) = node_depth(tax_map, kh_val(lca_map, ki));
 }
 
-inline khash_t(c) *make_depth_hash(khash_t(c) *lca_map, const khash_t(p) *tax_map) {
+inline khash_t(c) *make_depth_hash(khash_t(c) *lca_map, const Taxonomy *tax_map) {
     khash_t(c) *ret(kh_init(c));
     kh_resize(c, ret, kh_size(lca_map));
     khiter_t ki1;
@@ -296,7 +465,7 @@ inline khash_t(c) *make_depth_hash(khash_t(c) *lca_map, const khash_t(p) *tax_ma
 }
 
 
-inline khash_t(64) *make_taxdepth_hash(khash_t(c) *kc, const khash_t(p) *tax) {
+inline khash_t(64) *make_taxdepth_hash(khash_t(c) *kc, const Taxonomy *tax) {
     khash_t(64) *ret(kh_init(64));
     int khr;
     khiter_t kir;
@@ -1,6 +1,7 @@
 #ifndef __FLEX_TREE_H
 #define __FLEX_TREE_H
 
+#include <queue>
 #include "util.h"
 #include "counter.h"
 #include "bitmap.h"
@@ -21,9 +22,10 @@ struct fnode_t {
     const u32         bc_;  // bitcount for family (number of clades in subtree)
     const u32      si_:31;  // subtree index
     u32          added_:1;  // Whether node has been added or been subsumed
+    u32             cover_; // popcount of the smallest added strict superset, bc_ if none
     fnode_t(const bitvec_t &bits, u32 bc, u32 subtree_index, const u64 n=0):
-        n_{n}, desc_pts_{0}, pc_{static_cast<u32>(pop::vec_popcnt(bits))},
-        bc_{bc}, si_{subtree_index}, added_(false) {}
+        n_{n}, desc_pts_{0}, pc_{popcnt_words(bits.data(), bits.size())},
+        bc_{bc}, si_{subtree_index}, added_(false), cover_{bc} {}
     ks::string str() const {
         return ks::sprintf("fnode_t[n:%zu,popcount:%u,familysize:%u", n_, pc_, bc_);
     }
@@ -32,6 +34,12 @@ struct fnode_t {
         desc_pts_ += tmp;
         other.second.desc_pts_ -= tmp;
     }
+    // A strict superset with popcount pc was added: kmers here now only gain (cover - pc_) each from this node.
+    void cover(u32 pc) {
+        if(pc >= cover_) return;
+        desc_pts_ -= i64(cover_ - pc) * n_;
+        cover_ = pc;
+    }
 };
 
 INLINE u64 get_score(const NodeType &node) {
@@ -82,6 +90,10 @@ public:
             }
         }
     }
+    // Pointers stay valid until the map is next modified.
+    void get_nodes(std::vector<NodeType *> &nodes) {
+        for(auto &pair: map_) nodes.push_back(&pair);
+    }
 public:
     FlexMap(const tax_t parent, const u32 ntaxes, u32 id):
         n_{0}, bitcount_{ntaxes}, id_{id}, parent_{parent} {}
@@ -98,6 +110,13 @@ public:
         else ++match->second.n_;
         ++n_;
     }
+    // Adds n kmers sharing the presence pattern elem.
+    void add(const bitvec_t &elem, u64 n) {
+        auto match(map_.find(elem));
+        if(match == map_.end()) map_.emplace(elem, fnode_t(elem, bitcount_, id_, n));
+        else                    match->second.n_ += n;
+        n_ += n;
+    }
     void fill(const std::unordered_map<tax_t, std::forward_list<std::string>> &list, const Spacer &sp, bool canonicalize=true, int num_threads=-1,
               khash_t(all) *acc=nullptr) {
         if(tax_.size()) tax_.clear();
@@ -105,14 +124,11 @@ public:
             LOG_DEBUG("Filling from flexmap #%u with tax %u and is %s\n", id_, pair.first, pair.second.empty() ? "empty": "not bnsty");
             tax_.push_back(pair.first);
         }
-#if !NDEBUG
-        bitmap_t tmp_bitmap(kgset_t(list, sp, canonicalize, num_threads, acc));
-        auto &map(tmp_bitmap.get_map());
-        LOG_DEBUG("Map size: %zu\n", map.size());
-        for(auto &&pair: map) add(std::move(pair.second));
-#else
-        for(auto &&pair: bitmap_t(kgset_t(list, sp, canonicalize, num_threads, acc)).get_map()) add(std::move(pair.second));
-#endif
+        // Only interned pattern counts are kept, and the genome sets are freed before they are added.
+        const PatternSet patterns(pattern_counts(kgset_t(list, sp, canonicalize, num_threads, acc), num_threads));
+        map_.reserve(map_.size() + patterns.size());
+        for(u32 id(0); id < patterns.size(); ++id) add(patterns.vec(id), patterns.count(id));
+        LOG_DEBUG("Map size: %zu\n", map_.size());
     }
 };
 
@@ -141,6 +157,7 @@ class FMEmitter {
         ks.putl_(get_score(*node));
         ks.putc_('\t');
         ks.putuw_(fm.parent());
+        ks.putc_('\t');
         const auto &taxes(fm.get_taxes());
         for(size_t i = 0, e = node->first.size(); i < e; ++i) {
             if((val = node->first[i]) == 0) continue;
@@ -192,48 +209,24 @@ public:
         // Places the highest bitcount items at the beginning.
     };
     void condense_subtree(HeapType &subtree) {
-        using std::begin;
-        using std::end;
-        // Update scores
-        // Mark
-        using HeapIt = typename HeapType::iterator;
-        HeapIt ait, bit, eait;
-        using std::begin;
-        using std::end;
-        using std::find;
-        //std::vector<linear::set<NodeType *>> subtree_subsets;
+        // Each node not yet added subsumes its strict subsets, found through a subset index rather than pairwise.
+        std::vector<NodeType *> nodes;
+        std::vector<const u64 *> patterns;
+        for(auto node: subtree) {
+            if(node->second.added_) continue;
+            if(nodes.size() && node->first.size() != nodes[0]->first.size())
+                RUNTIME_ERROR(ks::sprintf("Patterns must all be the same size! %zu, %zu", node->first.size(), nodes[0]->first.size()).data());
+            nodes.push_back(node), patterns.push_back(node->first.data());
+        }
+        if(nodes.empty()) return;
+        const auto supersets(strict_supersets(patterns, nodes[0]->first.size()));
         linear::set<NodeType *> to_remove;
-#if 0
-        auto in = []<class T>(std::vector<T *> &vec, T *el) {
-            return find(begin(vec), end(vec), el) != vec.end();
-        };
-        auto insert = [&]<class T>(std::vector<T *> &vec, bitvec_t *el) {
-            if(!in(vec, el)) vec.emplace_back(el);
-        };
-#endif
-        // 1. Make linear vector of pointers to objects.
-        // 2. 
-        for(ait = begin(subtree), eait = end(subtree); ait != eait; ++ait) {
-            for(bit = ait, ++bit; bit != eait; ++bit) {
-                if((*ait)->second.added_|| (*bit)->second.added_) continue;
-                //if(&(*ait)->first) continue;
-                switch(veccmp((*ait)->first, (*bit)->first)) {
-                    case BitCmp::FIRST_PARENT:
-                        (*ait)->second.subsume(**bit);
-                        to_remove.insert(*ait);
-                        to_remove.insert(*bit);
-                        break;
-                    case BitCmp::SECOND_PARENT:
-                        (*bit)->second.subsume(**ait);
-                        to_remove.insert(*ait);
-                        to_remove.insert(*bit);
-                        break;
-                    case BitCmp::EQUAL:
-                        LOG_DEBUG("Warning: bit patterns a and b should be not equal....\n");
-                        [[fallthrough]];
-                    case BitCmp::INCOMPARABLE: continue;//Do nothing
-                }
+        for(u32 i(0); i < nodes.size(); ++i) {
+            for(const u32 j: supersets[i]) {
+                nodes[j]->second.subsume(*nodes[i]);
+                to_remove.insert(nodes[j]);
             }
+            if(supersets[i].size()) to_remove.insert(nodes[i]);
         }
         // I think I should instead think of some other way to organize them, but this works for a start.
         for(auto el: to_remove) subtree.erase(el);
@@ -267,20 +260,44 @@ public:
             break;
         }
 #else
-        while(left_to_add_) {
-            for(auto &subtree: subtrees_) {
-                subtree.fill_heap(heap_, max_heapsz_);
-                // condense_subtree(heap_);
+        // Nodes are taken best-first from a max-heap. Adding a node only lowers the scores of its strict subsets
+        // in the same subtree, so heap entries are refreshed lazily: a popped entry whose score is stale is
+        // pushed back with its current score, and every other entry is still an upper bound on its node's score.
+        std::vector<std::vector<NodeType *>> nodes(subtrees_.size());
+        std::vector<SubsetIndex> indices;
+        indices.reserve(subtrees_.size());
+        std::priority_queue<std::pair<u64, NodeType *>> queue;
+        for(size_t i(0); i < subtrees_.size(); ++i) {
+            subtrees_[i].get_nodes(nodes[i]);
+            std::vector<const u64 *> patterns;
+            patterns.reserve(nodes[i].size());
+            for(const auto node: nodes[i]) {
+                patterns.push_back(node->first.data());
+                if(!node->second.added_) queue.emplace(get_score(*node), node);
             }
-            for(auto it(heap_.crbegin()), sit(heap_.crend()); it != sit;) {
-                format_emitted_node(ks, *it++, ++maxtax);
-                (*it)->second.added_ = 1;
-                if(ks.size() & ~(BufferSize-1)) {
-                    ks.write(fd), ks.clear();
-                }
-                if(--left_to_add_ == 0) break;
+            indices.emplace_back(patterns, nodes[i].empty() ? 1: nodes[i][0]->first.size());
+        }
+        while(left_to_add_ && queue.size()) {
+            NodeType *const node(queue.top().second);
+            const u64 score(queue.top().first);
+            queue.pop();
+            if(node->second.added_) continue;
+            if(score != get_score(*node)) {
+                queue.emplace(get_score(*node), node);
+                continue;
+            }
+            format_emitted_node(ks, node, ++maxtax);
+            node->second.added_ = 1;
+            const auto &subtree_nodes(nodes[node->second.si_]);
+            indices[node->second.si_].for_each_subset(node->first.data(), [&](u32 j) {
+                subtree_nodes[j]->second.cover(node->second.pc_);
+            });
+            if(ks.size() & ~(BufferSize-1)) {
+                ks.write(fd), ks.clear();
             }
+            --left_to_add_;
         }
+        if(left_to_add_) LOG_WARNING("Ran out of nodes with %u left to add.\n", left_to_add_);
         ks.write(fd), ks.clear();
         return;
 #endif
@@ -110,6 +110,12 @@ public:
         for(auto &i: core_) std::free(i.keys), std::free(i.vals), std::free(i.flags);
     }
     size_t size() const {return core_.size();}
+    // Frees set i's table, leaving it empty. size() is unchanged.
+    void release(size_t i) {
+        auto &h(core_[i]);
+        std::free(h.keys), std::free(h.vals), std::free(h.flags);
+        h = khash_t(all){0,0,0,0,0,0,0};
+    }
 
     size_t weight() const {
         if(!size()) return 0;
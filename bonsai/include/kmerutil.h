@@ -134,6 +134,17 @@ inline static void countInU64Ex(uint64_t dw, uint32_t *arrs, unsigned k) {
     arrs[3] += (tmp = pop::popcount(x3));
 }
 
+// 128-bit kmers (k <= 64): reverse-complement each half, swap them, and shift out the padding.
+static INLINE u128 reverse_complement(u128 kmer, uint8_t n) {
+    const u128 ret((u128(reverse_complement(u64(kmer), 32)) << 64) | reverse_complement(u64(kmer >> 64), 32));
+    return ret >> (128 - (n << 1));
+}
+
+static INLINE u128 canonical_representation(u128 kmer, uint8_t n) {
+    const u128 revcom(reverse_complement(kmer, n));
+    return kmer < revcom ? kmer : revcom;
+}
+
 static INLINE u64 canonical_representation(u64 kmer, uint8_t n) {
     const u64 revcom(reverse_complement(kmer, n));
     return kmer < revcom ? kmer : revcom;
@@ -0,0 +1,322 @@
+#pragma once
+#include <vector>
+#include "database.h"
+#include "hash.h"
+#include "klib/kthread.h"
+#include "util.h"
+
+namespace bns {
+
+/*
+ * Mphf:
+ * BBHash-style minimal perfect hash function over a set of 64-bit keys.
+ * Each level hashes the keys not yet placed into GAMMA * n bits. Keys which land alone on a bit are placed,
+ * and the rest go on to the next level. A key's index is the rank of its bit across all levels.
+ * Keys left after MAX_LEVELS levels are kept in a sorted array and numbered after the rest.
+ * Bits are stored in cache-line blocks of 7 words, preceded by the rank of the block,
+ * so that testing a bit and ranking it touches one cache line.
+ */
+class Mphf {
+    struct block_t {
+        u64 rank_;
+        u64 words_[7];
+    };
+    static_assert(sizeof(block_t) == 64, "Blocks must fill a cache line.");
+    static constexpr unsigned BLOCK_BITS = 7 * 64;
+    static constexpr unsigned MAX_LEVELS = 24;
+    static constexpr double   GAMMA      = 2.;
+    static constexpr size_t   KEYS_PER_JOB = 1 << 16;
+
+    std::vector<block_t>  blocks_;
+    std::vector<u64>     offsets_;  // Start of each level in bits. offsets_.back() is the total.
+    std::vector<u64>    fallback_;  // Sorted.
+    u64                   nbits_;   // Set bits across all levels; fallback keys are numbered from here.
+
+    static INLINE u64 level_hash(u64 base, unsigned level) {
+        return wang_hash(base ^ (UINT64_C(0x9E3779B97F4A7C15) * (level + 1)));
+    }
+    static INLINE u64 reduce(u64 hash, u64 n) {return static_cast<u64>((u128(hash) * n) >> 64);}
+    INLINE bool test(u64 pos) const {
+        return (blocks_[pos / BLOCK_BITS].words_[(pos % BLOCK_BITS) >> 6] >> (pos & 63)) & 1;
+    }
+    INLINE u64 rank(u64 pos) const {
+        const block_t &b(blocks_[pos / BLOCK_BITS]);
+        const unsigned off(pos % BLOCK_BITS), word(off >> 6);
+        u64 ret(b.rank_);
+        for(unsigned i(0); i < word; ret += __builtin_popcountll(b.words_[i++]));
+        return ret + __builtin_popcountll(b.words_[word] & ((UINT64_C(1) << (off & 63)) - 1));
+    }
+
+    struct level_helper {
+        const u64 *keys_;
+        size_t     nkeys_;
+        u64       *seen_;
+        u64       *collisions_;
+        u64        nbits_;
+        unsigned   level_;
+    };
+    static void mark_fn(void *data_, long index, int tid) {
+        auto &h(*(level_helper *)data_);
+        for(size_t i(index * KEYS_PER_JOB), e(std::min(h.nkeys_, (index + 1) * KEYS_PER_JOB)); i < e; ++i) {
+            const u64 pos(reduce(level_hash(wang_hash(h.keys_[i]), h.level_), h.nbits_)), bit(UINT64_C(1) << (pos & 63));
+            if(__sync_fetch_and_or(h.seen_ + (pos >> 6), bit) & bit)
+                __sync_fetch_and_or(h.collisions_ + (pos >> 6), bit);
+        }
+    }
+
+public:
+    static constexpr u64 NOT_FOUND = UINT64_C(-1);
+    Mphf(): nbits_(0) {}
+    // keys must be distinct.
+    Mphf(std::vector<u64> keys, int num_threads=1): nbits_(0) {
+        if(num_threads <= 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<u64> words, seen, collisions, next;
+        offsets_.push_back(0);
+        for(unsigned level(0); level < MAX_LEVELS && keys.size(); ++level) {
+            const u64 nwords(std::max(u64(1), (static_cast<u64>(GAMMA * keys.size()) + 63) >> 6));
+            seen.assign(nwords, 0);
+            collisions.assign(nwords, 0);
+            level_helper helper{keys.data(), keys.size(), seen.data(), collisions.data(), nwords << 6, level};
+            kt_for(num_threads, &mark_fn, &helper, (keys.size() + KEYS_PER_JOB - 1) / KEYS_PER_JOB);
+            for(u64 i(0); i < nwords; ++i) seen[i] &= ~collisions[i];
+            next.clear();
+            for(const u64 key: keys) {
+                const u64 pos(reduce(level_hash(wang_hash(key), level), nwords << 6));
+                if(collisions[pos >> 6] & (UINT64_C(1) << (pos & 63))) next.push_back(key);
+            }
+            LOG_DEBUG("Level %u placed %zu of %zu keys.\n", level, keys.size() - next.size(), keys.size());
+            words.insert(words.end(), seen.begin(), seen.end());
+            offsets_.push_back(offsets_.back() + (nwords << 6));
+            std::swap(keys, next);
+        }
+        fallback_ = std::move(keys);
+        std::sort(fallback_.begin(), fallback_.end());
+        blocks_.resize((words.size() + 6) / 7);
+        for(size_t i(0); i < blocks_.size(); ++i) {
+            block_t &b(blocks_[i]);
+            b.rank_ = nbits_;
+            for(unsigned j(0); j < 7; ++j) {
+                b.words_[j] = i * 7 + j < words.size() ? words[i * 7 + j]: 0;
+                nbits_ += __builtin_popcountll(b.words_[j]);
+            }
+        }
+        if(fallback_.size()) LOG_INFO("%zu keys left for the fallback table after %u levels.\n", fallback_.size(), MAX_LEVELS);
+    }
+    size_t size() const {return nbits_ + fallback_.size();}
+    // Returns an index in [0, size()) for keys in the set, and either an arbitrary index or NOT_FOUND otherwise.
+    INLINE u64 index(u64 key) const {
+        const u64 base(wang_hash(key));
+        for(unsigned i(0), e(offsets_.size() - 1); i < e; ++i) {
+            const u64 pos(offsets_[i] + reduce(level_hash(base, i), offsets_[i + 1] - offsets_[i]));
+            if(test(pos)) return rank(pos);
+        }
+        auto it(std::lower_bound(fallback_.begin(), fallback_.end(), key));
+        return it == fallback_.end() || *it != key ? NOT_FOUND: nbits_ + (it - fallback_.begin());
+    }
+    size_t bytes() const {
+        return blocks_.size() * sizeof(block_t) + (offsets_.size() + fallback_.size()) * sizeof(u64);
+    }
+
+    template<typename Writer>
+    size_t write(const Writer &write_fn) const {
+        return write_vec(write_fn, blocks_) + write_vec(write_fn, offsets_) + write_vec(write_fn, fallback_) + write_fn(&nbits_, sizeof(nbits_));
+    }
+    template<typename Reader>
+    void read(const Reader &read_fn) {
+        read_vec(read_fn, blocks_);
+        read_vec(read_fn, offsets_);
+        read_vec(read_fn, fallback_);
+        read_fn(&nbits_, sizeof(nbits_));
+    }
+    template<typename Writer, typename T>
+    static size_t write_vec(const Writer &write_fn, const std::vector<T> &vec) {
+        const u64 n(vec.size());
+        return write_fn(&n, sizeof(n)) + write_fn(vec.data(), n * sizeof(T));
+    }
+    template<typename Reader, typename T>
+    static void read_vec(const Reader &read_fn, std::vector<T> &vec) {
+        u64 n;
+        read_fn(&n, sizeof(n));
+        vec.resize(n);
+        read_fn(vec.data(), n * sizeof(T));
+    }
+};
+
+/*
+ * MphfMap:
+ * Immutable kmer -> taxid map for classification, built from a finished LCA database.
+ * Keys aren't stored: an Mphf numbers them, and a 16-bit fingerprint per key rejects most absent kmers.
+ * Taxids are remapped to a dense range [0, ntaxa), stored with the fewest bits that hold it,
+ * and translated back through taxa_ on lookup.
+ * Each entry is the fingerprint above the dense taxid, bit-packed, so one load reads both.
+ * That's about 4 bits of Mphf plus 16 + ceil(log2(ntaxa)) bits per kmer,
+ * against khash's 96 bits per bucket plus flags.
+ * Absent kmers pass the fingerprint check with probability 2^-16.
+ */
+class MphfMap {
+public:
+    using key_type = u64;
+    using fingerprint_t = u16;
+    static constexpr u64 MAGIC = UINT64_C(0x3146485048504d42); // "BMPHPHF1"
+    static constexpr unsigned FP_BITS = 8 * sizeof(fingerprint_t);
+private:
+    Mphf                  mphf_;
+    std::vector<u64>    packed_;  // size_ entries of width_ bits, plus a trailing word so unaligned loads stay in bounds.
+    std::vector<tax_t>    taxa_;  // Dense id -> taxid.
+    u64                   size_;
+    u32               tax_bits_;
+    u32                  width_;
+    static INLINE fingerprint_t fingerprint(u64 kmer) {
+        return static_cast<fingerprint_t>(wang_hash(kmer ^ UINT64_C(0xD6E8FEB86659FD93)) >> (64 - FP_BITS));
+    }
+    INLINE u64 entry(u64 i) const {
+        const u64 bit(i * width_);
+        u64 ret;
+        std::memcpy(&ret, reinterpret_cast<const char *>(packed_.data()) + (bit >> 3), sizeof(ret));
+        return (ret >> (bit & 7)) & ((UINT64_C(1) << width_) - 1);
+    }
+    // Entries may share words with ones written by other threads.
+    void set_entry(u64 i, u64 val) {
+        const u64 bit(i * width_);
+        __sync_fetch_and_or(&packed_[bit >> 6], val << (bit & 63));
+        if((bit & 63) + width_ > 64)
+            __sync_fetch_and_or(&packed_[(bit >> 6) + 1], val >> (64 - (bit & 63)));
+    }
+
+    static constexpr size_t BUCKETS_PER_JOB = 1 << 16;
+    struct taxa_helper {
+        const khash_t(c)                        *src_;
+        std::vector<std::unordered_set<tax_t>> &sets_;
+    };
+    static void taxa_fn(void *data_, long index, int tid) {
+        auto &h(*(taxa_helper *)data_);
+        for(khiter_t ki(index * BUCKETS_PER_JOB), e(std::min(u64(kh_end(h.src_)), (index + 1) * BUCKETS_PER_JOB)); ki < e; ++ki)
+            if(kh_exist(h.src_, ki)) h.sets_[tid].insert(kh_val(h.src_, ki));
+    }
+    struct fill_helper {
+        MphfMap                                   &map_;
+        const khash_t(c)                          *src_;
+        const std::unordered_map<tax_t, u32>    &dense_;
+    };
+    static void fill_fn(void *data_, long index, int tid) {
+        auto &h(*(fill_helper *)data_);
+        for(khiter_t ki(index * BUCKETS_PER_JOB), e(std::min(u64(kh_end(h.src_)), (index + 1) * BUCKETS_PER_JOB)); ki < e; ++ki) {
+            if(!kh_exist(h.src_, ki)) continue;
+            const u64 kmer(kh_key(h.src_, ki));
+            h.map_.set_entry(h.map_.mphf_.index(kmer), (u64(fingerprint(kmer)) << h.map_.tax_bits_) | h.dense_.at(kh_val(h.src_, ki)));
+        }
+    }
+public:
+    MphfMap(): size_(0), tax_bits_(0), width_(FP_BITS) {}
+    MphfMap(const khash_t(c) *src, int num_threads=1) {
+        if(num_threads <= 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+        const long njobs((kh_end(src) + BUCKETS_PER_JOB - 1) / BUCKETS_PER_JOB);
+        std::unordered_map<tax_t, u32> dense;
+        {
+            std::vector<std::unordered_set<tax_t>> sets(num_threads);
+            taxa_helper helper{src, sets};
+            kt_for(num_threads, &taxa_fn, &helper, njobs);
+            for(const auto &set: sets) taxa_.insert(taxa_.end(), set.begin(), set.end());
+            std::sort(taxa_.begin(), taxa_.end());
+            taxa_.erase(std::unique(taxa_.begin(), taxa_.end()), taxa_.end());
+            for(u32 i(0); i < taxa_.size(); ++i) dense.emplace(taxa_[i], i);
+        }
+        tax_bits_ = taxa_.size() > 1 ? 64 - __builtin_clzll(taxa_.size() - 1): 0;
+        width_    = tax_bits_ + FP_BITS;
+        std::vector<u64> keys;
+        keys.reserve(kh_size(src));
+        for(khiter_t ki(0); ki != kh_end(src); ++ki)
+            if(kh_exist(src, ki)) keys.push_back(kh_key(src, ki));
+        mphf_ = Mphf(std::move(keys), num_threads);
+        size_ = mphf_.size();
+        packed_.assign((size_ * width_ + 63) / 64 + 1, 0);
+        fill_helper helper{*this, src, dense};
+        kt_for(num_threads, &fill_fn, &helper, njobs);
+        LOG_INFO("Built minimal perfect hash map for %zu kmers and %zu taxa (%u bits each) in %zu bytes.\n",
+                 size(), taxa_.size(), unsigned(tax_bits_), bytes());
+    }
+    size_t size()  const {return size_;}
+    size_t ntaxa() const {return taxa_.size();}
+    size_t bytes() const {return mphf_.bytes() + packed_.size() * sizeof(u64) + taxa_.size() * sizeof(tax_t);}
+    INLINE bool get(u64 kmer, tax_t &tax) const {
+        const u64 i(mphf_.index(kmer));
+        if(i >= size_) return false;
+        const u64 e(entry(i));
+        if((e >> tax_bits_) != fingerprint(kmer)) return false;
+        tax = taxa_[e & ((UINT64_C(1) << tax_bits_) - 1)];
+        return true;
+    }
+
+    // Calls fn with the taxid of every stored kmer; each Mphf slot holds exactly one.
+    template<typename Functor>
+    void for_each_taxon(const Functor &fn) const {
+        const u64 mask((UINT64_C(1) << tax_bits_) - 1);
+        for(u64 i(0); i < size_; ++i) fn(taxa_[entry(i) & mask]);
+    }
+
+    template<typename Writer>
+    size_t write(const Writer &write_fn) const {
+        return write_fn(&MAGIC, sizeof(MAGIC)) + mphf_.write(write_fn) + write_fn(&size_, sizeof(size_))
+             + write_fn(&tax_bits_, sizeof(tax_bits_)) + Mphf::write_vec(write_fn, packed_) + Mphf::write_vec(write_fn, taxa_);
+    }
+    template<typename Reader>
+    void read(const Reader &read_fn) {
+        u64 magic;
+        read_fn(&magic, sizeof(magic));
+        if(magic != MAGIC) LOG_EXIT("Not a minimal perfect hash database (magic %" PRIx64 ").\n", magic);
+        mphf_.read(read_fn);
+        read_fn(&size_, sizeof(size_));
+        read_fn(&tax_bits_, sizeof(tax_bits_));
+        width_ = tax_bits_ + FP_BITS;
+        Mphf::read_vec(read_fn, packed_);
+        Mphf::read_vec(read_fn, taxa_);
+    }
+};
+
+// Database<MphfMap> reads and writes through the same entry points as khash-backed databases.
+template<>
+inline size_t khash_write_impl<MphfMap>(const MphfMap *map, const int fn) noexcept {
+    return map->write([fn](const void *data, size_t n) {
+        size_t ret(0);
+        for(ssize_t rc; ret < n && (rc = ::write(fn, static_cast<const char *>(data) + ret, n - ret)) > 0; ret += rc);
+        return ret;
+    });
+}
+template<>
+inline size_t khash_write_impl<MphfMap>(const MphfMap *map, gzFile fp) noexcept {
+    return map->write([fp](const void *data, size_t n) {
+        size_t ret(0);
+        for(int rc; ret < n && (rc = gzwrite(fp, static_cast<const char *>(data) + ret, std::min(n - ret, size_t(1) << 30))) > 0; ret += rc);
+        return ret;
+    });
+}
+template<>
+inline MphfMap *khash_load_impl<MphfMap>(const int fn) noexcept {
+    MphfMap *ret(new MphfMap);
+    ret->read([fn](void *data, size_t n) {
+        size_t nread(0);
+        for(ssize_t rc; nread < n && (rc = ::read(fn, static_cast<char *>(data) + nread, n - nread)) > 0; nread += rc);
+        if(nread != n) LOG_EXIT("Truncated minimal perfect hash database.\n");
+    });
+    return ret;
+}
+template<>
+inline void khash_destroy<MphfMap>(MphfMap *map) noexcept {delete map;}
+
+// True if the database at fn holds an MphfMap rather than a khash.
+inline bool database_is_mphf(const char *fn) {
+    int filetype;
+    unsigned k(0), w;
+    u64 magic(0);
+    std::FILE *fp(open_database(fn, filetype));
+    if(!fp) LOG_EXIT("Could not open %s for reading.\n", fn);
+    if(std::fread(&k, sizeof(k), 1, fp) == 1 && std::fread(&w, sizeof(w), 1, fp) == 1 && k) {
+        std::vector<uint8_t> s(k - 1);
+        if(std::fread(s.data(), 1, s.size(), fp) != s.size() || std::fread(&magic, sizeof(magic), 1, fp) != 1) magic = 0;
+    }
+    if(filetype) pclose(fp);
+    else         std::fclose(fp);
+    return magic == MphfMap::MAGIC;
+}
+
+} // namespace bns
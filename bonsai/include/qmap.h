@@ -58,11 +58,11 @@ class QueueMap {
     map_iterator       end()       {return map_.end();}
     const_map_iterator end() const {return map_.cend();}
     // Do a std::enable_if that involves moving the element if it's by reference?
-    u64 next_value(const T el, const u64 score) {
+    T next_value(const T el, const ScoreType score) {
         add(list_.emplace_back(el, score));
         if(list_.size() > wsz_) del(list_.pop_front());
-        return list_.size() == wsz_ ? map_.begin()->first.el_: BF;
-        // Signal a window that is not filled by 0xFFFFFFFFFFFFFFFF
+        return list_.size() == wsz_ ? map_.begin()->first.el_: ~T(0);
+        // Signal a window that is not filled by all bits set (BF, for 64-bit kmers)
     }
     void reset() {
         list_.clear();
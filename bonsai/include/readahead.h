@@ -0,0 +1,195 @@
+#pragma once
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "kseq_declare.h"
+#include "klib/kthread.h"
+#include "logutil.h"
+
+namespace bns {
+
+/*
+ * GzReadAhead:
+ * Opens a (possibly compressed) sequence file for reading through a gzFile,
+ * moving decompression onto a separate thread.
+ *
+ * The decompressing thread writes inflated bytes into a socket pair, and the reader's gzFile
+ * is opened on the other end, where zlib passes the uncompressed data through.
+ * That way, kseq/bseq_read and everything built on them work unchanged.
+ *
+ * BGZF input (bgzip, as from samtools/htslib) is made of independent blocks,
+ * so batches of blocks are inflated by nthreads threads and written in order.
+ * Other gzip (and zstd, with the zlib wrapper) input gets a single decompress-ahead thread.
+ * Uncompressed input is opened directly; there's nothing to gain by moving it.
+ */
+class GzReadAhead {
+    gzFile      fp_;
+    gzFile     src_;
+    int     fds_[2];
+    std::thread thread_;
+    std::FILE  *raw_;
+    int   nthreads_;
+
+    static constexpr size_t BUFSIZE = 1 << 20;
+    static constexpr size_t BGZF_HEADER_SIZE = 18;
+    static constexpr size_t BATCH_PER_THREAD = 64;
+
+    struct block_helper {
+        std::vector<std::string> &in_;
+        std::vector<std::string> &out_;
+    };
+    static void inflate_block_fn(void *data_, long index, int tid) {
+        auto &h(*(block_helper *)data_);
+        const std::string &in(h.in_[index]);
+        std::string &out(h.out_[index]);
+        const size_t bsize(in.size());
+        uint32_t isize;
+        std::memcpy(&isize, in.data() + bsize - 4, sizeof(isize)); // little-endian, as is everything we build for.
+        out.resize(isize);
+        if(isize == 0) return; // EOF marker block
+        z_stream zs;
+        std::memset(&zs, 0, sizeof(zs));
+        if(inflateInit2(&zs, -15) != Z_OK) LOG_EXIT("Could not initialize inflate.\n");
+        zs.next_in = (Bytef *)(in.data() + BGZF_HEADER_SIZE);
+        zs.avail_in = bsize - BGZF_HEADER_SIZE - 8;
+        zs.next_out = (Bytef *)&out[0];
+        zs.avail_out = isize;
+        const int rc(inflate(&zs, Z_FINISH));
+        inflateEnd(&zs);
+        if(rc != Z_STREAM_END) LOG_EXIT("Corrupt BGZF block (inflate returned %i).\n", rc);
+    }
+    static size_t bgzf_block_size(const unsigned char *h) {
+        // gzip magic, deflate, FEXTRA set, XLEN == 6, with a single 'BC' subfield of length 2.
+        if(h[0] != 31 || h[1] != 139 || h[2] != 8 || (h[3] & 4) == 0 ||
+           h[10] != 6 || h[11] != 0 || h[12] != 'B' || h[13] != 'C' || h[14] != 2 || h[15] != 0)
+            return 0;
+        return size_t(h[16] | (h[17] << 8)) + 1;
+    }
+    // Returns false if the reader has gone away.
+    bool send_all(const char *buf, size_t n) const {
+        while(n) {
+            const ssize_t rc(::send(fds_[1], buf, n, MSG_NOSIGNAL));
+            if(rc < 0) {
+                if(errno == EINTR) continue;
+                return false;
+            }
+            buf += rc, n -= rc;
+        }
+        return true;
+    }
+    void run_plain(gzFile src) {
+        std::string buf(BUFSIZE, '\0');
+        int rc;
+        while((rc = gzread(src, &buf[0], buf.size())) > 0)
+            if(!send_all(buf.data(), rc)) break;
+        if(rc < 0) LOG_WARNING("Error reading compressed input.\n");
+    }
+    // Decompresses the rest of raw_, from offset on, the usual way.
+    void run_plain_from(off_t offset) {
+        const int fd(::dup(fileno(raw_)));
+        gzFile src(fd < 0 || ::lseek(fd, offset, SEEK_SET) != offset ? nullptr: gzdopen(fd, "rb"));
+        if(src == nullptr) {
+            if(fd >= 0) ::close(fd);
+            LOG_WARNING("Could not reopen input to read past the BGZF blocks. Output is truncated.\n");
+            return;
+        }
+        run_plain(src);
+        gzclose(src);
+    }
+    void run_bgzf() {
+        const size_t batch_size(BATCH_PER_THREAD * nthreads_);
+        std::vector<std::string> in(batch_size), out(batch_size);
+        block_helper helper{in, out};
+        unsigned char header[BGZF_HEADER_SIZE];
+        // Only the first block was checked, so a later member that isn't a whole BGZF block
+        // (plain gzip appended to a BGZF file, say) is handed to zlib from its start on.
+        off_t fallback(-1);
+        for(bool done(false); !done;) {
+            size_t n(0);
+            while(n < batch_size) {
+                const off_t start(ftello(raw_));
+                const size_t nread(std::fread(header, 1, BGZF_HEADER_SIZE, raw_));
+                if(nread == 0) {done = true; break;}
+                const size_t bsize(nread == BGZF_HEADER_SIZE ? bgzf_block_size(header): 0);
+                if(bsize < BGZF_HEADER_SIZE + 8) {fallback = start, done = true; break;}
+                in[n].resize(bsize);
+                std::memcpy(&in[n][0], header, BGZF_HEADER_SIZE);
+                if(std::fread(&in[n][BGZF_HEADER_SIZE], 1, bsize - BGZF_HEADER_SIZE, raw_) != bsize - BGZF_HEADER_SIZE) {
+                    fallback = start, done = true;
+                    break;
+                }
+                ++n;
+            }
+            if(nthreads_ > 1 && n > 1) kt_for(nthreads_, &inflate_block_fn, &helper, n);
+            else for(size_t i(0); i < n; inflate_block_fn(&helper, i++, 0));
+            for(size_t i(0); i < n; ++i)
+                if(!send_all(out[i].data(), out[i].size())) return;
+        }
+        if(fallback >= 0) run_plain_from(fallback);
+    }
+    void run() {
+        if(raw_) run_bgzf();
+        else     run_plain(src_);
+        ::shutdown(fds_[1], SHUT_WR);
+    }
+
+public:
+    static bool is_compressed(const char *path) {
+        unsigned char magic[4]{0};
+        std::FILE *fp(std::fopen(path, "rb"));
+        if(!fp) return false;
+        const size_t n(std::fread(magic, 1, sizeof(magic), fp));
+        std::fclose(fp);
+        return n >= 2 && ((magic[0] == 31 && magic[1] == 139) ||                                           // gzip/bgzf
+                          (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)); // zstd
+    }
+    static bool is_bgzf(const char *path) {
+        unsigned char header[BGZF_HEADER_SIZE];
+        std::FILE *fp(std::fopen(path, "rb"));
+        if(!fp) return false;
+        const bool ret(std::fread(header, 1, BGZF_HEADER_SIZE, fp) == BGZF_HEADER_SIZE && bgzf_block_size(header));
+        std::fclose(fp);
+        return ret;
+    }
+
+    GzReadAhead(const char *path, int nthreads=1): fp_(nullptr), src_(nullptr), fds_{-1, -1}, raw_(nullptr), nthreads_(std::max(nthreads, 1)) {
+        if(!is_compressed(path)) {
+            fp_ = gzopen(path, "rb");
+            return;
+        }
+        if(is_bgzf(path)) {
+            if((raw_ = std::fopen(path, "rb")) == nullptr) return;
+        } else if((src_ = gzopen(path, "rb")) == nullptr) return;
+        if(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds_)) {
+            LOG_WARNING("Could not create socket pair for read-ahead of %s. Decompressing on the calling thread.\n", path);
+            if(raw_) std::fclose(raw_), raw_ = nullptr;
+            if(src_) gzclose(src_), src_ = nullptr;
+            fp_ = gzopen(path, "rb");
+            return;
+        }
+        const int sndbuf(BUFSIZE << 2);
+        ::setsockopt(fds_[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        if((fp_ = gzdopen(fds_[0], "rb")) == nullptr) LOG_EXIT("Could not open read-ahead stream for %s.\n", path);
+        gzbuffer(fp_, 1 << 17);
+        thread_ = std::thread(&GzReadAhead::run, this);
+    }
+    GzReadAhead(const GzReadAhead &) = delete;
+    GzReadAhead(GzReadAhead &&) = delete;
+    gzFile get() const {return fp_;}
+    operator gzFile() const {return fp_;}
+    ~GzReadAhead() {
+        // Closing our end first makes the decompressing thread stop early if we didn't read everything.
+        if(fp_) gzclose(fp_);
+        if(thread_.joinable()) thread_.join();
+        if(fds_[1] >= 0) ::close(fds_[1]);
+        if(src_) gzclose(src_);
+        if(raw_) std::fclose(raw_);
+    }
+};
+
+} // namespace bns
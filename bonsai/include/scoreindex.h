@@ -0,0 +1,93 @@
+#pragma once
+#include <memory>
+#include "hash.h"
+#include "klib/kthread.h"
+#include "util.h"
+
+namespace bns {
+
+/*
+ * ScoreIndex:
+ * Read-only kmer -> score table for scored minimization (score::Hash), built once from the phase 1 map.
+ * Keys and scores are stored together in one open-addressed array with linear probing,
+ * so a lookup usually costs a single cache miss. Keys not in the index get default_score().
+ * BF marks empty slots; it is never a key, since kmers with ambiguous bases aren't stored.
+ */
+class ScoreIndex {
+public:
+    struct entry_t {
+        u64 key_;
+        u64 val_;
+    };
+private:
+    std::unique_ptr<entry_t[]> table_;
+    u64    mask_;
+    size_t size_;
+    u64 default_;
+    static constexpr u64 EMPTY = BF;
+    static constexpr size_t BUCKETS_PER_JOB = 1 << 16;
+
+    struct build_helper {
+        ScoreIndex            &index_;
+        const khash_t(64)     *map_;
+    };
+    static void fill_fn(void *data_, long index, int tid) {
+        auto &h(*(build_helper *)data_);
+        for(u64 i(index * BUCKETS_PER_JOB), e(std::min(u64(h.index_.mask_ + 1), (index + 1) * BUCKETS_PER_JOB)); i < e; ++i)
+            h.index_.table_[i] = entry_t{EMPTY, 0};
+    }
+    static void build_fn(void *data_, long index, int tid) {
+        auto &h(*(build_helper *)data_);
+        for(khiter_t ki(index * BUCKETS_PER_JOB), e(std::min(u64(kh_end(h.map_)), (index + 1) * BUCKETS_PER_JOB)); ki < e; ++ki)
+            if(kh_exist(h.map_, ki))
+                h.index_.insert(kh_key(h.map_, ki), kh_val(h.map_, ki));
+    }
+    // Safe to call from multiple threads: slots are claimed with a CAS on the key.
+    void insert(u64 key, u64 val) {
+        if(unlikely(key == EMPTY)) RUNTIME_ERROR("Cannot index the invalid kmer.");
+        for(u64 i(wang_hash(key) & mask_);; i = (i + 1) & mask_) {
+            u64 cur(table_[i].key_);
+            if(cur == EMPTY) {
+                if(__sync_bool_compare_and_swap(&table_[i].key_, EMPTY, key)) {
+                    table_[i].val_ = val;
+                    return;
+                }
+                cur = table_[i].key_;
+            }
+            if(cur == key) {
+                table_[i].val_ = val;
+                return;
+            }
+        }
+    }
+public:
+    ScoreIndex(const khash_t(64) *map, int num_threads=1, u64 default_score=BF):
+        mask_(roundup64(std::max(u64(kh_size(map)) + (kh_size(map) >> 1), u64(BUCKETS_PER_JOB))) - 1),
+        size_(kh_size(map)), default_(default_score)
+    {
+        if(num_threads <= 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+        table_.reset(new entry_t[mask_ + 1]);
+        build_helper helper{*this, map};
+        kt_for(num_threads, &fill_fn, &helper, (mask_ + BUCKETS_PER_JOB) / BUCKETS_PER_JOB);
+        kt_for(num_threads, &build_fn, &helper, (kh_end(map) + BUCKETS_PER_JOB - 1) / BUCKETS_PER_JOB);
+        LOG_INFO("Built score index with %zu keys in %zu slots.\n", size_, size_t(mask_ + 1));
+    }
+    ScoreIndex(const ScoreIndex &) = delete;
+    ScoreIndex(ScoreIndex &&) = default;
+    INLINE const entry_t *find(u64 key) const {
+        if(unlikely(key == EMPTY)) return nullptr;
+        for(u64 i(wang_hash(key) & mask_);; i = (i + 1) & mask_) {
+            const entry_t &e(table_[i]);
+            if(e.key_ == key)   return &e;
+            if(e.key_ == EMPTY) return nullptr;
+        }
+    }
+    INLINE u64 score(u64 key) const {
+        const entry_t *e(find(key));
+        return e ? e->val_: default_;
+    }
+    size_t size()        const {return size_;}
+    u64 default_score()  const {return default_;}
+};
+
+} // namespace bns
@@ -5,6 +5,9 @@
 #include <string>
 #include <algorithm>
 #include "kmerutil.h"
+#if __BMI2__
+#include <immintrin.h>
+#endif
 
 namespace bns {
 
@@ -49,7 +52,7 @@ inline spvec_t sub1(const spvec_t &spaces) {
 }
 
 struct Spacer {
-    static const u32 max_k = 32;
+    static const u32 max_k = 64; // Encoder handles up to 32; WideEncoder up to 64.
 
     // Instance variables
     spvec_t          s_; // Spaces to skip
@@ -81,7 +84,8 @@ public:
     }
     Spacer(unsigned k): Spacer(k, k) {}
     Spacer(const Spacer &other): s_(other.s_), k_(other.k_), c_(other.c_), w_(other.w_) {}
-    void write(u64 kmer, std::FILE *fp=stdout) const {
+    template<typename KmerType=u64>
+    void write(KmerType kmer, std::FILE *fp=stdout) const {
         int offset = ((k_ - 1) << 1);
         std::fputc(num2nuc((kmer >> offset) & 0x3u), fp);
         for(auto s: s_) {
@@ -92,7 +96,8 @@ public:
         }
         std::fputc('\n', fp);
     }
-    std::string to_string(u64 kmer) const {
+    template<typename KmerType=u64>
+    std::string to_string(KmerType kmer) const {
         std::string ret;
         ret.reserve(c_ - k_ + 1);
         int offset = ((k_ - 1) << 1);
@@ -108,6 +113,86 @@ public:
     ~Spacer() {}
 };
 
+/*
+ * SpacedExtractor:
+ * Pulls a spaced kmer out of a packed 2-bit window of the whole comb, so that encoders can roll
+ * the window one base at a time instead of re-reading k spaced bases.
+ * Windows are a u64 for combs of up to 32 bases and a u128 for up to 64.
+ * The forward window has the oldest base in the highest bits; the reverse-complement window
+ * is rolled the other way, so extracting from it yields the reverse complement directly.
+ * Uses PEXT where BMI2 is available and a loop over contiguous runs of the mask otherwise.
+ */
+class SpacedExtractor {
+public:
+    using u128 = ::bns::u128;
+    static constexpr unsigned MAX_COMB = 64;
+private:
+    struct run_t {
+        u8 shift_, len_, dest_;
+    };
+    struct half_t {
+        u64 mask_;
+        std::vector<run_t> runs_;
+        half_t(u64 mask=0): mask_(mask) {
+            u8 dest(0);
+            for(unsigned i(0); i < 64;) {
+                if(!(mask >> i & 1)) {++i; continue;}
+                unsigned j(i);
+                while(j < 64 && (mask >> j & 1)) ++j;
+                runs_.push_back(run_t{u8(i), u8(j - i), dest});
+                dest += j - i;
+                i = j;
+            }
+        }
+        INLINE u64 extract(u64 x) const {
+#if __BMI2__
+            return _pext_u64(x, mask_);
+#else
+            u64 ret(0);
+            for(const auto &r: runs_)
+                ret |= ((x >> r.shift_) & (UINT64_C(-1) >> (64 - r.len_))) << r.dest_;
+            return ret;
+#endif
+        }
+    };
+    half_t fwlo_, fwhi_, rclo_, rchi_;
+    unsigned fwshift_, rcshift_; // Number of bits extracted from the low halves
+    u64 used_;
+public:
+    SpacedExtractor(const Spacer &sp): fwshift_(0), rcshift_(0), used_(0) {
+        if(sp.c_ > MAX_COMB) return; // Encoders fall back to Encoder::kmer.
+        u128 fw(0), rc(0);
+        for(unsigned i(0), p(0);; p += sp.s_[i++]) {
+            fw    |= u128(3) << ((sp.c_ - 1 - p) << 1);
+            rc    |= u128(3) << (p << 1);
+            used_ |= UINT64_C(1) << (sp.c_ - 1 - p);
+            if(i == sp.s_.size()) break;
+        }
+        fwlo_ = half_t(u64(fw)), fwhi_ = half_t(u64(fw >> 64));
+        rclo_ = half_t(u64(rc)), rchi_ = half_t(u64(rc >> 64));
+        fwshift_ = __builtin_popcountll(fwlo_.mask_);
+        rcshift_ = __builtin_popcountll(rclo_.mask_);
+    }
+    bool valid() const {return used_;}
+    // One bit per base of the comb, newest base at bit 0, set for bases which are part of the kmer.
+    u64 used() const {return used_;}
+    INLINE u64 fw(u64 window) const {return fwlo_.extract(window);}
+    INLINE u64 rc(u64 window) const {return rclo_.extract(window);}
+    INLINE u64 fw(u128 window) const {
+        return fwlo_.extract(u64(window)) | (fwhi_.extract(u64(window >> 64)) << fwshift_);
+    }
+    INLINE u64 rc(u128 window) const {
+        return rclo_.extract(u64(window)) | (rchi_.extract(u64(window >> 64)) << rcshift_);
+    }
+    // For k > 32.
+    INLINE u128 fw128(u128 window) const {
+        return u128(fwlo_.extract(u64(window))) | (u128(fwhi_.extract(u64(window >> 64))) << fwshift_);
+    }
+    INLINE u128 rc128(u128 window) const {
+        return u128(rclo_.extract(u64(window))) | (u128(rchi_.extract(u64(window >> 64))) << rcshift_);
+    }
+};
+
 } // namespace bns
 
 #endif // #ifndef _EMP_SPACE_H__
@@ -0,0 +1,250 @@
+#pragma once
+#include "util.h"
+#include "klib/kthread.h"
+
+namespace bns {
+
+/*
+ * Taxonomy:
+ * Flat, read-only taxonomy for the hot paths (LCA during database builds, tree resolution per read).
+ * Taxids are mapped once to dense indices; parents, depths and ranks are arrays over those indices,
+ * so walking toward the root is a sequence of array reads instead of hash probes.
+ * Depths match node_depth: the root (whose parent is 0) has depth 1.
+ * Nodes whose parent is missing from the taxonomy are kept as roots of their own subtrees.
+ */
+class Taxonomy {
+public:
+    static constexpr u32 NONE = u32(-1);
+private:
+    std::vector<tax_t>      taxids_;  // Dense index -> taxid, sorted.
+    std::vector<u32>        parents_; // Dense index -> dense index of parent, NONE for roots.
+    std::vector<u32>        depths_;
+    std::vector<ClassLevel> ranks_;   // Empty unless load_ranks has been called.
+    std::vector<u32>        index_;   // Taxid -> dense index, if taxids are dense enough for a direct table.
+
+    struct rank_helper {
+        Taxonomy                  &tax_;
+        const char               *data_;
+        const std::vector<size_t> &chunks_;
+    };
+    static void rank_fn(void *data_, long index, int tid) {
+        auto &h(*(rank_helper *)data_);
+        const char *p(h.data_ + h.chunks_[index]), *end(h.data_ + h.chunks_[index + 1]);
+        std::string buffer;
+        while(p < end) {
+            const char *eol(static_cast<const char *>(std::memchr(p, '\n', end - p)));
+            if(!eol) eol = end;
+            const u32 i(h.tax_.index(detail::parse_uint(p, eol)));
+            const char *q(static_cast<const char *>(std::memchr(p, '|', eol - p)));
+            if(i != NONE && q && (q = static_cast<const char *>(std::memchr(q + 1, '|', eol - q - 1)))) {
+                while(++q < eol && (*q == ' ' || *q == '\t'));
+                const char *qe(q);
+                while(qe < eol && *qe != '\t' && *qe != '|') ++qe;
+                buffer.assign(q, qe);
+                auto m(classlvl_map.find(buffer));
+                // Each line owns a distinct slot, so no locking is needed.
+                h.tax_.ranks_[i] = m == classlvl_map.end() ? ClassLevel::NO_RANK: m->second;
+            }
+            p = eol + 1;
+        }
+    }
+    void build(const khash_t(p) *parents) {
+        taxids_.reserve(kh_size(parents));
+        for(khiter_t ki(0); ki < kh_end(parents); ++ki)
+            if(kh_exist(parents, ki))
+                taxids_.push_back(kh_key(parents, ki));
+        SORT(taxids_.begin(), taxids_.end());
+        const size_t n(taxids_.size());
+        if(n && taxids_.back() < 4 * n + (1u << 20)) {
+            index_.resize(size_t(taxids_.back()) + 1, NONE);
+            for(size_t i(0); i < n; ++i) index_[taxids_[i]] = i;
+        }
+        parents_.resize(n);
+        size_t norphans(0);
+        for(size_t i(0); i < n; ++i) {
+            const tax_t parent(kh_val(parents, kh_get(p, parents, taxids_[i])));
+            parents_[i] = parent ? index(parent): NONE;
+            norphans += parent && parents_[i] == NONE;
+        }
+        if(norphans) LOG_WARNING("%zu taxa have parents missing from the taxonomy.\n", norphans);
+        // Fill in depths iteratively, walking up only as far as the first node already done.
+        static constexpr u32 IN_PROGRESS = u32(-1);
+        depths_.assign(n, 0);
+        std::vector<u32> stack;
+        for(size_t i(0); i < n; ++i) {
+            u32 node(i);
+            while(node != NONE && depths_[node] == 0) {
+                depths_[node] = IN_PROGRESS;
+                stack.push_back(node);
+                node = parents_[node];
+            }
+            if(node != NONE && depths_[node] == IN_PROGRESS)
+                RUNTIME_ERROR(ks::sprintf("Cycle in taxonomy at taxid %u.", taxids_[node]).data());
+            u32 depth(node == NONE ? 0: depths_[node]);
+            while(stack.size()) depths_[stack.back()] = ++depth, stack.pop_back();
+        }
+        LOG_DEBUG("Built flat taxonomy with %zu taxa (%s index).\n", n, index_.empty() ? "sorted": "direct");
+    }
+public:
+    explicit Taxonomy(const khash_t(p) *parents) {
+        if(parents == nullptr) RUNTIME_ERROR("null taxonomy.");
+        build(parents);
+    }
+    // Parses (or loads the cached parse of) nodes.dmp via build_parent_map.
+    explicit Taxonomy(const char *nodes_path) {
+        khash_t(p) *parents(build_parent_map(nodes_path));
+        build(parents);
+        kh_destroy(p, parents);
+    }
+    Taxonomy(const Taxonomy &) = delete;
+    Taxonomy(Taxonomy &&) = default;
+
+    // Reads the rank column of nodes.dmp. Unrecognized ranks are NO_RANK.
+    void load_ranks(const char *nodes_path, int num_threads=detail::parse_threads()) {
+        detail::MMapFile f(nodes_path);
+        ranks_.assign(size(), ClassLevel::NO_RANK);
+        const std::vector<size_t> chunks(detail::line_chunks(f.data(), f.size(), num_threads * 4));
+        rank_helper helper{*this, f.data(), chunks};
+        kt_for(num_threads, &rank_fn, &helper, chunks.size() - 1);
+    }
+
+    size_t size() const {return taxids_.size();}
+    INLINE u32 index(tax_t taxid) const {
+        if(index_.size()) return taxid < index_.size() ? index_[taxid]: NONE;
+        auto it(std::lower_bound(taxids_.begin(), taxids_.end(), taxid));
+        return it != taxids_.end() && *it == taxid ? u32(it - taxids_.begin()): NONE;
+    }
+    INLINE tax_t taxid(u32 i)        const {return taxids_[i];}
+    INLINE u32   parent_index(u32 i) const {return parents_[i];}
+    INLINE u32   depth_index(u32 i)  const {return depths_[i];}
+    INLINE bool  has(tax_t taxid)    const {return index(taxid) != NONE;}
+    // As get_parent: the maximum value if taxid is missing, 0 for roots.
+    INLINE tax_t parent(tax_t taxid) const {
+        const u32 i(index(taxid));
+        return i == NONE ? std::numeric_limits<tax_t>::max(): parents_[i] == NONE ? 0: taxids_[parents_[i]];
+    }
+    INLINE ClassLevel rank(tax_t taxid) const {
+        const u32 i(index(taxid));
+        return i == NONE || ranks_.empty() ? ClassLevel::NO_RANK: ranks_[i];
+    }
+    // Steps up from the deeper node to the depth of the other, then up both until they meet.
+    // Returns NONE for nodes in different subtrees.
+    INLINE u32 lca_index(u32 i, u32 j) const {
+        while(depths_[i] > depths_[j]) i = parents_[i];
+        while(depths_[j] > depths_[i]) j = parents_[j];
+        while(i != j) i = parents_[i], j = parents_[j];
+        return i;
+    }
+    // Same conventions as lca(const khash_t(p) *, tax_t, tax_t).
+    tax_t lca(tax_t a, tax_t b) const noexcept {
+        if(a == b || b == 0) return a;
+        if(a == 0) return b;
+        const u32 i(index(a)), j(index(b));
+        if(unlikely(i == NONE || j == NONE)) {
+            std::fprintf(stderr, "Missing taxid %u. Returning node b (%u)!\n", i == NONE ? a: b, i == NONE ? b: a);
+            return (tax_t)-1;
+        }
+        const u32 ret(lca_index(i, j));
+        return ret == NONE ? 1: taxids_[ret];
+    }
+    unsigned depth(tax_t a) const noexcept {
+        if(a == 0) return 0;
+        const u32 i(index(a));
+        if(unlikely(i == NONE)) std::fprintf(stderr, "Tax ID %u missing. Abort!\n", a), std::exit(1);
+        return depths_[i];
+    }
+    unsigned dist(tax_t leaf, tax_t root) const noexcept {
+        const unsigned leaf_depth(depth(leaf)), root_depth(depth(root));
+        if(leaf_depth > root_depth) {
+            u32 i(index(leaf));
+            for(unsigned d(leaf_depth); d > root_depth; --d) i = parents_[i];
+            if(root == 0 ? i == NONE: i == index(root)) return leaf_depth - root_depth;
+        }
+        LOG_EXIT("leaf %u is not a child of root %u\n", leaf, root);
+        return 0;
+    }
+};
+
+/*
+ * LcaCache:
+ * Direct-mapped memo of LCA queries, keyed by the (unordered) taxid pair.
+ * Database builds ask for the same pairs over and over (one genome's taxid against the few taxa
+ * already labeling its k-mers), so most queries are answered without touching the tree.
+ * Not thread-safe: each thread uses its own, or threads share one under a lock.
+ */
+class LcaCache {
+    // The depth fills what would otherwise be padding.
+    struct entry_t {
+        u64   key_;
+        tax_t val_;
+        u32   depth_;
+    };
+    const Taxonomy            *tax_;
+    std::unique_ptr<entry_t[]> entries_;
+    const unsigned             shift_;
+    INLINE const entry_t &get(tax_t a, tax_t b) {
+        if(a > b) std::swap(a, b);
+        // Keys are never 0, since a and b are not, so zeroed entries are empty.
+        const u64 key((u64(a) << 32) | b);
+        entry_t &e(entries_[(key * UINT64_C(0x9E3779B97F4A7C15)) >> shift_]);
+        if(e.key_ != key) {
+            e.key_ = key;
+            e.val_ = tax_->lca(a, b);
+            e.depth_ = e.val_ == (tax_t)-1 ? 0: tax_->depth(e.val_);
+        }
+        return e;
+    }
+public:
+    LcaCache(const Taxonomy *tax, unsigned log2size=12):
+        tax_(tax), entries_(new entry_t[size_t(1) << log2size]()), shift_(64 - log2size) {}
+    INLINE tax_t lca(tax_t a, tax_t b) {
+        if(a == b || a == 0 || b == 0) return a ? a: b;
+        return get(a, b).val_;
+    }
+    // Also sets depth to the result's node_depth (0 if a taxid is missing), which is memoized with it.
+    INLINE tax_t lca(tax_t a, tax_t b, unsigned &depth) {
+        if(a == b || a == 0 || b == 0) {
+            depth = tax_->depth(a = a ? a: b);
+            return a;
+        }
+        const entry_t &e(get(a, b));
+        depth = e.depth_;
+        return e.val_;
+    }
+    const Taxonomy *taxonomy() const {return tax_;}
+};
+
+INLINE tax_t lca(const Taxonomy *tax, tax_t a, tax_t b) noexcept {return tax->lca(a, b);}
+INLINE unsigned node_depth(const Taxonomy *tax, tax_t a) noexcept {return tax->depth(a);}
+INLINE unsigned node_dist(const Taxonomy *tax, tax_t leaf, tax_t root) noexcept {return tax->dist(leaf, root);}
+
+// As resolve_tree(hit_counts, const khash_t(p) *), but hits are translated to dense indices once
+// and each leaf-to-root path is walked through the parent array.
+static tax_t resolve_tree(const linear::counter<tax_t, u16> &hit_counts, const Taxonomy *tax) noexcept {
+    static thread_local std::vector<std::pair<u32, u32>> hits;
+    hits.clear();
+    for(size_t i(0); i < hit_counts.size(); ++i) {
+        const u32 index(tax->index(hit_counts.keys()[i]));
+        if(index != Taxonomy::NONE) hits.emplace_back(index, hit_counts.vals()[i]);
+    }
+    u32 max_index(Taxonomy::NONE), max_score(0);
+    bool disjoint(false);
+    for(const auto &hit: hits) {
+        u32 score(0);
+        for(u32 node(hit.first); node != Taxonomy::NONE; node = tax->parent_index(node))
+            for(const auto &other: hits)
+                if(other.first == node) {score += other.second; break;}
+        if(score > max_score) {
+            max_score = score;
+            max_index = hit.first;
+            disjoint = false;
+        } else if(score == max_score && max_index != Taxonomy::NONE) {
+            // If two leaf-to-root paths are tied for max, return the LCA of all.
+            disjoint = (max_index = tax->lca_index(max_index, hit.first)) == Taxonomy::NONE;
+        }
+    }
+    if(disjoint) return 1;
+    return max_index == Taxonomy::NONE ? 0: tax->taxid(max_index);
+}
+
+} // namespace bns
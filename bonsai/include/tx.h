@@ -117,6 +117,7 @@ public:
         for(khint_t ki(0); ki < kh_size(name_map_); ++ki)
             if(kh_exist(name_map_, ki))
                 kh_val(name_map_, ki) = kh_val(old_to_new_, kh_get(p, old_to_new_, kh_val(name_map_, ki)));
+        forget_taxids(name_map_);
 
         LOG_DEBUG("Paths to genomes with new subtax elements:\n\n\n%s", newtaxprintf().data());
         STLFREE(path_map);
@@ -138,8 +139,12 @@ public:
 
     template<typename T>
     void fill_path_map(const T &container) {
+        std::vector<std::string> paths;
+        for(const auto &path: container) paths.emplace_back(get_cstr(path));
+        const std::vector<tax_t> taxids(get_taxids(paths, name_map_));
+        size_t i(0);
         for(const auto &path: container) {
-            const tax_t id(get_taxid(get_cstr(path), name_map_));
+            const tax_t id(taxids[i++]);
             if(id == tax_t(-1)) {
                 if(panic_on_undef_)
                     RUNTIME_ERROR(ks::sprintf("Tax id not found in path %s. Skipping. This can be fixed by augmenting the name dictionary file.\n", get_cstr(path)).data());
@@ -248,8 +253,8 @@ static void bitmap_filler_helper(void *data_, long index, int tid) {
     const tax_t taxid(data.taxes_[index]);
     u64 val;
     Encoder enc(data.sp_, data.canonicalize_);
-    gzFile fp(gzopen(data.paths_[index].data(), "rb"));
-    kseq_t *ks(kseq_init(fp));
+    GzReadAhead fp(data.paths_[index].data());
+    kseq_t *ks(kseq_init(fp.get()));
     while(kseq_read(ks) >= 0) {
         enc.assign(ks);
         while(enc.has_next_kmer())
@@ -257,7 +262,6 @@ static void bitmap_filler_helper(void *data_, long index, int tid) {
                 map.set_kmer_ts(data.h_, val, taxid);
     }
     kseq_destroy(ks);
-    gzclose(fp);
 }
 
 } // namespace bns
@@ -10,6 +10,7 @@
 #include <cinttypes>
 #include <cstdio>
 #include <cstring>
+#include <exception>
 #include <forward_list>
 #include <fstream>
 #include <functional>
@@ -18,16 +19,22 @@
 #include <random>
 #include <set>
 #include <sstream>
+#include <thread>
 #include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <zlib.h>
 
 #include "kspp/ks.h"
 #include "clhash/include/clhash.h"
 #include "khash64.h"
 #include "klib/kstring.h"
+#include "klib/kthread.h"
 #include "kseq_declare.h"
 #include "lazy/vector.h"
 #include "linear/linear.h"
@@ -130,6 +137,7 @@ using i8  = std::uint8_t;
 using u16 = std::uint16_t;
 using u32 = std::uint32_t;
 using u64 = std::uint64_t;
+using u128 = __uint128_t;
 using u8  = std::uint8_t;
 using std::size_t;
 using tax_t = u32;
@@ -166,6 +174,12 @@ KHASH_MAP_INIT_INT64(64, u64)
 KHASH_MAP_INIT_INT(p, tax_t)
 KHASH_MAP_INIT_STR(name, tax_t)
 
+// 128-bit kmer keys, for k > 32. Equality is a single 128-bit comparison, which compilers do branch-free.
+#define kh_u128_hash_func(key) __ac_Wang64_hash((u64)(key) ^ __ac_Wang64_hash((u64)((key) >> 64)))
+#define kh_u128_hash_equal(a, b) ((a) == (b))
+KHASH_INIT(all128, u128, char, 0, kh_u128_hash_func, kh_u128_hash_equal)
+KHASH_INIT(c128, u128, tax_t, 1, kh_u128_hash_func, kh_u128_hash_equal)
+
 // Resolve_tree is modified from Kraken 1 source code, which
 // is MIT-licensed. https://github.com/derrickwood/kraken
 
@@ -203,6 +217,9 @@ template<> inline khint_t khash_put(khash_t(64) *map, uint64_t key, int *ret) {
 template<> inline khint_t khash_put(khash_t(all) *map, uint64_t key, int *ret) {
     return kh_put(all, map, key, ret);
 }
+template<> inline khint_t khash_put(khash_t(all128) *map, u128 key, int *ret) {
+    return kh_put(all128, map, key, ret);
+}
 
 template<typename T, typename KType> khint_t khash_get(T *map, KType key) {
 #if __cplusplus < 201703L
@@ -231,6 +248,10 @@ void khash_destroy(khash_t(all) *map) noexcept;
 template<>
 void khash_destroy(khash_t(c) *map) noexcept;
 template<>
+void khash_destroy(khash_t(all128) *map) noexcept;
+template<>
+void khash_destroy(khash_t(c128) *map) noexcept;
+template<>
 void khash_destroy(khash_t(p) *map) noexcept;
 template<>
 void khash_destroy(khash_t(name) *map) noexcept;
@@ -280,6 +301,82 @@ void print_khash(T *rex) noexcept {
 }
 
 
+// Number of buckets needed to hold nelem keys without khash growing past its load factor.
+INLINE khint_t khash_buckets_for(size_t nelem) {
+    return static_cast<khint_t>(nelem / __ac_HASH_UPPER) + 1;
+}
+
+template<typename T>
+struct khash_grow_helper {
+    const T       *h_;
+    khint32_t *flags_;
+    decltype(h_->keys) keys_;
+    decltype(h_->vals) vals_;
+    const khint_t  mask_;
+    const khint_t chunk_;
+};
+
+template<typename T>
+void khash_grow_helper_fn(void *data, long index, int tid) {
+    // Keys are unique, so inserting only needs to claim an empty bucket.
+    // The flag word for a bucket is shared with 15 neighbors, so claim it with a CAS.
+    auto &hh(*(khash_grow_helper<T> *)data);
+    const T *h(hh.h_);
+    for(khint_t j(index * hh.chunk_), end(std::min(j + hh.chunk_, kh_end(h))); j < end; ++j) {
+        if(!kh_exist(h, j)) continue;
+        khint_t i(__ac_Wang64_hash(h->keys[j]) & hh.mask_), step(0);
+        for(;;) {
+            khint32_t *fp(hh.flags_ + (i >> 4));
+            const khint32_t bit(2u << ((i & 0xfU) << 1));
+            khint32_t old(*fp);
+            if(old & bit) {
+                if(__sync_bool_compare_and_swap(fp, old, old & ~bit)) break;
+                continue; // Neighbor claimed a bucket in the same word; try this one again.
+            }
+            i = (i + (++step)) & hh.mask_;
+        }
+        hh.keys_[i] = h->keys[j];
+        if(hh.vals_) hh.vals_[i] = h->vals[j];
+    }
+}
+
+// Multithreaded replacement for khash's in-place resize, for use when a table outgrows its initial sizing.
+// Only for tables with 64-bit integer keys (all, c, 64), which are the ones big enough for this to matter.
+// This keeps old and new arrays live at once, so it's a fallback rather than something to do routinely.
+template<typename T>
+void khash_parallel_grow(T *h, khint_t new_n_buckets, int nthreads=-1) {
+    if(nthreads <= 0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+    kroundup64(new_n_buckets);
+    if(new_n_buckets <= h->n_buckets) return;
+    LOG_INFO("Growing table of size %zu from %zu to %zu buckets with %i threads.\n", size_t(h->size), size_t(h->n_buckets), size_t(new_n_buckets), nthreads);
+    using KeyType = std::remove_pointer_t<decltype(h->keys)>;
+    using ValType = std::remove_pointer_t<decltype(h->vals)>;
+    khint32_t *new_flags(static_cast<khint32_t *>(std::malloc(__ac_fsize(new_n_buckets) * sizeof(khint32_t))));
+    KeyType *new_keys(static_cast<KeyType *>(std::malloc(new_n_buckets * sizeof(KeyType))));
+    ValType *new_vals(h->vals ? static_cast<ValType *>(std::malloc(new_n_buckets * sizeof(ValType))): nullptr);
+    if(!new_flags || !new_keys || (h->vals && !new_vals)) throw std::bad_alloc();
+    std::memset(new_flags, 0xaa, __ac_fsize(new_n_buckets) * sizeof(khint32_t));
+    const khint_t chunk(1 << 16);
+    khash_grow_helper<T> helper{h, new_flags, new_keys, new_vals, new_n_buckets - 1, chunk};
+    kt_for(nthreads, &khash_grow_helper_fn<T>, &helper, (kh_end(h) + chunk - 1) / chunk);
+    std::free(h->flags), std::free(h->keys), std::free(h->vals);
+    h->flags = new_flags, h->keys = new_keys, h->vals = new_vals;
+    h->n_buckets = new_n_buckets;
+    h->n_occupied = h->size;
+    h->upper_bound = (khint_t)(h->n_buckets * __ac_HASH_UPPER + 0.5);
+}
+
+// Call before each insertion: grows the table in parallel when the next insert would make khash rehash serially.
+// nthreads is the caller's thread budget, since this is usually reached while holding a lock.
+template<typename T>
+INLINE void khash_check_load(T *h, int nthreads) {
+    if(unlikely(h->n_occupied >= h->upper_bound) && h->n_buckets) {
+        static int warned = 0;
+        if(!warned) LOG_WARNING("Table of size %zu exceeded its presized capacity. Consider a larger starting size.\n", size_t(h->size)), warned = 1;
+        khash_parallel_grow(h, h->n_buckets << 1, nthreads);
+    }
+}
+
 #define __fw(item, fn) ::write(fn, static_cast<const void *>(std::addressof(item)), sizeof(item))
 template<typename T>
 size_t khash_write_impl(const T *map, const int fn) noexcept {
@@ -708,39 +805,334 @@ static unsigned node_depth(const khash_t(p) *map, tax_t a) noexcept {
     return ret;
 }
 
-static khash_t(name) *build_name_hash(const char *fn) noexcept {
-    size_t bufsz(2048), namelen;
-    char *buf((char *)std::malloc(bufsz));
-    ssize_t len;
-    std::FILE *fp(std::fopen(fn, "r"));
+namespace detail {
+
+// Read-only mapping of a whole file.
+class MMapFile {
+    const char *data_;
+    size_t      size_;
+public:
+    MMapFile(const char *fn): data_(nullptr), size_(0) {
+        const int fd(::open(fn, O_RDONLY));
+        if(fd < 0) RUNTIME_ERROR(std::string("Could not open ") + fn + " for reading.");
+        struct stat st;
+        if(::fstat(fd, &st)) ::close(fd), RUNTIME_ERROR(std::string("Could not stat ") + fn);
+        if((size_ = st.st_size)) {
+            void *ptr(::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0));
+            if(ptr == MAP_FAILED) ::close(fd), RUNTIME_ERROR(std::string("Could not mmap ") + fn);
+            ::madvise(ptr, size_, MADV_SEQUENTIAL);
+            data_ = static_cast<const char *>(ptr);
+        }
+        ::close(fd);
+    }
+    MMapFile(const MMapFile &) = delete;
+    ~MMapFile() {if(data_) ::munmap(const_cast<char *>(data_), size_);}
+    const char *data() const {return data_;}
+    size_t size()      const {return size_;}
+};
+
+INLINE int parse_threads() {return std::min(16u, std::max(1u, std::thread::hardware_concurrency()));}
+
+// Splits a buffer into about n ranges, each ending just after a newline (or at the end of the buffer).
+// Range i is [ret[i], ret[i + 1]).
+inline std::vector<size_t> line_chunks(const char *data, size_t size, size_t n) {
+    std::vector<size_t> ret{0};
+    for(size_t i(1); i < n; ++i) {
+        size_t pos(std::max(ret.back(), size * i / n));
+        const char *nl(pos < size ? static_cast<const char *>(std::memchr(data + pos, '\n', size - pos)): nullptr);
+        if(!nl) break;
+        if((pos = nl - data + 1) > ret.back()) ret.push_back(pos);
+    }
+    if(ret.back() != size || ret.size() == 1) ret.push_back(size);
+    return ret;
+}
+
+// Parses an unsigned integer after optional spaces/tabs. Returns 0 if there are no digits.
+INLINE tax_t parse_uint(const char *p, const char *end) {
+    while(p < end && (*p == ' ' || *p == '\t')) ++p;
+    tax_t ret(0);
+    for(unsigned d; p < end && (d = unsigned(*p) - '0') < 10; ++p) ret = ret * 10 + d;
+    return ret;
+}
+
+struct checksum_helper {
+    const char *data_;
+    size_t      size_;
+    u64        *sums_;
+};
+static constexpr size_t CHECKSUM_CHUNK = size_t(1) << 24;
+static void checksum_fn(void *data_, long index, int tid) {
+    auto &h(*(checksum_helper *)data_);
+    const size_t start(index * CHECKSUM_CHUNK), end(std::min(h.size_, start + CHECKSUM_CHUNK));
+    u64 sum(index), word;
+    size_t i(start);
+    for(; i + sizeof(word) <= end; i += sizeof(word)) {
+        std::memcpy(&word, h.data_ + i, sizeof(word));
+        sum = (sum ^ word) * UINT64_C(0x9E3779B97F4A7C15);
+        sum ^= sum >> 29;
+    }
+    for(word = 0; i < end; word = (word << 8) | uint8_t(h.data_[i++]));
+    h.sums_[index] = sum ^ word;
+}
+// Content checksum for validating caches, computed in parallel over fixed-size chunks.
+inline u64 file_checksum(const MMapFile &f, int nthreads) {
+    const size_t nchunks((f.size() + CHECKSUM_CHUNK - 1) / CHECKSUM_CHUNK);
+    std::vector<u64> sums(nchunks);
+    checksum_helper helper{f.data(), f.size(), sums.data()};
+    kt_for(nthreads, &checksum_fn, &helper, nchunks);
+    u64 ret(f.size());
+    for(const u64 sum: sums) ret = (ret ^ sum) * UINT64_C(0xBF58476D1CE4E5B9), ret ^= ret >> 31;
+    return ret;
+}
+
+/*
+ * Binary caches of parsed taxonomy files are written next to the source as <path>.bnscache,
+ * starting with a magic number, the source's size and its checksum.
+ * A cache is used only if all three match; otherwise the source is parsed and the cache rewritten.
+ * Set BONSAI_NO_TAX_CACHE to neither read nor write them.
+ */
+static constexpr u64 PARENT_CACHE_MAGIC = UINT64_C(0x3170617478736e62); // "bnsxtap1"
+static constexpr u64 NAME_CACHE_MAGIC   = UINT64_C(0x31656d616e736e62); // "bnsname1"
+struct cache_header {
+    u64 magic_;
+    u64 size_;
+    u64 checksum_;
+};
+INLINE bool use_tax_cache() {return std::getenv("BONSAI_NO_TAX_CACHE") == nullptr;}
+inline std::string tax_cache_path(const char *fn) {return std::string(fn) + ".bnscache";}
+// Returns an open cache file positioned after the header if it matches, otherwise nullptr.
+inline std::FILE *open_tax_cache(const char *fn, const cache_header &expected) {
+    if(!use_tax_cache()) return nullptr;
+    std::FILE *fp(std::fopen(tax_cache_path(fn).data(), "rb"));
+    cache_header h;
+    if(fp && (std::fread(&h, sizeof(h), 1, fp) != 1 || std::memcmp(&h, &expected, sizeof(h)))) std::fclose(fp), fp = nullptr;
+    return fp;
+}
+// Bytes left in a cache file after its current position.
+inline u64 tax_cache_remaining(std::FILE *fp) {
+    struct stat st;
+    const long pos(std::ftell(fp));
+    return pos >= 0 && ::fstat(fileno(fp), &st) == 0 && st.st_size >= pos ? u64(st.st_size - pos): 0;
+}
+// Reads the counts at the start of a cached khash and allocates its arrays.
+// Returns false if the counts are inconsistent, or the arrays couldn't fit in what remains of the cache,
+// so a damaged cache can't ask for an absurd allocation.
+template<typename T>
+bool read_tax_cache_counts(std::FILE *fp, T *h) {
+    const u64 remaining(tax_cache_remaining(fp));
+    if(std::fread(&h->n_buckets, sizeof(h->n_buckets), 1, fp) != 1 ||
+       std::fread(&h->n_occupied, sizeof(h->n_occupied), 1, fp) != 1 ||
+       std::fread(&h->size, sizeof(h->size), 1, fp) != 1 ||
+       std::fread(&h->upper_bound, sizeof(h->upper_bound), 1, fp) != 1)
+        return false;
+    if((h->n_buckets & (h->n_buckets - 1)) || h->size > h->n_occupied || h->n_occupied > h->n_buckets || h->upper_bound > h->n_buckets ||
+       u64(h->n_buckets) * (sizeof(*h->keys) + sizeof(*h->vals)) > remaining)
+        return false;
+    h->flags = (u32 *)std::malloc(__ac_fsize(h->n_buckets) * sizeof(*h->flags));
+    h->keys  = (std::remove_pointer_t<decltype(h->keys)> *)std::calloc(h->n_buckets, sizeof(*h->keys));
+    h->vals  = (std::remove_pointer_t<decltype(h->vals)> *)std::malloc(h->n_buckets * sizeof(*h->vals));
+    return h->n_buckets == 0 || (h->flags && h->keys && h->vals);
+}
+// Caches are written to a temporary file and renamed into place, so readers never see a partial cache.
+template<typename WriteFn>
+void write_tax_cache(const char *fn, const cache_header &header, const WriteFn &write_fn) {
+    if(!use_tax_cache()) return;
+    const std::string path(tax_cache_path(fn)), tmp(path + ks::sprintf(".%d", int(::getpid())).data());
+    std::FILE *fp(std::fopen(tmp.data(), "wb"));
+    if(!fp) {
+        LOG_DEBUG("Could not write taxonomy cache %s. Continuing without it.\n", path.data());
+        return;
+    }
+    const bool ok(std::fwrite(&header, sizeof(header), 1, fp) == 1 && write_fn(fp));
+    if(std::fclose(fp) || !ok || std::rename(tmp.data(), path.data())) {
+        LOG_WARNING("Failed to write taxonomy cache %s.\n", path.data());
+        std::remove(tmp.data());
+    }
+}
+
+// Names in hashes built by build_name_hash live in a few large arenas rather than individual allocations.
+struct name_arenas {
+    std::mutex m_;
+    std::unordered_map<const void *, std::vector<std::unique_ptr<char[]>>> map_;
+};
+inline name_arenas &get_name_arenas() {
+    static name_arenas ret;
+    return ret;
+}
+inline void add_name_arena(const void *hash, std::unique_ptr<char[]> &&arena) {
+    auto &a(get_name_arenas());
+    LockSmith<std::mutex> lock(a.m_);
+    a.map_[hash].push_back(std::move(arena));
+}
+
+// Taxids resolved by get_taxids, per name hash, so that each genome is opened at most once.
+// Entries are dropped by destroy_name_hash.
+struct taxid_cache {
+    std::mutex m_;
+    std::unordered_map<const void *, std::unordered_map<std::string, tax_t>> map_;
+};
+inline taxid_cache &get_taxid_cache() {
+    static taxid_cache ret;
+    return ret;
+}
+
+struct name_parse_helper {
+    const char                                          *data_;
+    const std::vector<size_t>                          &chunks_;
+    std::vector<std::unique_ptr<char[]>>               &arenas_;
+    std::vector<std::vector<std::pair<const char *, tax_t>>> &entries_;
+};
+static void name_parse_fn(void *data_, long index, int tid) {
+    auto &h(*(name_parse_helper *)data_);
+    const char *p(h.data_ + h.chunks_[index]), *end(h.data_ + h.chunks_[index + 1]);
+    // Names are copied, NUL-terminated, into an arena no larger than the chunk.
+    h.arenas_[index].reset(new char[end - p + 1]);
+    char *out(h.arenas_[index].get());
+    auto &entries(h.entries_[index]);
+    while(p < end) {
+        const char *eol(static_cast<const char *>(std::memchr(p, '\n', end - p)));
+        if(!eol) eol = end;
+        if(p < eol && *p != '#' && *p != '\r') {
+            const char *tab(static_cast<const char *>(std::memchr(p, '\t', eol - p)));
+            const char *name_end(tab ? tab: eol);
+            std::memcpy(out, p, name_end - p);
+            out[name_end - p] = '\0';
+            entries.emplace_back(out, tab ? parse_uint(tab + 1, eol): 0);
+            out += name_end - p + 1;
+        }
+        p = eol + 1;
+    }
+}
+
+struct parent_parse_helper {
+    const char                                    *data_;
+    const std::vector<size_t>                    &chunks_;
+    std::vector<std::vector<std::pair<tax_t, tax_t>>> &entries_;
+};
+static void parent_parse_fn(void *data_, long index, int tid) {
+    auto &h(*(parent_parse_helper *)data_);
+    const char *p(h.data_ + h.chunks_[index]), *end(h.data_ + h.chunks_[index + 1]);
+    auto &entries(h.entries_[index]);
+    while(p < end) {
+        const char *eol(static_cast<const char *>(std::memchr(p, '\n', end - p)));
+        if(!eol) eol = end;
+        if(p < eol && *p != '#') {
+            const char *bar(static_cast<const char *>(std::memchr(p, '|', eol - p)));
+            entries.emplace_back(parse_uint(p, eol), bar ? parse_uint(bar + 1, eol): tax_t(-1));
+            if(!bar) LOG_WARNING("Malformed line: %.*s\n", int(eol - p), p);
+        }
+        p = eol + 1;
+    }
+}
+
+} // namespace detail
+
+// Builds a name -> taxid map from a file with lines of name<TAB>taxid, in parallel from an mmap of the file,
+// or loads it from a binary cache of a previous parse.
+static khash_t(name) *build_name_hash(const char *fn) {
+    using namespace detail;
+    const int nthreads(parse_threads());
+    MMapFile f(fn);
+    const cache_header header{NAME_CACHE_MAGIC, f.size(), file_checksum(f, nthreads)};
     khash_t(name) *ret(kh_init(name));
-    kh_resize(name, ret, count_lines(fn));
-    char *p;
+    if(std::FILE *fp = open_tax_cache(fn, header)) {
+        u64 nbytes;
+        bool ok(read_tax_cache_counts(fp, ret));
+        if(ok) {
+            std::vector<u64> offsets(ret->n_buckets);
+            ok = std::fread(ret->flags, sizeof(*ret->flags), __ac_fsize(ret->n_buckets), fp) == __ac_fsize(ret->n_buckets) &&
+                 std::fread(ret->vals, sizeof(*ret->vals), ret->n_buckets, fp) == ret->n_buckets &&
+                 std::fread(offsets.data(), sizeof(u64), ret->n_buckets, fp) == ret->n_buckets &&
+                 std::fread(&nbytes, sizeof(nbytes), 1, fp) == 1 &&
+                 nbytes == tax_cache_remaining(fp);
+            if(ok) {
+                std::unique_ptr<char[]> arena(new char[nbytes]);
+                // Every name must start inside the arena, and the last must be terminated.
+                ok = std::fread(arena.get(), 1, nbytes, fp) == nbytes && (nbytes == 0 || arena[nbytes - 1] == '\0');
+                for(khint_t ki(0); ok && ki != kh_end(ret); ++ki)
+                    if(kh_exist(ret, ki)) ok = offsets[ki] < nbytes;
+                if(ok) {
+                    for(khint_t ki(0); ki != kh_end(ret); ++ki)
+                        if(kh_exist(ret, ki)) kh_key(ret, ki) = arena.get() + offsets[ki];
+                    add_name_arena(ret, std::move(arena));
+                }
+            }
+        }
+        std::fclose(fp);
+        if(ok) {
+            LOG_DEBUG("Loaded name hash of size %zu from cache for %s\n", size_t(kh_size(ret)), fn);
+            return ret;
+        }
+        LOG_WARNING("Taxonomy cache for %s is corrupt. Reparsing.\n", fn);
+        std::free(ret->keys); ret->keys = nullptr; // Names are in no arena yet.
+        kh_destroy(name, ret);
+        ret = kh_init(name);
+    }
+    const std::vector<size_t> chunks(line_chunks(f.data(), f.size(), nthreads * 4));
+    const size_t njobs(chunks.size() - 1);
+    std::vector<std::unique_ptr<char[]>> arenas(njobs);
+    std::vector<std::vector<std::pair<const char *, tax_t>>> entries(njobs);
+    name_parse_helper helper{f.data(), chunks, arenas, entries};
+    kt_for(nthreads, &name_parse_fn, &helper, njobs);
+    size_t total(0);
+    for(const auto &e: entries) total += e.size();
+    kh_resize(name, ret, total);
     int khr;
     khint_t ki;
-    while((len = getline(&buf, &bufsz, fp)) >= 0) {
-        switch(*buf) case '\0': case '\n': case '#': continue;
-        p = ::bns::strchrnul(buf, '\t');
-        ki = kh_put(name, ret, buf, &khr);
-        if(khr == 0) { // Key already present.
-            LOG_INFO("Key %s already present. Updating value from "
-                     "%i to %s.\tNote: if you have performed TaxonomyReformation, this is an error.\n", kh_key(ret, ki), kh_val(ret, ki), p + 1);
-        } else {
-            namelen = p - buf;
-            char *tmp = static_cast<char *>(std::malloc(namelen + 1));
-            std::memcpy(tmp, buf, namelen);
-            tmp[namelen] = '\0';
-            kh_key(ret, ki) = tmp;
+    for(const auto &chunk: entries) { // In file order, so later lines take precedence.
+        for(const auto &entry: chunk) {
+            ki = kh_put(name, ret, entry.first, &khr);
+            if(khr == 0) // Key already present.
+                LOG_INFO("Key %s already present. Updating value from "
+                         "%i to %u.\tNote: if you have performed TaxonomyReformation, this is an error.\n", kh_key(ret, ki), kh_val(ret, ki), entry.second);
+            kh_val(ret, ki) = entry.second;
         }
-        kh_val(ret, ki) = std::atoi(p + 1);
     }
-    std::fclose(fp);
-    std::free(buf);
+    for(auto &arena: arenas) add_name_arena(ret, std::move(arena));
+    write_tax_cache(fn, header, [ret](std::FILE *fp) {
+        // Names are written as offsets into one concatenated block.
+        std::vector<u64> offsets(kh_end(ret));
+        std::string names;
+        for(khint_t ki(0); ki != kh_end(ret); ++ki) {
+            if(!kh_exist(ret, ki)) continue;
+            offsets[ki] = names.size();
+            names.append(kh_key(ret, ki), std::strlen(kh_key(ret, ki)) + 1);
+        }
+        const u64 nbytes(names.size());
+        return std::fwrite(&ret->n_buckets, sizeof(ret->n_buckets), 1, fp) == 1 &&
+               std::fwrite(&ret->n_occupied, sizeof(ret->n_occupied), 1, fp) == 1 &&
+               std::fwrite(&ret->size, sizeof(ret->size), 1, fp) == 1 &&
+               std::fwrite(&ret->upper_bound, sizeof(ret->upper_bound), 1, fp) == 1 &&
+               std::fwrite(ret->flags, sizeof(*ret->flags), __ac_fsize(ret->n_buckets), fp) == __ac_fsize(ret->n_buckets) &&
+               std::fwrite(ret->vals, sizeof(*ret->vals), ret->n_buckets, fp) == ret->n_buckets &&
+               std::fwrite(offsets.data(), sizeof(u64), offsets.size(), fp) == offsets.size() &&
+               std::fwrite(&nbytes, sizeof(nbytes), 1, fp) == 1 &&
+               std::fwrite(names.data(), 1, nbytes, fp) == nbytes;
+    });
     return ret;
 }
 
+// Drops the taxids get_taxids remembered for a name hash. Call this after changing its values.
+inline void forget_taxids(const khash_t(name) *hash) {
+    auto &cache(detail::get_taxid_cache());
+    LockSmith<std::mutex> lock(cache.m_);
+    cache.map_.erase(hash);
+}
+
 static void destroy_name_hash(khash_t(name) *hash) noexcept {
     if(hash == nullptr) return;
+    forget_taxids(hash);
+    auto &arenas(detail::get_name_arenas());
+    {
+        LockSmith<std::mutex> lock(arenas.m_);
+        auto it(arenas.map_.find(hash));
+        if(it != arenas.map_.end()) {
+            // Names are in arenas.
+            arenas.map_.erase(it);
+            kh_destroy(name, hash);
+            return;
+        }
+    }
     for(khint_t ki(kh_begin(hash)); ki != kh_end(hash); ++ki)
         if(kh_exist(hash, ki))
             std::free((void *)kh_key(hash, ki));
@@ -781,24 +1173,51 @@ static tax_t lca(const std::map<tax_t, tax_t> &parent_map, tax_t a, tax_t b)
   return 1;
 }
 
+// Builds a taxid -> parent map from nodes.dmp, in parallel from an mmap of the file,
+// or loads it from a binary cache of a previous parse.
 static khash_t(p) *build_parent_map(const char *fn) {
-    std::ifstream is(fn);
-    khash_t(p) *ret(kh_init(p));
+    using namespace detail;
+    const int nthreads(parse_threads());
+    MMapFile f(fn);
+    const cache_header header{PARENT_CACHE_MAGIC, f.size(), file_checksum(f, nthreads)};
+    khash_t(p) *ret(nullptr);
+    if(std::FILE *fp = open_tax_cache(fn, header)) {
+        ret = kh_init(p);
+        const bool ok(read_tax_cache_counts(fp, ret) &&
+                      std::fread(ret->flags, sizeof(*ret->flags), __ac_fsize(ret->n_buckets), fp) == __ac_fsize(ret->n_buckets) &&
+                      std::fread(ret->keys, sizeof(*ret->keys), ret->n_buckets, fp) == ret->n_buckets &&
+                      std::fread(ret->vals, sizeof(*ret->vals), ret->n_buckets, fp) == ret->n_buckets &&
+                      tax_cache_remaining(fp) == 0);
+        std::fclose(fp);
+        if(ok && kh_size(ret) >= 2) {
+            LOG_DEBUG("Loaded parent map of size %zu from cache for %s\n", size_t(kh_size(ret)), fn);
+            return ret;
+        }
+        LOG_WARNING("Taxonomy cache for %s is corrupt. Reparsing.\n", fn);
+        kh_destroy(p, ret);
+    }
+    ret = kh_init(p);
+    const std::vector<size_t> chunks(line_chunks(f.data(), f.size(), nthreads * 4));
+    const size_t njobs(chunks.size() - 1);
+    std::vector<std::vector<std::pair<tax_t, tax_t>>> entries(njobs);
+    parent_parse_helper helper{f.data(), chunks, entries};
+    kt_for(nthreads, &parent_parse_fn, &helper, njobs);
+    size_t total(0);
+    for(const auto &e: entries) total += e.size();
+    kh_resize(p, ret, total + 1);
     khint_t ki;
     int khr;
-    std::string line;
-    char *p;
-    while(std::getline(is, line)) {
-        switch(line[0]) case '\n': case '\0': case '#': continue;
-        ki = kh_put(p, ret, std::atoi(line.data()), &khr);
-        kh_val(ret, ki) = (p = std::strchr(line.data(), '|')) ? std::atoi(p + 2)
-                                                              : tax_t(-1);
-        if(kh_val(ret, ki) == tax_t(-1)) LOG_WARNING("Malformed line: %s", line.data());
+    for(const auto &chunk: entries) {
+        for(const auto &entry: chunk) {
+            ki = kh_put(p, ret, entry.first, &khr);
+            kh_val(ret, ki) = entry.second;
+        }
     }
     ki = kh_put(p, ret, 1, &khr);
     kh_val(ret, ki) = 0; // Root of the tree.
     if(kh_size(ret) < 2) RUNTIME_ERROR(std::string("Failed to create taxmap from ") + fn);
     LOG_DEBUG("Built parent map of size %zu from path %s\n", kh_size(ret), fn);
+    write_tax_cache(fn, header, [ret](std::FILE *fp) {return khash_write_impl(ret, fp) > 0;});
     return ret;
 }
 
@@ -946,6 +1365,57 @@ static tax_t get_taxid(const char *fn, const khash_t(name) *name_hash) {
     return ret;
 }
 
+namespace detail {
+struct taxid_helper {
+    const std::vector<std::string> &paths_;
+    const khash_t(name)        *name_hash_;
+    const std::vector<size_t>       &todo_;
+    std::vector<tax_t>            &taxids_;
+    std::exception_ptr           &error_;
+    std::mutex                       &m_;
+};
+static void taxid_fn(void *data_, long index, int tid) {
+    auto &h(*(taxid_helper *)data_);
+    const size_t i(h.todo_[index]);
+    try {
+        h.taxids_[i] = get_taxid(h.paths_[i].data(), h.name_hash_);
+    } catch(...) {
+        LockSmith<std::mutex> lock(h.m_);
+        if(!h.error_) h.error_ = std::current_exception();
+    }
+}
+} // namespace detail
+
+// As get_taxid for every path, reading headers in parallel.
+// Results are remembered for the name hash, so later calls for the same paths don't reopen them.
+static std::vector<tax_t> get_taxids(const std::vector<std::string> &paths, const khash_t(name) *name_hash, int num_threads=-1) {
+    using namespace detail;
+    if(num_threads <= 0) num_threads = parse_threads();
+    std::vector<tax_t> ret(paths.size());
+    std::vector<size_t> todo;
+    auto &cache(get_taxid_cache());
+    {
+        LockSmith<std::mutex> lock(cache.m_);
+        const auto &known(cache.map_[name_hash]);
+        for(size_t i(0); i < paths.size(); ++i) {
+            auto it(known.find(paths[i]));
+            if(it == known.end()) todo.push_back(i);
+            else                  ret[i] = it->second;
+        }
+    }
+    if(todo.empty()) return ret;
+    std::exception_ptr error;
+    std::mutex m;
+    taxid_helper helper{paths, name_hash, todo, ret, error, m};
+    kt_for(num_threads, &taxid_fn, &helper, todo.size());
+    if(error) std::rethrow_exception(error);
+    LOG_DEBUG("Resolved taxids for %zu of %zu paths (the rest were cached).\n", todo.size(), paths.size());
+    LockSmith<std::mutex> lock(cache.m_);
+    auto &known(cache.map_[name_hash]);
+    for(const size_t i: todo) known.emplace(paths[i], ret[i]);
+    return ret;
+}
+
 static std::map<uint32_t, uint32_t> kh2kr(khash_t(p) *map) {
     std::map<uint32_t, uint32_t> ret;
     if(map)
@@ -956,7 +1426,7 @@ static std::map<uint32_t, uint32_t> kh2kr(khash_t(p) *map) {
 }
 
 
-static std::unordered_map<tax_t, std::forward_list<std::string>> tax2genome_map(khash_t(name) *name_map, const std::vector<std::string> &paths) {
+static std::unordered_map<tax_t, std::forward_list<std::string>> tax2genome_map(khash_t(name) *name_map, const std::vector<std::string> &paths, int num_threads=-1) {
     tax_t taxid;
     std::unordered_map<tax_t, std::forward_list<std::string>> ret;
     typename std::unordered_map<tax_t, std::forward_list<std::string>>::iterator m;
@@ -964,8 +1434,10 @@ static std::unordered_map<tax_t, std::forward_list<std::string>> tax2genome_map(
 #if !NDEBUG
     ks::string ks;
 #endif
-    for(const auto &path: paths) {
-        if((taxid = get_taxid(path.data(), name_map)) == UINT32_C(-1)) continue;
+    const std::vector<tax_t> taxids(get_taxids(paths, name_map, num_threads));
+    for(size_t i(0); i < paths.size(); ++i) {
+        const std::string &path(paths[i]);
+        if((taxid = taxids[i]) == UINT32_C(-1)) continue;
         if((m = ret.find(taxid)) == ret.end()) m = ret.emplace(taxid, std::forward_list<std::string>{path}).first;
         else if(std::find(m->second.begin(), m->second.end(), path) == m->second.end()) m->second.push_front(path);
 #if !NDEBUG
@@ -1083,6 +1555,8 @@ static inline const char *bool2str(bool val) {
 
 _KHD(all)
 _KHD(c)
+_KHD(all128)
+_KHD(c128)
 _KHD(64)
 _KHD(p)
 
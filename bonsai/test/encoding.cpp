@@ -3,6 +3,9 @@
 #include "encoder.h"
 #include <algorithm>
 #include <numeric>
+#include <random>
+#include <set>
+#include <unordered_set>
 
 using namespace bns;
 using EncType = Encoder<score::Lex>;
@@ -175,3 +178,248 @@ TEST_CASE("entmin") {
     }
     LOG_INFO("kmers2 size: %zu\n", kmers2.size());
 }
+TEST_CASE("rolling") {
+    gzFile fp(gzopen("test/phix.fa", "rb"));
+    kseq_t *ks(kseq_init(fp));
+    kseq_read(ks);
+    std::string seq(ks->seq.s, ks->seq.l), rc(seq.rbegin(), seq.rend());
+    for(auto &c: rc) c = nuc_cmpl(c);
+    kseq_destroy(ks);
+    gzclose(fp);
+    SECTION("matches hashing each kmer from scratch") {
+        for(const unsigned k: {13u, 31u, 64u, 100u}) {
+            RollingHasher rh(k);
+            size_t i(0);
+            rh.for_each_hash([&](u64 hash) {
+                u64 direct(0);
+                rh.for_each_hash([&](u64 h) {direct = h;}, seq.data() + i++, k);
+                REQUIRE(hash == direct);
+            }, seq.data(), seq.size());
+            REQUIRE(i == seq.size() - k + 1);
+        }
+    }
+    SECTION("canonical hashes are strand-independent") {
+        for(const unsigned k: {21u, 31u, 50u}) {
+            RollingHasher rh(k);
+            std::unordered_set<u64> fw, rv;
+            rh.for_each_hash([&](u64 hash) {fw.insert(hash);}, seq.data(), seq.size());
+            rh.for_each_hash([&](u64 hash) {rv.insert(hash);}, rc.data(), rc.size());
+            REQUIRE(fw == rv);
+        }
+    }
+    SECTION("kmers and multiple seeds") {
+        std::string s(seq);
+        s[100] = 'N';
+        RollingHasher rh(31);
+        std::vector<u64> kmers, hashes, expected, rolled;
+        rh.for_each_kmer_hash([&](u64 kmer, u64 hash) {kmers.push_back(kmer); hashes.push_back(hash);}, s.data(), s.size());
+        Encoder<score::Lex> enc(31);
+        enc.assign(&s[0], s.size());
+        enc.for_each_uncanon_unspaced_unwindowed([&](u64 kmer) {expected.push_back(canonical_representation(kmer, 31));});
+        enc.for_each([&](u64 kmer) {rolled.push_back(kmer);}, s.data(), s.size());
+        REQUIRE(kmers.size() == s.size() - 30 - 31);
+        REQUIRE(kmers == expected);
+        REQUIRE(rolled == expected);
+        size_t i(0);
+        rh.for_each_hash_n([&](const u64 *h) {
+            REQUIRE(h[0] == hashes[i++]);
+            REQUIRE(h[1] != h[0]);
+        }, s.data(), s.size(), 3);
+    }
+}
+// Encodes each kmer from scratch with next_kmer, the original unpacked path. Windows never pick k-mers with Ns in them.
+static std::vector<u64> reference_kmers(std::string seq, const Spacer &sp, bool canon) {
+    std::vector<u64> ret;
+    EncType enc(&seq[0], seq.size(), sp, nullptr, canon);
+    qmap_t qmap(sp.w_ - sp.c_ + 1);
+    while(enc.has_next_kmer()) {
+        u64 km(enc.next_kmer());
+        if(km != BF && canon) km = canonical_representation(km, sp.k_);
+        if(sp.w_ > sp.c_) km = qmap.next_value(km, km == BF ? BF: lex_score(km, nullptr));
+        if(km != BF) ret.push_back(km);
+    }
+    return ret;
+}
+TEST_CASE("packed spaced encoding matches encoding each kmer") {
+    gzFile fp(gzopen("test/phix.fa", "rb"));
+    kseq_t *ks(kseq_init(fp));
+    kseq_read(ks);
+    std::string seq(ks->seq.s, ks->seq.l);
+    kseq_destroy(ks);
+    gzclose(fp);
+    seq[1000] = 'N';
+    spvec_t v{1, 2, 18};
+    while(v.size() < 30) v.push_back(0);
+    spvec_t v2(30, 0);
+    v2[3] = 1; // Comb of 32, which fits in a single word.
+    for(const spvec_t &spaces: {v, v2, spvec_t(30, 0)}) {
+        for(const unsigned w: {0u, 60u}) {
+            Spacer sp(31, w, spaces);
+            for(const bool canon: {false, true}) {
+                std::vector<u64> packed;
+                const std::vector<u64> expected(reference_kmers(seq, sp, canon));
+                EncType enc(&seq[0], seq.size(), sp, nullptr, canon);
+                if(canon) enc.for_each_canon_windowed([&](u64 km) {packed.push_back(km);});
+                else      enc.for_each_uncanon_spaced([&](u64 km) {packed.push_back(km);});
+                REQUIRE(packed.size() > 0);
+                REQUIRE(packed == expected);
+            }
+        }
+    }
+}
+TEST_CASE("fixed encoders match the generic encoder") {
+    gzFile fp(gzopen("test/phix.fa", "rb"));
+    kseq_t *ks(kseq_init(fp));
+    kseq_read(ks);
+    std::string seq(ks->seq.s, ks->seq.l);
+    kseq_destroy(ks);
+    gzclose(fp);
+    seq[1000] = 'N';
+    spvec_t v2(30, 0);
+    v2[3] = 1;
+    for(const Spacer &sp: {Spacer(31, 31), Spacer(31, 50), Spacer(21, 21), Spacer(31, 32, v2), Spacer(31, 50, v2)}) {
+        REQUIRE(fixed_encoder(sp) != FIXED_NONE);
+        for(const bool canon: {false, true}) {
+            std::vector<u64> fixed, generic;
+            EncType enc(sp, canon);
+            REQUIRE(enc.fixed() == fixed_encoder(sp));
+            enc.for_each([&](u64 km) {fixed.push_back(km);}, seq.data(), seq.size());
+            enc.assign(&seq[0], seq.size());
+            if(canon) enc.for_each_packed<true>([&](u64 km) {generic.push_back(km);});
+            else      enc.for_each_packed<false>([&](u64 km) {generic.push_back(km);});
+            REQUIRE(fixed.size() > 0);
+            REQUIRE(fixed == generic);
+            REQUIRE(fixed == reference_kmers(seq, sp, canon));
+        }
+    }
+    REQUIRE(fixed_encoder(Spacer(25, 25)) == FIXED_NONE);
+}
+TEST_CASE("wide encoder") {
+    gzFile fp(gzopen("test/phix.fa", "rb"));
+    kseq_t *ks(kseq_init(fp));
+    kseq_read(ks);
+    std::string seq(ks->seq.s, ks->seq.l);
+    kseq_destroy(ks);
+    gzclose(fp);
+    seq[1000] = 'N';
+    std::string rcseq(seq.rbegin(), seq.rend());
+    for(auto &c: rcseq) {
+        switch(c) {
+            case 'A': c = 'T'; break; case 'C': c = 'G'; break;
+            case 'G': c = 'C'; break; case 'T': c = 'A'; break;
+        }
+    }
+    std::mt19937_64 mt(13);
+    for(unsigned n: {5u, 31u, 32u}) {
+        const u64 km(mt() & (UINT64_C(-1) >> (64 - 2 * n)));
+        REQUIRE(reverse_complement(u128(km), n) == u128(reverse_complement(km, n)));
+    }
+    for(unsigned n: {33u, 45u, 64u}) {
+        const u128 km(((u128(mt()) << 64) | mt()) & (~u128(0) >> (128 - 2 * n)));
+        REQUIRE(reverse_complement(reverse_complement(km, n), n) == km);
+    }
+    spvec_t v{1, 2, 18};
+    while(v.size() < 30) v.push_back(0);
+    for(const spvec_t &spaces: {v, spvec_t(30, 0)}) {
+        Spacer sp(31, 31, spaces);
+        for(const bool canon: {false, true}) {
+            std::vector<u64> narrow, wide;
+            EncType enc(sp, canon);
+            enc.for_each([&](u64 km) {narrow.push_back(km);}, seq.data(), seq.size());
+            WideEncoder<score::Lex> wenc(sp, canon);
+            wenc.for_each([&](u128 km) {wide.push_back(u64(km)); REQUIRE((km >> 64) == 0);}, seq.data(), seq.size());
+            REQUIRE(wide.size() > 0);
+            REQUIRE(wide == narrow);
+        }
+    }
+    for(const unsigned w: {45u, 60u}) {
+        Spacer sp(45, w);
+        WideEncoder<score::Lex> wenc(sp, true);
+        std::set<u128> fwd, rev;
+        wenc.for_each([&](u128 km) {fwd.insert(km);}, seq.data(), seq.size());
+        wenc.for_each([&](u128 km) {rev.insert(km);}, rcseq.data(), rcseq.size());
+        REQUIRE(fwd.size() > 0);
+        REQUIRE(fwd == rev);
+        REQUIRE(std::none_of(fwd.begin(), fwd.end(), [](u128 km) {return (km >> 90) != 0;}));
+    }
+}
+TEST_CASE("entropy table") {
+    gzFile fp(gzopen("test/phix.fa", "rb"));
+    kseq_t *ks(kseq_init(fp));
+    kseq_read(ks);
+    std::string seq(ks->seq.s, ks->seq.l);
+    kseq_destroy(ks);
+    gzclose(fp);
+    seq[1000] = 'N';
+    EntropyTable table(31);
+    REQUIRE(table.kmer_score(0) == UINT64_C(-1));                    // All A: no entropy.
+    REQUIRE(table.kmer_score(UINT64_C(0x1B1B1B1B1B1B1B1B) >> 2) < table.kmer_score(UINT64_C(0x5555555555555555) >> 2));
+    std::mt19937_64 mt(7);
+    for(size_t i(0); i < 1000; ++i) {
+        const u64 km(mt() >> 2);
+        unsigned counts[4]{0};
+        for(unsigned j(0); j < 31; ++j) ++counts[(km >> (2 * j)) & 3];
+        REQUIRE(table.kmer_score(km) == UINT64_C(-1) - static_cast<u64>(EntropyTable::SCALE * EntropyTable::entropy(counts[0], counts[1], counts[2], counts[3], 31)));
+    }
+    for(const bool canon: {false, true}) {
+        Encoder<score::Entropy> enc(Spacer(31, 60), canon);
+        std::vector<u64> rolled, expected;
+        enc.for_each([&](u64 km) {rolled.push_back(km);}, seq.data(), seq.size());
+        enc.assign(&seq[0], seq.size());
+        qmap_t qmap(60 - 31 + 1);
+        while(enc.has_next_kmer()) {
+            const u64 km(enc.next_kmer());
+            u64 min;
+            if(km != BF && (min = qmap.next_value(km, table.kmer_score(km))) != BF)
+                expected.push_back(canon ? canonical_representation(min, 31): min);
+        }
+        REQUIRE(rolled.size() > 0);
+        REQUIRE(rolled == expected);
+    }
+}
+TEST_CASE("score index") {
+    gzFile fp(gzopen("test/phix.fa", "rb"));
+    kseq_t *ks(kseq_init(fp));
+    kseq_read(ks);
+    std::string seq(ks->seq.s, ks->seq.l);
+    kseq_destroy(ks);
+    gzclose(fp);
+    Spacer sp(31, 50);
+    khash_t(64) *map(kh_init(64));
+    int khr;
+    {
+        EncType enc(Spacer(31), false);
+        enc.for_each([&](u64 km) {
+            const khiter_t ki(kh_put(64, map, km, &khr));
+            kh_val(map, ki) = lex_score(km, nullptr);
+        }, seq.data(), seq.size());
+    }
+    ScoreIndex index(map, 2, 1337);
+    REQUIRE(index.size() == kh_size(map));
+    for(khiter_t ki(0); ki != kh_end(map); ++ki)
+        if(kh_exist(map, ki))
+            REQUIRE(index.score(kh_key(map, ki)) == kh_val(map, ki));
+    REQUIRE(index.find(BF) == nullptr);
+    u64 missing(1);
+    while(kh_get(64, map, missing) != kh_end(map)) ++missing;
+    REQUIRE(index.score(missing) == 1337);
+    // Scoring by the index with lexicographic scores selects the same minimizers as lexicographic scoring.
+    std::vector<u64> lex, hashed;
+    EncType(sp, false).for_each([&](u64 km) {lex.push_back(km);}, seq.data(), seq.size());
+    Encoder<score::Hash>(sp, (void *)&index, false).for_each([&](u64 km) {hashed.push_back(km);}, seq.data(), seq.size());
+    REQUIRE(lex.size() > 0);
+    REQUIRE(hashed == lex);
+    kh_destroy(64, map);
+}
+TEST_CASE("partitioned cardinality matches a serial count") {
+    const std::vector<std::string> paths{"test/phix.fa", "test/GCF_000302455.1_ASM30245v1_genomic.fna.gz", "test/small_genome.fa"};
+    const spvec_t sv(30, 0);
+    const Spacer sp(31, 31, sv);
+    std::unordered_set<u64> expected;
+    EncType enc(sp, true);
+    for(const auto &path: paths) enc.for_each([&](u64 km) {expected.insert(km);}, path.data());
+    REQUIRE(expected.size() > 1000);
+    for(const unsigned npasses: {1u, 3u})
+        for(const int nthreads: {1, 4})
+            REQUIRE(count_cardinality<score::Lex>(paths, 31, 31, sv, true, nullptr, nthreads, npasses) == expected.size());
+}
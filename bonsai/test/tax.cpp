@@ -1,7 +1,7 @@
 #include "test/catch.hpp"
 
 #include "tx.h"
-#include "bitmap.h"
+#include "flextree.h"
 using namespace bns;
 
 TEST_CASE("tax") {
@@ -50,3 +50,177 @@ TEST_CASE("bitstrings") {
     counter.add(v2);
     counter.print_vec();
 }
+
+TEST_CASE("sharded presence bits match a serial build") {
+    std::vector<std::string> paths;
+    for(const char *path: {"test/GCF_000302455.1_ASM30245v1_genomic.fna.gz", "test/GCF_000762265.1_ASM76226v1_genomic.fna.gz", "test/phix.fa"})
+        paths.emplace_back(path);
+    Spacer sp(11, 11, nullptr);
+    kgset_t set(paths, sp);
+    std::unordered_map<u64, bitvec_t> expected;
+    for(size_t i(0); i < set.size(); ++i) {
+        const khash_t(all) *h(&set.core()[i]);
+        for(khiter_t ki(0); ki != kh_end(h); ++ki) {
+            if(!kh_exist(h, ki)) continue;
+            auto m(expected.find(kh_key(h, ki)));
+            if(m == expected.end()) m = expected.emplace(kh_key(h, ki), bitvec_t(1)).first;
+            m->second[0] |= UINT64_C(1) << i;
+        }
+    }
+    std::unordered_map<bitvec_t, u64> expected_counts;
+    size_t nkept(0);
+    for(const auto &pair: expected) {
+        const auto bitsum(pop::popcount(pair.second[0]));
+        if(bitsum != 1 && bitsum != set.size()) ++expected_counts[pair.second], ++nkept;
+    }
+    REQUIRE(nkept);
+    for(const size_t shard_kmers: {set.weight() / 7, SHARD_KMERS}) {
+        bitmap_t bitmap(set, 4, shard_kmers);
+        REQUIRE(bitmap.cget_map().size() == nkept);
+        REQUIRE(bitmap.patterns().size() == expected_counts.size());
+        for(const auto &pair: bitmap.cget_map()) REQUIRE(bitmap.patterns().vec(pair.second) == expected.at(pair.first));
+        for(u32 id(0); id < bitmap.patterns().size(); ++id)
+            REQUIRE(bitmap.patterns().count(id) == expected_counts.at(bitmap.patterns().vec(id)));
+        // From a kept set, and from a temporary one freed as it is scattered.
+        for(const bool consume: {false, true}) {
+            const PatternSet counts(consume ? pattern_counts(kgset_t(paths, sp), 4, shard_kmers): pattern_counts(set, 4, shard_kmers));
+            REQUIRE(counts.size() == expected_counts.size());
+            for(const auto &pair: expected_counts) {
+                const u32 id(counts.find(pair.first));
+                REQUIRE(id != PatternSet::NONE);
+                REQUIRE(counts.count(id) == pair.second);
+            }
+        }
+    }
+    // Shards split kmers evenly.
+    const unsigned nshards(kmer_shards(set, 4, set.weight() / 7));
+    std::vector<size_t> sizes(nshards);
+    for(const auto &pair: expected) ++sizes[kmer_shard(pair.first, nshards)];
+    for(const size_t size: sizes) REQUIRE(size * nshards > expected.size() * 9 / 10);
+}
+
+TEST_CASE("subset index matches pairwise comparison") {
+    std::mt19937_64 mt(1337);
+    for(const unsigned nbits: {13u, 70u}) {
+        count::Counter<bitvec_t> counts;
+        const unsigned words((nbits + 63) >> 6);
+        std::vector<bitvec_t> made;
+        while(counts.size() < 600) {
+            // Half of the patterns extend an earlier one, so that many are subsets of others.
+            bitvec_t v(made.size() && mt() & 1 ? made[mt() % made.size()]: bitvec_t(words));
+            for(unsigned i(0); i < nbits; ++i) if(mt() % 8 == 0) v[i >> 6] |= UINT64_C(1) << (i & 63);
+            counts.add(v);
+            made.push_back(std::move(v));
+        }
+        std::vector<const bitvec_t *> elems;
+        std::vector<const u64 *> patterns;
+        for(const auto &pair: counts) elems.push_back(&pair.first), patterns.push_back(pair.first.data());
+        const auto supersets(strict_supersets(patterns, words, 4));
+        const SubsetIndex index(patterns, words);
+        const adjmap_t forward(counts), reverse(counts, true);
+        size_t npairs(0);
+        for(size_t i(0); i < elems.size(); ++i) {
+            std::set<u32> expected;
+            for(size_t j(0); j < elems.size(); ++j)
+                if(veccmp(*elems[j], *elems[i]) == BitCmp::FIRST_PARENT) expected.insert(j);
+            REQUIRE(std::set<u32>(supersets[i].begin(), supersets[i].end()) == expected);
+            std::set<u32> subsets, expected_subsets;
+            for(size_t j(0); j < elems.size(); ++j)
+                if(veccmp(*elems[i], *elems[j]) == BitCmp::FIRST_PARENT) expected_subsets.insert(j);
+            index.for_each_subset(patterns[i], [&](u32 j) {REQUIRE(subsets.insert(j).second);});
+            REQUIRE(subsets == expected_subsets);
+            if(forward.find(elems[i]) != forward.end()) {
+                // Score from separate popcounts, against the fused kernel in score_node_addn.
+                u64 score(counts.find(*elems[i])->second * (nbits - pop::vec_popcnt(*elems[i])));
+                for(const u32 j: expected_subsets) score += counts.find(*elems[j])->second * pop::vec_popcnt(*elems[j]);
+                REQUIRE(score_node_addn(*elems[i], forward, counts, nbits) == score);
+            }
+            npairs += expected.size();
+            const auto m(reverse.find(elems[i]));
+            REQUIRE((m == reverse.end() ? 0: m->second.size()) == expected.size());
+            for(const u32 j: expected) {
+                const auto f(forward.find(elems[j]));
+                REQUIRE(f != forward.end());
+                REQUIRE(std::find(f->second.begin(), f->second.end(), elems[i]) != f->second.end());
+            }
+        }
+        REQUIRE(npairs);
+    }
+}
+
+TEST_CASE("bit pattern kernels agree") {
+    std::mt19937_64 mt(7);
+    for(const BitKernel kernel: {SCALAR_KERNEL, AVX2_KERNEL, AVX512_KERNEL}) {
+        const bool cmp_ok(veccmp_kernel_supported(kernel)), pop_ok(popcnt_kernel_supported(kernel));
+        if(!cmp_ok && !pop_ok) continue;
+        for(size_t nwords(1); nwords < 21; ++nwords) {
+            for(unsigned trial(0); trial < 50; ++trial) {
+                bitvec_t a(nwords), b(nwords);
+                for(auto &w: a) w = mt() & mt();
+                // Make b a subset, superset, copy or unrelated pattern of a.
+                switch(trial & 3) {
+                    case 0: for(size_t i(0); i < nwords; ++i) b[i] = a[i] & mt(); break;
+                    case 1: for(size_t i(0); i < nwords; ++i) b[i] = a[i] | (mt() & mt() & mt()); break;
+                    case 2: b = a; break;
+                    case 3: for(auto &w: b) w = mt(); break;
+                }
+                unsigned popa(0), popb(0), diff(0);
+                bool asup(true), bsup(true);
+                for(size_t i(0); i < nwords; ++i) {
+                    popa += pop::popcount(a[i]), popb += pop::popcount(b[i]), diff += pop::popcount(a[i] ^ b[i]);
+                    asup &= !(b[i] & ~a[i]), bsup &= !(a[i] & ~b[i]);
+                }
+                const int cmp(asup ? bsup ? BitCmp::EQUAL: BitCmp::FIRST_PARENT: bsup ? BitCmp::SECOND_PARENT: BitCmp::INCOMPARABLE);
+                if(cmp_ok) REQUIRE(veccmp_words(a.data(), b.data(), nwords, kernel) == cmp);
+                if(!pop_ok) continue;
+                const BitStats stats(bitstats(a.data(), b.data(), nwords, kernel));
+                REQUIRE(stats.cmp_ == cmp);
+                REQUIRE(stats.popa_ == popa);
+                REQUIRE(stats.popb_ == popb);
+                REQUIRE(stats.diff_ == diff);
+                REQUIRE(popcnt_words(a.data(), nwords, kernel) == popa);
+            }
+        }
+    }
+}
+
+TEST_CASE("collapse adds nodes best first") {
+    const char *paths[] {"test/GCF_000302455.1_ASM30245v1_genomic.fna.gz", "test/GCF_000762265.1_ASM76226v1_genomic.fna.gz",
+                         "test/GCF_000953115.1_DSM1535_genomic.fna.gz", "test/GCF_001723155.1_ASM172315v1_genomic.fna.gz", "test/phix.fa"};
+    khash_t(p) *tax(kh_init(p));
+    int khr;
+    khiter_t ki(kh_put(p, tax, 100, &khr));
+    kh_val(tax, ki) = 0;
+    std::unordered_map<tax_t, std::forward_list<std::string>> tpm;
+    std::vector<tax_t> taxes;
+    for(tax_t i(1); i <= 5; ++i) {
+        ki = kh_put(p, tax, i, &khr);
+        kh_val(tax, ki) = 100;
+        tpm[i].push_front(paths[i - 1]);
+        taxes.push_back(i);
+    }
+    static constexpr unsigned NTOADD = 12;
+    FMEmitter emitter(tax, tpm, true, 1 << 8, kh_size(tax) + NTOADD);
+    emitter.process_subtree(100, taxes.begin(), taxes.end(), Spacer(11, 11, nullptr), 4);
+    std::FILE *fp(std::tmpfile());
+    emitter.run_collapse(1000, fp);
+    std::rewind(fp);
+    char buf[1 << 12];
+    REQUIRE(std::fgets(buf, sizeof(buf), fp));
+    std::set<std::string> children;
+    u64 last_score(UINT64_C(-1));
+    tax_t expected_taxid(1000);
+    while(std::fgets(buf, sizeof(buf), fp)) {
+        char *p;
+        REQUIRE(std::strtoul(buf, &p, 10) == ++expected_taxid);
+        const u64 score(std::strtoull(p + 1, &p, 10));
+        // Scores only ever drop as nodes are added, so nodes must come out best first.
+        REQUIRE(score <= last_score);
+        last_score = score;
+        REQUIRE(std::strtoul(p + 1, &p, 10) == 100);
+        REQUIRE(children.insert(p + 1).second);
+    }
+    REQUIRE(children.size() == NTOADD);
+    std::fclose(fp);
+    kh_destroy(p, tax);
+}
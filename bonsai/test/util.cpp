@@ -1,5 +1,8 @@
 #include "test/catch.hpp"
 #include "util.h"
+#include "mphf.h"
+#include "taxonomy.h"
+#include "feature_min.h"
 using namespace bns;
 
 #define is_pow2(x) ((x & (x - 1)) == 0)
@@ -36,3 +39,447 @@ TEST_CASE("roundup64") {
         REQUIRE(__builtin_clzll(d) - 1 == __builtin_clzll(roundup64(d)));
     }
 }
+
+TEST_CASE("parallel growth keeps every key and value") {
+    khash_t(64) *h(kh_init(64));
+    khash_t(all) *set(kh_init(all));
+    std::mt19937_64 mt(13);
+    std::unordered_map<u64, u64> expected;
+    int khr;
+    khiter_t ki;
+    // Delete some keys so that growth also has to skip tombstones.
+    while(expected.size() < 300000) {
+        const u64 key(mt()), val(mt());
+        ki = kh_put(64, h, key, &khr);
+        kh_val(h, ki) = val;
+        expected[key] = val;
+        kh_put(all, set, key, &khr);
+        if((key & 7) == 0) {
+            kh_del(64, h, kh_get(64, h, key));
+            kh_del(all, set, kh_get(all, set, key));
+            expected.erase(key);
+        }
+    }
+    for(const int nthreads: {1, 4}) {
+        khash_parallel_grow(h, h->n_buckets << 1, nthreads);
+        khash_parallel_grow(set, set->n_buckets << 1, nthreads);
+        REQUIRE(kh_size(h) == expected.size());
+        REQUIRE(kh_size(set) == expected.size());
+        for(const auto &pair: expected) {
+            REQUIRE((ki = kh_get(64, h, pair.first)) != kh_end(h));
+            REQUIRE(kh_val(h, ki) == pair.second);
+            REQUIRE(kh_get(all, set, pair.first) != kh_end(set));
+        }
+    }
+    // The grown table still takes inserts as usual.
+    for(size_t i(0); i < 1000; ++i) {
+        const u64 key(mt());
+        khash_check_load(h, 2);
+        ki = kh_put(64, h, key, &khr);
+        kh_val(h, ki) = ~key;
+        expected[key] = ~key;
+    }
+    REQUIRE(kh_size(h) == expected.size());
+    for(const auto &pair: expected) REQUIRE(kh_val(h, kh_get(64, h, pair.first)) == pair.second);
+    kh_destroy(64, h);
+    kh_destroy(all, set);
+}
+
+TEST_CASE("minimal perfect hash database") {
+    std::mt19937_64 mt(1337);
+    khash_t(c) *map(kh_init(c));
+    int khr;
+    while(kh_size(map) < 200000) {
+        const u64 kmer(mt() >> 2);
+        const khiter_t ki(kh_put(c, map, kmer, &khr));
+        kh_val(map, ki) = static_cast<tax_t>(kmer % 100000) + 1;
+    }
+    std::vector<u64> keys;
+    for(khiter_t ki(0); ki != kh_end(map); ++ki) if(kh_exist(map, ki)) keys.push_back(kh_key(map, ki));
+    Mphf mphf(keys, 4);
+    REQUIRE(mphf.size() == keys.size());
+    std::vector<uint8_t> hit(keys.size());
+    for(const u64 key: keys) {
+        const u64 i(mphf.index(key));
+        REQUIRE(i < keys.size());
+        REQUIRE(!hit[i]);
+        hit[i] = 1;
+    }
+    Database<khash_t(c)> db(31, 31, spvec_t(30), 0, map);
+    Database<MphfMap> out(db, 1);
+    out.db_ = new MphfMap(map, 4);
+    REQUIRE(out.db_->size() == kh_size(map));
+    REQUIRE(out.db_->ntaxa() <= 100000);
+    // 17 bits of dense taxid, 16 of fingerprint, and the Mphf, plus the translation table.
+    REQUIRE(out.db_->bytes() - out.db_->ntaxa() * sizeof(tax_t) < kh_size(map) * 5);
+    out.write("__zomg_mphf__");
+    REQUIRE(database_is_mphf("__zomg_mphf__"));
+    Database<MphfMap> in("__zomg_mphf__");
+    std::remove("__zomg_mphf__");
+    REQUIRE(in.k_ == 31);
+    tax_t tax;
+    for(khiter_t ki(0); ki != kh_end(map); ++ki) {
+        if(!kh_exist(map, ki)) continue;
+        REQUIRE(in.db_->get(kh_key(map, ki), tax));
+        REQUIRE(tax == kh_val(map, ki));
+    }
+    // hist walks the compacted entries; it must see every kmer's taxid exactly once.
+    std::unordered_map<tax_t, size_t> expected, seen;
+    for(khiter_t ki(0); ki != kh_end(map); ++ki) if(kh_exist(map, ki)) ++expected[kh_val(map, ki)];
+    in.db_->for_each_taxon([&](tax_t t) {++seen[t];});
+    REQUIRE(seen == expected);
+    size_t false_positives(0), absent(0);
+    while(absent < 100000) {
+        const u64 kmer(mt() >> 2);
+        if(kh_get(c, map, kmer) != kh_end(map)) continue;
+        ++absent;
+        false_positives += in.db_->get(kmer, tax);
+    }
+    REQUIRE(false_positives < 20);
+    // A single taxon needs no bits for the taxid.
+    kh_clear(c, map);
+    for(u64 i(1); i <= 1000; ++i) {
+        const khiter_t ki(kh_put(c, map, i * 7919, &khr));
+        kh_val(map, ki) = 7;
+    }
+    MphfMap single(map, 2);
+    REQUIRE(single.ntaxa() == 1);
+    for(u64 i(1); i <= 1000; ++i) {
+        REQUIRE(single.get(i * 7919, tax));
+        REQUIRE(tax == 7);
+    }
+    kh_destroy(c, map);
+}
+
+TEST_CASE("taxonomy files parse in parallel and load from cache") {
+    {
+        std::FILE *fp(std::fopen("__zomg_nodes__", "w"));
+        std::fprintf(fp, "1\t|\t1\t|\tno rank\t|\n");
+        for(unsigned i(2); i < 20000; ++i) std::fprintf(fp, "%u\t|\t%u\t|\tspecies\t|\n", i, i / 2);
+        std::fclose(fp);
+        fp = std::fopen("__zomg_names__", "w");
+        std::fprintf(fp, "# comment\n");
+        for(unsigned i(0); i < 50000; ++i) std::fprintf(fp, "seq%u\t%u\n", i, i % 1000 + 2);
+        std::fprintf(fp, "seq7\t1\n"); // Later lines take precedence.
+        std::fclose(fp);
+    }
+    // Parse, load the caches, then load caches that were truncated and caches with garbage counts.
+    // Damaged caches must be reparsed, never trusted.
+    for(const int pass: {0, 1, 2, 3}) {
+        if(pass >= 2 && !std::getenv("BONSAI_NO_TAX_CACHE")) {
+            for(const char *path: {"__zomg_nodes__.bnscache", "__zomg_names__.bnscache"}) {
+                std::string contents;
+                {
+                    std::ifstream in(path, std::ios::binary);
+                    contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+                }
+                const size_t counts(sizeof(detail::cache_header));
+                REQUIRE(contents.size() > counts + 64);
+                if(pass == 2) contents.resize(contents.size() / 2);
+                else          std::memset(&contents[counts], 0x7f, sizeof(khint_t));
+                std::ofstream(path, std::ios::binary).write(contents.data(), contents.size());
+            }
+        }
+        khash_t(p) *taxmap(build_parent_map("__zomg_nodes__"));
+        REQUIRE(kh_size(taxmap) == 19999);
+        REQUIRE(kh_val(taxmap, kh_get(p, taxmap, 1)) == 0u);
+        for(tax_t i(2); i < 20000; ++i) REQUIRE(kh_val(taxmap, kh_get(p, taxmap, i)) == i / 2);
+        khash_t(name) *names(build_name_hash("__zomg_names__"));
+        REQUIRE(kh_size(names) == 50000);
+        for(unsigned i(0); i < 50000; ++i) {
+            const std::string name("seq" + std::to_string(i));
+            const khiter_t ki(kh_get(name, names, name.data()));
+            REQUIRE(ki != kh_end(names));
+            REQUIRE(kh_val(names, ki) == (i == 7 ? 1u: i % 1000 + 2));
+        }
+        REQUIRE(std::ifstream("__zomg_nodes__.bnscache").good() == !std::getenv("BONSAI_NO_TAX_CACHE"));
+        kh_destroy(p, taxmap);
+        destroy_name_hash(names);
+    }
+    for(const char *path: {"__zomg_nodes__", "__zomg_names__", "__zomg_nodes__.bnscache", "__zomg_names__.bnscache"})
+        std::remove(path);
+}
+
+TEST_CASE("flat taxonomy matches the parent map") {
+    // Dense taxids get a direct lookup table, sparse ones a sorted array.
+    for(const unsigned spread: {2u, 500u}) {
+        std::unordered_map<tax_t, ClassLevel> ranks;
+        tax_t missing;
+        {
+            // Random tree over sparse taxids, with ranks on every other node.
+            std::FILE *fp(std::fopen("__zomg_nodes__", "w"));
+            std::fprintf(fp, "1\t|\t1\t|\tno rank\t|\n");
+            std::mt19937_64 mt(1337);
+            std::vector<tax_t> ids{1};
+            for(unsigned i(0); i < 5000; ++i) {
+                const tax_t id(ids.back() + 1 + mt() % spread), parent(ids[mt() % ids.size()]);
+                std::fprintf(fp, "%u\t|\t%u\t|\t%s\t|\n", id, parent, i & 1 ? "genus": "species");
+                ids.push_back(id);
+                ranks[id] = i & 1 ? ClassLevel::GENUS: ClassLevel::SPECIES;
+            }
+            missing = ids.back() + 1;
+            std::fclose(fp);
+        }
+        khash_t(p) *taxmap(build_parent_map("__zomg_nodes__"));
+        Taxonomy tax(taxmap);
+        tax.load_ranks("__zomg_nodes__");
+        REQUIRE(tax.size() == kh_size(taxmap));
+        LcaCache cache(&tax, 6); // Small enough that entries are evicted.
+        std::mt19937_64 mt(13);
+        for(khiter_t ki(0); ki < kh_end(taxmap); ++ki) {
+            if(!kh_exist(taxmap, ki)) continue;
+            const tax_t a(kh_key(taxmap, ki));
+            REQUIRE(tax.parent(a) == kh_val(taxmap, ki));
+            REQUIRE(node_depth(&tax, a) == node_depth(taxmap, a));
+            REQUIRE(node_dist(&tax, a, 0) == node_depth(taxmap, a));
+            if(a != 1) {
+                REQUIRE(node_dist(&tax, a, 1) == node_dist(taxmap, a, 1));
+                REQUIRE(node_dist(&tax, a, kh_val(taxmap, ki)) == 1);
+                REQUIRE(tax.rank(a) == ranks[a]);
+            }
+            for(unsigned i(0); i < 8; ++i) {
+                khiter_t kj;
+                while(!kh_exist(taxmap, kj = mt() % kh_end(taxmap)));
+                REQUIRE(lca(&tax, a, kh_key(taxmap, kj)) == lca(taxmap, a, kh_key(taxmap, kj)));
+                REQUIRE(cache.lca(kh_key(taxmap, kj), a) == lca(&tax, a, kh_key(taxmap, kj)));
+                REQUIRE(cache.lca(a, kh_key(taxmap, kj)) == lca(&tax, a, kh_key(taxmap, kj)));
+                unsigned depth;
+                REQUIRE(cache.lca(a, kh_key(taxmap, kj), depth) == lca(&tax, a, kh_key(taxmap, kj)));
+                REQUIRE(depth == node_depth(taxmap, lca(taxmap, a, kh_key(taxmap, kj))));
+            }
+        }
+        REQUIRE(tax.rank(1) == ClassLevel::NO_RANK);
+        REQUIRE(tax.parent(missing) == std::numeric_limits<tax_t>::max());
+        kh_destroy(p, taxmap);
+        for(const char *path: {"__zomg_nodes__", "__zomg_nodes__.bnscache"})
+            std::remove(path);
+    }
+}
+
+TEST_CASE("tax depth and feature count maps") {
+    // 1 -> {2 -> 4, 3}
+    khash_t(p) *taxmap(kh_init(p));
+    int khr;
+    for(const auto &pair: std::vector<std::pair<tax_t, tax_t>>{{1, 0}, {2, 1}, {3, 1}, {4, 2}}) {
+        const khiter_t ki(kh_put(p, taxmap, pair.first, &khr));
+        kh_val(taxmap, ki) = pair.second;
+    }
+    const Taxonomy tax(taxmap);
+    khash_t(all) *a(kh_init(all)), *b(kh_init(all));
+    for(const u64 key: {11, 12}) kh_put(all, a, key, &khr);
+    for(const u64 key: {12, 13}) kh_put(all, b, key, &khr);
+    khash_t(64) *td(kh_init(64)), *fc(kh_init(64));
+    for(khash_t(64) *map: {td, fc}) kh_resize(64, map, 16);
+    LcaCache cache(&tax);
+    update_td_map(td, a, cache, 4, 1);
+    update_td_map(td, b, cache, 3, 1);
+    REQUIRE(kh_size(td) == 3);
+    REQUIRE(kh_val(td, kh_get(64, td, 11)) == TDencode(3, 4));
+    REQUIRE(kh_val(td, kh_get(64, td, 12)) == TDencode(1, 1));
+    REQUIRE(kh_val(td, kh_get(64, td, 13)) == TDencode(2, 3));
+    update_feature_counter(fc, a, cache, 4, 1);
+    update_feature_counter(fc, b, cache, 3, 1);
+    REQUIRE(FMtax(kh_val(fc, kh_get(64, fc, 11))) == 4);
+    REQUIRE(FMtax(kh_val(fc, kh_get(64, fc, 12))) == 1);
+    REQUIRE(FMtax(kh_val(fc, kh_get(64, fc, 13))) == 3);
+    // Counts are the number of genomes each kmer was seen in.
+    REQUIRE(FMcount(kh_val(fc, kh_get(64, fc, 11))) == 1);
+    REQUIRE(FMcount(kh_val(fc, kh_get(64, fc, 12))) == 2);
+    REQUIRE(FMcount(kh_val(fc, kh_get(64, fc, 13))) == 1);
+    for(khash_t(64) *map: {td, fc}) kh_destroy(64, map);
+    kh_destroy(all, a);
+    kh_destroy(all, b);
+    kh_destroy(p, taxmap);
+}
+
+TEST_CASE("parallel LCA merge and update match a serial union") {
+    // Random tree over taxids 1..500, with genomes assigned to random taxa.
+    khash_t(p) *taxmap(kh_init(p));
+    int khr;
+    std::mt19937_64 mt(42);
+    khiter_t root(kh_put(p, taxmap, 1, &khr));
+    kh_val(taxmap, root) = 0;
+    for(tax_t i(2); i <= 500; ++i) {
+        const khiter_t ki(kh_put(p, taxmap, i, &khr));
+        kh_val(taxmap, ki) = 1 + mt() % (i - 1);
+    }
+    const Taxonomy tax(taxmap);
+    // Genomes share segments, so many kmers are seen under several taxa.
+    static const char bases[] {'A', 'C', 'G', 'T'};
+    std::vector<std::string> segments(6);
+    for(auto &seg: segments) for(unsigned i(0); i < 20000; ++i) seg.push_back(bases[mt() & 3]);
+    std::vector<std::string> paths;
+    std::vector<tax_t> taxids;
+    {
+        std::FILE *names(std::fopen("__zomg_names__", "w"));
+        for(unsigned i(0); i < 8; ++i) {
+            paths.push_back("__zomg_genome" + std::to_string(i) + ".fa");
+            taxids.push_back(2 + mt() % 499);
+            std::FILE *fp(std::fopen(paths.back().data(), "w"));
+            std::fprintf(fp, ">NC_%06u.1 Genome %u\n%s%s", i, i, segments[i % segments.size()].data(), segments[(i * 5 + 1) % segments.size()].data());
+            for(unsigned j(0); j < 10000; ++j) std::fputc(bases[mt() & 3], fp);
+            std::fputc('\n', fp);
+            std::fclose(fp);
+            std::fprintf(names, "NC_%06u.1\t%u\n", i, taxids.back());
+        }
+        std::fclose(names);
+    }
+    const Spacer sp(31, 31);
+    // Serial reference: each genome's kmers folded in one at a time with the parent map's LCA.
+    auto reference = [&](size_t begin, size_t end) {
+        std::unordered_map<u64, tax_t> ret;
+        khash_t(all) *set(kh_init(all));
+        for(size_t i(begin); i < end; ++i) {
+            kh_clear(all, set);
+            fill_set_genome<score::Lex>(paths[i].data(), sp, set, 0, nullptr, true);
+            for(khiter_t ki(0); ki != kh_end(set); ++ki) {
+                if(!kh_exist(set, ki)) continue;
+                auto it(ret.find(kh_key(set, ki)));
+                if(it == ret.end()) ret.emplace(kh_key(set, ki), taxids[i]);
+                else                it->second = lca(taxmap, it->second, taxids[i]);
+            }
+        }
+        kh_destroy(all, set);
+        return ret;
+    };
+    auto matches = [](const khash_t(c) *map, const std::unordered_map<u64, tax_t> &ref) {
+        if(kh_size(map) != ref.size()) return false;
+        for(khiter_t ki(0); ki != kh_end(map); ++ki) {
+            if(!kh_exist(map, ki)) continue;
+            auto it(ref.find(kh_key(map, ki)));
+            if(it == ref.end() || it->second != kh_val(map, ki)) return false;
+        }
+        return true;
+    };
+    const auto first(reference(0, 4)), later(reference(2, 8)), all(reference(0, 8));
+    REQUIRE(first.size() > (1 << 16)); // More than one merge chunk.
+    for(const int nthreads: {1, 4}) {
+        // Updating in place, starting from a table too small for the new keys.
+        khash_t(c) *map(lca_map<score::Lex>(std::vector<std::string>(paths.begin(), paths.begin() + 4), &tax, "__zomg_names__", sp, nthreads, true, 1 << 10));
+        REQUIRE(matches(map, first));
+        lca_map_update<score::Lex>(map, std::vector<std::string>(paths.begin() + 4, paths.end()), &tax, "__zomg_names__", sp, nthreads, true, 1 << 10);
+        REQUIRE(matches(map, all));
+        kh_destroy(c, map);
+        // Merging overlapping databases.
+        khash_t(c) *dest(lca_map<score::Lex>(std::vector<std::string>(paths.begin(), paths.begin() + 4), &tax, "__zomg_names__", sp, nthreads, true, 1 << 10));
+        khash_t(c) *src(lca_map<score::Lex>(std::vector<std::string>(paths.begin() + 2, paths.end()), &tax, "__zomg_names__", sp, nthreads, true, 1 << 10));
+        REQUIRE(matches(src, later));
+        lca_merge(dest, src, &tax, nthreads);
+        REQUIRE(matches(dest, all));
+        kh_destroy(c, dest);
+        kh_destroy(c, src);
+    }
+    kh_destroy(p, taxmap);
+    for(const auto &path: paths) std::remove(path.data());
+    for(const char *path: {"__zomg_names__", "__zomg_names__.bnscache"})
+        std::remove(path);
+}
+
+TEST_CASE("genome taxids resolve in parallel and are remembered") {
+    std::vector<std::string> paths;
+    {
+        std::FILE *fp(std::fopen("__zomg_names__", "w"));
+        for(unsigned i(0); i < 64; ++i) {
+            paths.push_back("__zomg_genome" + std::to_string(i) + ".fa.gz");
+            gzFile gz(gzopen(paths.back().data(), "wb"));
+            gzprintf(gz, i & 1 ? ">gi|%u|ref|NC_%06u.1| Genome %u\nACGT\n": ">NC_%06u.1 Genome %u\nACGT\n", i, i, i);
+            gzclose(gz);
+            std::fprintf(fp, "NC_%06u.1\t%u\n", i, i + 100);
+        }
+        std::fclose(fp);
+    }
+    khash_t(name) *names(build_name_hash("__zomg_names__"));
+    const std::vector<tax_t> taxids(get_taxids(paths, names, 4));
+    REQUIRE(taxids.size() == paths.size());
+    for(size_t i(0); i < paths.size(); ++i) {
+        REQUIRE(taxids[i] == i + 100);
+        REQUIRE(get_taxid(paths[i].data(), names) == taxids[i]);
+    }
+    // Remembered paths are not reopened.
+    for(const auto &path: paths) std::remove(path.data());
+    REQUIRE(get_taxids(paths, names, 4) == taxids);
+    REQUIRE(tax2genome_map(names, paths, 4).size() == paths.size());
+    destroy_name_hash(names);
+    for(const char *path: {"__zomg_names__", "__zomg_names__.bnscache"})
+        std::remove(path);
+}
+
+namespace {
+// One BGZF block (a gzip member with a 'BC' extra field giving its size) holding data.
+std::string bgzf_block(const char *data, size_t n) {
+    std::string out(n + (n >> 3) + 64, '\0');
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    deflateInit2(&zs, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    zs.next_in = (Bytef *)data, zs.avail_in = n;
+    zs.next_out = (Bytef *)&out[18], zs.avail_out = out.size() - 26;
+    REQUIRE(deflate(&zs, Z_FINISH) == Z_STREAM_END);
+    const size_t clen(zs.total_out);
+    deflateEnd(&zs);
+    const size_t bsize(18 + clen + 8);
+    const unsigned char header[] {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0,
+                                  (unsigned char)((bsize - 1) & 0xFF), (unsigned char)((bsize - 1) >> 8)};
+    std::memcpy(&out[0], header, sizeof(header));
+    const uint32_t crc(crc32(0, (const Bytef *)data, n)), isize(n);
+    std::memcpy(&out[18 + clen], &crc, 4);
+    std::memcpy(&out[18 + clen + 4], &isize, 4);
+    out.resize(bsize);
+    return out;
+}
+std::string gzip_member(const std::string &data) {
+    const char *tmp("__readahead_member__.gz");
+    gzFile fp(gzopen(tmp, "wb"));
+    gzwrite(fp, data.data(), data.size());
+    gzclose(fp);
+    std::string ret;
+    std::FILE *ifp(std::fopen(tmp, "rb"));
+    for(int c; (c = std::fgetc(ifp)) != EOF; ret.push_back(c));
+    std::fclose(ifp);
+    std::remove(tmp);
+    return ret;
+}
+std::string read_all(gzFile fp) {
+    std::string ret, buf(1 << 16, '\0');
+    for(int rc; (rc = gzread(fp, &buf[0], buf.size())) > 0; ret.append(buf.data(), rc));
+    return ret;
+}
+}
+
+TEST_CASE("read-ahead matches gzread") {
+    std::mt19937_64 mt(5);
+    std::string seq;
+    while(seq.size() < (3 << 20)) {
+        seq += ">seq" + std::to_string(seq.size()) + "\n";
+        for(unsigned i(0); i < 4000; ++i) seq.push_back("ACGT"[mt() & 3]);
+        seq.push_back('\n');
+    }
+    std::string bgzf;
+    for(size_t i(0); i < seq.size(); i += 60000) bgzf += bgzf_block(seq.data() + i, std::min(size_t(60000), seq.size() - i));
+    const std::string eof(bgzf_block("", 0)), half(seq.substr(0, seq.size() / 2)), rest(seq.substr(seq.size() / 2));
+    std::string bgzf_half;
+    for(size_t i(0); i < half.size(); i += 60000) bgzf_half += bgzf_block(half.data() + i, std::min(size_t(60000), half.size() - i));
+    const std::vector<std::pair<const char *, std::string>> inputs {
+        {"plain gzip",              gzip_member(seq)},
+        {"bgzf",                    bgzf + eof},
+        {"concatenated gzip",       gzip_member(half) + gzip_member(rest)},
+        {"bgzf then plain gzip",    bgzf_half + gzip_member(rest)},
+        {"truncated bgzf",          bgzf.substr(0, bgzf.size() - 1000)},
+    };
+    const char *path("__readahead__.gz");
+    for(const auto &input: inputs) {
+        INFO(input.first);
+        std::FILE *fp(std::fopen(path, "wb"));
+        std::fwrite(input.second.data(), 1, input.second.size(), fp);
+        std::fclose(fp);
+        gzFile direct(gzopen(path, "rb"));
+        const std::string expected(read_all(direct));
+        gzclose(direct);
+        if(std::strcmp(input.first, "truncated bgzf")) REQUIRE(expected == seq);
+        for(const int nthreads: {1, 4}) {
+            GzReadAhead ra(path, nthreads);
+            REQUIRE(ra.get());
+            REQUIRE(read_all(ra) == expected);
+        }
+    }
+    std::remove(path);
+}